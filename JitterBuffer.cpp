@@ -1,38 +1,214 @@
 #include "JitterBuffer.hh"
 
 #include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <csignal>
 #include <iostream>
+#include <limits>
+#include <new>
 #include <sstream>
+#include <thread>
 #include <type_traits>
+#include <utility>
 #ifdef __APPLE__
 #include <mach/mach.h>
+#elif _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
 #elif _GNU_SOURCE
+#include <linux/mempolicy.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
 #endif
 
 using namespace std::chrono;
 
+#ifdef LIBJITTER_NO_TRACE
+/// @brief Nothing is ever pushed with tracing compiled out, so the rings are left empty.
+constexpr bool TRACING = false;
+#else
+constexpr bool TRACING = true;
+#endif
+
+/// @brief Everything Export sends besides the ring itself. Bump SNAPSHOT_VERSION whenever this or the ring layout changes.
+constexpr std::uint32_t SNAPSHOT_VERSION = 3;
+struct Snapshot {
+  std::uint32_t version;
+  // What the ring was laid out with, checked against the importer's configuration.
+  std::uint64_t element_size;
+  std::uint64_t packet_elements;
+  std::uint64_t header_bytes;
+  std::uint64_t mapped_size;
+  std::uint32_t sequence_mode;
+  std::uint32_t packet_mode;
+  std::uint32_t shared;
+  // Where the writer and reader are, and what lies between them.
+  std::uint64_t read_offset;
+  std::uint64_t write_offset;
+  std::uint64_t written;
+  std::uint64_t written_elements;
+  std::uint32_t play;
+  std::uint32_t has_last_written;
+  std::uint32_t last_written_sequence_number;
+  std::uint32_t next_media_timestamp;
+  std::uint64_t previous_real_offset;
+  std::uint64_t previous_real_elements;
+  std::uint64_t since_previous_real;
+  std::int64_t target_depth_ms;
+  std::int64_t manual_time_ms;
+  std::uint64_t smoothed_depth_elements;
+  std::uint32_t draining;
+  Metrics metrics;
+};
+
+// Concealment can be rewritten by the writer while the reader copies it, so both sides of that copy are atomic,
+// a word at a time where the ring side allows it.
+static void LoadRelaxed(std::uint8_t *destination, const std::uint8_t *source, const std::size_t length) {
+  std::size_t index = 0;
+  if (reinterpret_cast<std::uintptr_t>(source) % std::atomic_ref<std::uint32_t>::required_alignment == 0) {
+    for (; index + sizeof(std::uint32_t) <= length; index += sizeof(std::uint32_t)) {
+      const std::uint32_t word = std::atomic_ref(*reinterpret_cast<std::uint32_t *>(const_cast<std::uint8_t *>(source + index))).load(std::memory_order_relaxed);
+      memcpy(destination + index, &word, sizeof(word));
+    }
+  }
+  for (; index < length; index++) {
+    destination[index] = std::atomic_ref(*const_cast<std::uint8_t *>(source + index)).load(std::memory_order_relaxed);
+  }
+}
+
+static void StoreRelaxed(std::uint8_t *destination, const std::uint8_t *source, const std::size_t length) {
+  std::size_t index = 0;
+  if (reinterpret_cast<std::uintptr_t>(destination) % std::atomic_ref<std::uint32_t>::required_alignment == 0) {
+    for (; index + sizeof(std::uint32_t) <= length; index += sizeof(std::uint32_t)) {
+      std::uint32_t word;
+      memcpy(&word, source + index, sizeof(word));
+      std::atomic_ref(*reinterpret_cast<std::uint32_t *>(destination + index)).store(word, std::memory_order_relaxed);
+    }
+  }
+  for (; index < length; index++) {
+    std::atomic_ref(destination[index]).store(source[index], std::memory_order_relaxed);
+  }
+}
+
+// Compile time widths turn each slice into a single move, and let the compiler vectorise the common channel layouts.
+template<std::size_t Bytes, std::size_t ElementSize = 0>
+static void ScatterFixed(std::uint8_t *destination, const std::size_t stride, const std::uint8_t *source, const std::size_t element_size, const std::size_t elements) {
+  const std::size_t source_stride = ElementSize > 0 ? ElementSize : element_size;
+  for (std::size_t index = 0; index < elements; index++) {
+    memcpy(destination + index * stride, source + index * source_stride, Bytes);
+  }
+}
+
+template<std::size_t Bytes>
+static void ScatterPacked(std::uint8_t *destination, const std::size_t stride, const std::uint8_t *source, const std::size_t element_size, const std::size_t elements) {
+  // Planar output of 2, 4 or 8 channels is the usual case, so those get a fixed source stride too.
+  if (stride == Bytes) {
+    switch (element_size / Bytes) {
+      case 2:
+        return ScatterFixed<Bytes, 2 * Bytes>(destination, Bytes, source, element_size, elements);
+      case 4:
+        return ScatterFixed<Bytes, 4 * Bytes>(destination, Bytes, source, element_size, elements);
+      case 8:
+        return ScatterFixed<Bytes, 8 * Bytes>(destination, Bytes, source, element_size, elements);
+      default:
+        break;
+    }
+  }
+  ScatterFixed<Bytes>(destination, stride, source, element_size, elements);
+}
+
+static void ScatterSlices(std::uint8_t *destination, const std::size_t stride, const std::uint8_t *source, const std::size_t element_size, const std::size_t bytes, const std::size_t elements) {
+  if (bytes == element_size && stride == element_size) {
+    // Whole elements, packed, is just a copy.
+    memcpy(destination, source, elements * element_size);
+    return;
+  }
+  switch (bytes) {
+    case 2:
+      return ScatterPacked<2>(destination, stride, source, element_size, elements);
+    case 4:
+      return ScatterPacked<4>(destination, stride, source, element_size, elements);
+    case 8:
+      return ScatterPacked<8>(destination, stride, source, element_size, elements);
+    default:
+      for (std::size_t index = 0; index < elements; index++) {
+        memcpy(destination + index * stride, source + index * element_size, bytes);
+      }
+  }
+}
+
+JitterBuffer::JitterBuffer(const std::size_t element_size,
+                           const std::size_t packet_elements,
+                           const std::uint32_t clock_rate,
+                           const milliseconds max_length,
+                           const milliseconds min_length,
+                           const cantina::LoggerPointer &logger,
+                           const JitterBufferOptions &options)
+    : JitterBuffer(element_size, packet_elements, clock_rate, max_length, min_length, logger, options, nullptr, 0) {}
+
 JitterBuffer::JitterBuffer(const std::size_t element_size,
                            const std::size_t packet_elements,
                            const std::uint32_t clock_rate,
                            const milliseconds max_length,
                            const milliseconds min_length,
-                           const cantina::LoggerPointer &logger)
+                           const cantina::LoggerPointer &logger,
+                           const JitterBufferOptions &options,
+                           std::uint8_t *ring,
+                           const std::size_t ring_size)
     : logger(std::make_shared<cantina::Logger>("JTTR", logger)),
       element_size(element_size),
       packet_elements(packet_elements),
       clock_rate(clock_rate),
       min_length(min_length),
       max_length(max_length),
-      read_offset(0),
+      drain_depth(options.drain_depth),
+      drain_rate(options.drain_rate),
+      clock(options.clock),
+      depth_mode(options.depth),
+      depth_percentile(options.depth_percentile),
+      sequence_mode(options.sequence),
+      packet_mode(options.packets),
+      min_packet_elements(MinPacketElements(packet_elements, clock_rate, options.packets)),
+      owns_buffer(ring == nullptr),
+      payload_alignment(options.payload_alignment),
+      vm_user_data(nullptr),
+      state(&local_state),
+      state_bytes(0),
+      manual_time_ms(0),
+      event_armed(false),
+      event_fd(-1),
+      write_position(0),
+      taps(options.taps),
       write_offset(0),
-      written(0),
-      written_elements(0) {
-  memset(&metrics, 0, sizeof(metrics));
-
+      writer_metrics_version(0),
+      writer_trace(TRACING ? options.trace_capacity : 0),
+      previous_real_offset(0),
+      previous_real_elements(0),
+      since_previous_real(0),
+      arrival_delays_count(0),
+      arrival_delays_next(0),
+      arrival_position(0),
+      next_media_timestamp(0),
+      read_offset(0),
+      peeked_spans(0),
+      peeked_elements(0),
+      smoothed_depth_elements(0),
+      draining(false),
+      waiting_elements(0),
+      reader_metrics_version(0),
+      reader_trace(TRACING ? options.trace_capacity : 0),
+      trace_dropped_logged(0) {
   // Max size needs to be >0.
   if (max_length.count() <= 0) {
     throw std::invalid_argument("Max length must be >0");
@@ -44,26 +220,129 @@ JitterBuffer::JitterBuffer(const std::size_t element_size,
     throw std::invalid_argument("Packets should be at least 1ms.");
   }
 
+  // Payloads, and so records, must stay aligned across the wrap.
+  if (!std::has_single_bit(payload_alignment) || payload_alignment < alignof(Header) || payload_alignment > 4096) {
+    throw std::invalid_argument("Payload alignment must be a power of two between alignof(Header) and 4096");
+  }
+  if (packet_elements >= (std::size_t{1} << (32 - Header::CONSUMED_SHIFT))) {
+    throw std::invalid_argument("Too many elements per packet");
+  }
+  header_bytes = (METADATA_SIZE + payload_alignment - 1) & ~(payload_alignment - 1);
+  if (drain_depth.count() < 0 || drain_rate < 0) {
+    throw std::invalid_argument("Drain depth and rate can't be negative");
+  }
+  if (options.depth == DepthMode::Adaptive && (options.depth_window == 0 || depth_percentile < 0 || depth_percentile > 1)) {
+    throw std::invalid_argument("Adaptive depth needs a window of at least 1 and a percentile in [0, 1]");
+  }
+#if !defined(_GNU_SOURCE) || LIBJITTER_LINEAR_RING
+  if (options.shared) {
+    throw std::invalid_argument("Sharing a buffer needs the mirrored ring on Linux");
+  }
+#endif
+  if (options.shared && !owns_buffer) {
+    throw std::invalid_argument("Only a buffer that maps its own ring can be shared");
+  }
+  if (options.shared && options.taps > 0) {
+    // Taps are found through this object, which the other process doesn't have.
+    throw std::invalid_argument("A shared buffer can't have taps");
+  }
+  local_state.target_depth_ms = min_length.count();
+
   // Ensure atomic variables are lock free.
-  static_assert(std::is_same<decltype(written), std::atomic<std::size_t>>::value);
-  static_assert(std::is_same<decltype(written_elements), std::atomic<std::size_t>>::value);
+  static_assert(std::is_same<decltype(state->written), std::atomic<std::size_t>>::value);
+  static_assert(std::is_same<decltype(state->written_elements), std::atomic<std::size_t>>::value);
   static_assert(std::atomic<std::size_t>::is_always_lock_free);
+  static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+  static_assert(std::atomic<std::int64_t>::is_always_lock_free && std::atomic<bool>::is_always_lock_free);
 
   // VM Address trick for automatic wrap around.
-  const std::size_t buffer_size = max_length.count() * (clock_rate / 1000) * (element_size + METADATA_SIZE);
-  max_size_bytes = buffer_size;
-#if _GNU_SOURCE
-  vm_user_data = calloc(1, sizeof(int));
+  max_size_bytes = CalculateBufferSize(element_size, min_packet_elements, clock_rate, max_length, options.sizing, RecordSize(min_packet_elements));
+  if (owns_buffer) {
+    buffer = reinterpret_cast<std::uint8_t *>(MakeVirtualMemory(max_size_bytes, RecordSize(packet_elements), vm_user_data, options));
+#if !LIBJITTER_LINEAR_RING
+    // A linear ring is on the heap, where mbind would move whatever else shares its pages.
+    if (options.numa_node >= 0 && !BindToNode(buffer, max_size_bytes, options.numa_node)) {
+      this->logger->warning << "Failed to bind buffer to NUMA node " << options.numa_node << std::flush;
+    }
+#endif
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+    if (options.shared) {
+      // The state goes in the same file, in its own page after the ring, so one descriptor carries everything.
+      int fd;
+      memcpy(&fd, vm_user_data, sizeof(fd));
+      state_bytes = RoundToPage(sizeof(SharedState), options.hugetlb);
+      state = MapSharedState(fd, max_size_bytes, state_bytes, true);
+      if (state == nullptr) {
+        FreeVirtualMemory(buffer, max_size_bytes, vm_user_data);
+        throw std::runtime_error("Failed to map shared state");
+      }
+      state->target_depth_ms = min_length.count();
+    }
+#endif
+  } else {
+    // Someone else mapped this for us, e.g. a pool.
+    max_size_bytes = RoundToPage(max_size_bytes, options.hugetlb);
+    if (ring_size != max_size_bytes) {
+      throw std::invalid_argument("Provided ring doesn't match the size this configuration needs");
+    }
+    buffer = ring;
+  }
+
+  // Scratch for concealment descriptors, enough for a full buffer of the smallest packets.
+  const std::size_t max_packets = max_size_bytes / RecordSize(min_packet_elements);
+  concealment_packets.resize(max_packets);
+
+  // Sequence number to header lookup, covering every packet the buffer can hold.
+  sequence_index.resize(std::bit_ceil(max_packets + 1));
+  sequence_index_mask = sequence_index.size() - 1;
+
+  // Somewhere to settle concealment that might be changing before DequeueV scatters it.
+  scatter_scratch.resize(packet_elements * element_size);
+
+  // Recent arrivals for estimating jitter.
+  if (depth_mode == DepthMode::Adaptive) {
+    arrival_delays.resize(options.depth_window);
+    arrival_delays_scratch.resize(options.depth_window);
+  }
+
+  // Headers are always written before they're read, so touching the ring is only to take the page faults now.
+  switch (options.populate) {
+    case PopulateMode::Eager:
+      memset(buffer, 0, max_size_bytes);
+      break;
+    case PopulateMode::Prefault:
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+      // Pages have to be faulted after binding to land on the node, so that's left to here.
+      if (options.numa_node >= 0) {
+        memset(buffer, 0, max_size_bytes);
+      }
+#else
+      memset(buffer, 0, max_size_bytes);
 #endif
-  buffer = reinterpret_cast<std::uint8_t *>(MakeVirtualMemory(max_size_bytes, vm_user_data));
+      break;
+    case PopulateMode::Lazy:
+      break;
+  }
 
   // Done.
-  memset(buffer, 0, max_size_bytes);
   last_written_sequence_number.reset();
   logger->debug << "Allocated JitterBuffer with: " << max_size_bytes << " bytes" << std::flush;
 }
 
 JitterBuffer::~JitterBuffer() {
+#ifdef _GNU_SOURCE
+  if (event_fd >= 0) {
+    close(event_fd);
+  }
+#endif
+  if (!owns_buffer) {
+    return;
+  }
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+  if (state_bytes > 0) {
+    munmap(state, state_bytes);
+  }
+#endif
   try {
     FreeVirtualMemory(buffer, max_size_bytes, vm_user_data);
   } catch (...) {
@@ -72,93 +351,295 @@ JitterBuffer::~JitterBuffer() {
 }
 
 std::size_t JitterBuffer::Prepare(const std::uint32_t sequence_number, const ConcealmentCallback &concealment_callback) {
+  return Prepare(sequence_number, &InvokeConcealmentCallback, const_cast<ConcealmentCallback *>(&concealment_callback));
+}
+
+std::size_t JitterBuffer::Prepare(const std::uint32_t sequence_number, const ConcealmentFunction concealment_callback, void *user_data) {
+  if (reserved_sequence_number.has_value()) {
+    throw std::logic_error("Prepare called between Reserve and CommitWrite");
+  }
+  const MetricsUpdate metrics_update(writer_metrics_version);
   if (!last_written_sequence_number.has_value()) {
     // Nothing to do.
     return 0;
   }
 
-  const unsigned long last = last_written_sequence_number.value();
-  if (sequence_number <= last) {
+  const std::int32_t distance = SequenceDistance(ExtendSequence(sequence_number), last_written_sequence_number.value());
+  if (distance <= 0) {
     // Might be an update, nothing to do.
     return 0;
   }
 
-  if (sequence_number == last + 1) {
+  if (distance == 1) {
     // This is the next packet, nothing to do.
     return 0;
   }
 
   // In all other cases, we're missing packets.
-  const std::size_t missing_packets = sequence_number - last - 1;
-  const std::size_t concealed_frames = GenerateConcealment(missing_packets, concealment_callback);
-  this->metrics.concealed_frames += concealed_frames;
+  const std::size_t missing_packets = distance - 1;
+  const std::size_t concealed_frames = GenerateConcealment(missing_packets, Now(), concealment_callback, user_data, true);
+  writer_metrics.concealed_frames.Add(concealed_frames);
   return concealed_frames;
 }
 
 std::size_t JitterBuffer::Enqueue(const std::vector<Packet> &packets, const ConcealmentCallback &concealment_callback) {
-  std::size_t enqueued = 0;
+  return Enqueue(packets.data(), packets.size(), &InvokeConcealmentCallback, const_cast<ConcealmentCallback *>(&concealment_callback));
+}
 
-  for (const Packet &packet: packets) {
-    // TODO: Handle sequence rollover.
-    if (packet.sequence_number <= last_written_sequence_number) {
-      // This might be an update for an existing concealment packet.
-      // Update it and continue on.
-      enqueued += Update(packet);
-      continue;
-    } else if (last_written_sequence_number.has_value() && packet.sequence_number != last_written_sequence_number) {
-      const std::size_t last = last_written_sequence_number.value();
-      const std::size_t missing = packet.sequence_number - last - 1;
-      if (missing > 0) {
-        const auto concealed = GenerateConcealment(missing, concealment_callback);
-        enqueued += concealed;
-        this->metrics.concealed_frames += concealed;
-      }
-    }
+/// @brief Where a contiguous concealment run goes, for InvokeContiguousConcealment.
+struct ContiguousConcealment {
+  JitterBuffer::ContiguousConcealmentFunction callback;
+  void *user_data;
+  JitterBuffer *buffer;
+};
 
-    // Enqueue this packet of real data.
-    if (packet.elements != packet_elements) {
-      std::ostringstream message;
-      message << "Supplied packet elements must match declared number of elements. Got: " << packet.elements << ", expected: " << packet_elements;
-      throw std::invalid_argument(message.str());
-    }
-    const std::size_t enqueued_elements = CopyIntoBuffer(packet);
-    if (enqueued_elements == 0 && packet.elements > 0) {
-      // There's no more space.
-      logger->warning << "Enqueue has no more space. This packet will be lost " << packet.sequence_number << std::flush;
-      break;
-    }
-    enqueued += enqueued_elements;
-    last_written_sequence_number = packet.sequence_number;
-  }
+std::size_t JitterBuffer::Prepare(const std::uint32_t sequence_number, const ContiguousConcealmentFunction concealment_callback, void *user_data) {
+  ContiguousConcealment contiguous = {.callback = concealment_callback, .user_data = user_data, .buffer = this};
+  return Prepare(sequence_number, &InvokeContiguousConcealment, &contiguous);
+}
+
+std::size_t JitterBuffer::Enqueue(const Packet *packets, const std::size_t num_packets, const ContiguousConcealmentFunction concealment_callback, void *user_data) {
+  ContiguousConcealment contiguous = {.callback = concealment_callback, .user_data = user_data, .buffer = this};
+  return Enqueue(packets, num_packets, &InvokeContiguousConcealment, &contiguous);
+}
 
+std::size_t JitterBuffer::Enqueue(const Packet *packets, const std::size_t num_packets, const ConcealmentFunction concealment_callback, void *user_data) {
+  return EnqueuePackets(packets, num_packets, concealment_callback, user_data, [this](std::uint8_t *destination, const Packet &packet) {
+    memcpy(destination, packet.data, packet.elements * element_size);
+  });
+}
+
+std::size_t JitterBuffer::FillToTarget(const std::uint64_t now_ms, const ConcealmentFunction concealment_callback, void *user_data) {
   // Now that we've written, check the fill level.
-  // If it's below the min fill level, we need to conceal.
-  const milliseconds gap_to_min = min_length - GetCurrentDepth();
-  if (play && gap_to_min.count() > 0) {
+  // If it's below the target fill level, we need to conceal.
+  std::size_t enqueued = 0;
+  UpdateTargetDepth();
+  const milliseconds gap_to_min = GetTargetDepth() - GetCurrentDepth();
+  if (state->play && gap_to_min.count() > 0) {
     // How many packets would cover this gap?
-    const milliseconds each_packet = milliseconds(packet_elements * 1000 / clock_rate.count());
+    const milliseconds each_packet = milliseconds(ConcealmentElements() * 1000 / clock_rate.count());
     assert(each_packet.count() > 0);
     const std::size_t to_conceal = std::ceil((float) gap_to_min.count() / (float) each_packet.count());
-    const auto concealed = GenerateConcealment(to_conceal, concealment_callback);
+    // Adaptive fill sits in front of the packets to come rather than standing in for them, so it adds latency.
+    const auto concealed = GenerateConcealment(to_conceal, now_ms, concealment_callback, user_data, depth_mode == DepthMode::Fixed);
     enqueued += concealed;
-    this->metrics.filled_packets = concealed;
+    writer_metrics.filled_packets.Add(concealed);
   }
 
-  // If we're waiting to play, is it time to play?
-  if (!play && GetCurrentDepth() >= min_length * 1.5) {
-    play = true;
+  UpdatePlayState();
+  return enqueued;
+}
+
+std::uint8_t *JitterBuffer::Reserve(const std::uint32_t given_sequence_number) {
+  if (reserved_sequence_number.has_value()) {
+    throw std::logic_error("Reserve called again before CommitWrite");
+  }
+  const MetricsUpdate metrics_update(writer_metrics_version);
+  const std::uint32_t sequence_number = ExtendSequence(given_sequence_number);
+  if (last_written_sequence_number.has_value() && SequenceDistance(sequence_number, last_written_sequence_number.value()) <= 0) {
+    // Updates to existing packets have to go through Enqueue.
+    return nullptr;
   }
+  const std::uint64_t now_ms = Now();
+  TrackArrival(sequence_number, packet_elements, now_ms);
+  // A reserved packet's media time isn't known, so it's assumed to follow on.
+  std::uint8_t *destination = WriteHeader(sequence_number, packet_elements, next_media_timestamp, now_ms);
+  if (destination == nullptr) {
+    Trace(writer_trace, JITTER_TRACE_FULL_DROPPED, sequence_number);
+    writer_metrics.full_dropped_packets.Add(1);
+    return nullptr;
+  }
+  reserved_sequence_number = sequence_number;
+  return destination;
+}
+
+std::size_t JitterBuffer::CommitWrite() {
+  return CommitWrite(packet_elements);
+}
 
+std::size_t JitterBuffer::CommitWrite(const std::size_t elements) {
+  if (!reserved_sequence_number.has_value()) {
+    return 0;
+  }
+  CheckPacketElements(elements);
+  const MetricsUpdate metrics_update(writer_metrics_version);
+  // Space was reserved for the largest packet, so a shorter one always fits.
+  HeaderAt(write_offset)->elements = static_cast<std::uint32_t>(elements);
+  const std::size_t enqueued = PublishPacket(elements);
+  writer_metrics.enqueued_bytes.Add(elements * element_size);
+  last_written_sequence_number = reserved_sequence_number;
+  reserved_sequence_number.reset();
+  UpdateTargetDepth();
+  UpdatePlayState();
   return enqueued;
 }
 
+void JitterBuffer::UpdatePlayState() {
+  // If we're waiting to play, is it time to play?
+  if (!state->play && GetCurrentDepth() >= GetTargetDepth() * 1.5) {
+    state->play = true;
+    // What was published already may only now be readable.
+    NotifyWrite();
+  }
+}
+
 std::size_t JitterBuffer::Dequeue(std::uint8_t *destination, const std::size_t &destination_length, const std::size_t &elements) {
+  const MetricsUpdate metrics_update(reader_metrics_version);
+  if (!state->play) {
+    return 0;
+  }
+  CheckDestination(destination_length, elements);
+
+  return DequeueFront(elements, elements, [this, destination](Header *header, const std::size_t consumed, const std::size_t to_dequeue, const std::size_t dequeued_elements) {
+    ReadFront(header, destination + dequeued_elements * element_size, consumed, to_dequeue);
+  });
+}
+
+std::size_t JitterBuffer::Dequeue(std::uint8_t *destination, const std::size_t destination_length, const std::size_t elements, const StretchFunction stretch, void *user_data) {
+  // Drain from past drain_depth all the way back to the target, so this doesn't flap at the threshold.
+  // Surplus is what would still be above the target after this read.
+  const std::size_t depth_elements = state->written_elements;
+  const std::size_t target_elements = GetTargetElements() + elements;
+  const std::size_t surplus = depth_elements > target_elements ? depth_elements - target_elements : 0;
+  if (drain_depth.count() > 0 && GetCurrentDepth() > drain_depth) {
+    draining = true;
+  } else if (surplus == 0) {
+    draining = false;
+  }
+  if (!state->play || !draining || surplus == 0) {
+    return Dequeue(destination, destination_length, elements);
+  }
 
-  if (!play) {
+  const MetricsUpdate metrics_update(reader_metrics_version);
+  CheckDestination(destination_length, elements);
+
+  // Take a little more than asked for, never past the target.
+  const std::size_t extra = std::min(static_cast<std::size_t>(std::ceil(elements * drain_rate)), surplus);
+  const std::size_t input_bytes = (elements + extra) * element_size;
+  if (drain_scratch.size() < input_bytes) {
+    drain_scratch.resize(input_bytes);
+  }
+  const std::size_t input = DequeueFront(elements + extra, elements, [this](Header *header, const std::size_t consumed, const std::size_t to_dequeue, const std::size_t dequeued_elements) {
+    ReadFront(header, drain_scratch.data() + dequeued_elements * element_size, consumed, to_dequeue);
+  });
+  if (input <= elements) {
+    // Nothing to spare after all.
+    memcpy(destination, drain_scratch.data(), input * element_size);
+    return input;
+  }
+  stretch(drain_scratch.data(), input, destination, elements, element_size, user_data);
+  reader_metrics.accelerated_frames.Add(input - elements);
+  return elements;
+}
+
+void JitterBuffer::StretchPcm16(const std::uint8_t *input, const std::size_t input_elements, std::uint8_t *output, const std::size_t output_elements, const std::size_t element_size, void *) {
+  const std::size_t channels = element_size / sizeof(std::int16_t);
+  const std::size_t removed = input_elements - output_elements;
+  const std::size_t fade = output_elements / 2;
+  if (channels == 0 || element_size % sizeof(std::int16_t) != 0 || fade == 0) {
+    // Not PCM16, or too short to fade, so just lose the end.
+    memcpy(output, input, output_elements * element_size);
+    return;
+  }
+  const auto sample = [input, channels](const std::size_t element, const std::size_t channel) {
+    std::int16_t value;
+    memcpy(&value, input + (element * channels + channel) * sizeof(value), sizeof(value));
+    return static_cast<float>(value);
+  };
+  const auto mono = [&sample, channels](const std::size_t element) {
+    float sum = 0;
+    for (std::size_t channel = 0; channel < channels; channel++) {
+      sum += sample(element, channel);
+    }
+    return sum;
+  };
+
+  // Output is input up to the splice, a fade from there into input removed elements later, then the rest of that.
+  // The splice goes where the two overlapping stretches are most alike, so the fade doesn't beat. A coarse search
+  // over the channels' sum is plenty for that, and keeps this cheap enough for the audio thread.
+  const std::size_t window = std::min<std::size_t>(fade, 32);
+  const std::size_t step = 4;
+  std::size_t splice = 0;
+  float best = -std::numeric_limits<float>::infinity();
+  for (std::size_t candidate = 0; candidate + fade <= output_elements; candidate += step) {
+    float correlation = 0;
+    float energy = 0;
+    for (std::size_t element = 0; element < window; element++) {
+      const float later = mono(candidate + removed + element);
+      correlation += mono(candidate + element) * later;
+      energy += later * later;
+    }
+    const float score = energy > 0 ? correlation / std::sqrt(energy) : 0;
+    if (score > best) {
+      best = score;
+      splice = candidate;
+    }
+  }
+
+  memcpy(output, input, splice * element_size);
+  for (std::size_t element = 0; element < fade; element++) {
+    const float weight = static_cast<float>(element) / static_cast<float>(fade);
+    for (std::size_t channel = 0; channel < channels; channel++) {
+      const float mixed = sample(splice + element, channel) * (1 - weight) + sample(splice + removed + element, channel) * weight;
+      const float clamped = std::clamp(mixed, -32768.0f, 32767.0f);
+      const auto value = static_cast<std::int16_t>(clamped + (clamped < 0 ? -0.5f : 0.5f));
+      memcpy(output + ((splice + element) * channels + channel) * sizeof(value), &value, sizeof(value));
+    }
+  }
+  const std::size_t tail = splice + fade;
+  memcpy(output + tail * element_size, input + (tail + removed) * element_size, (output_elements - tail) * element_size);
+}
+
+void JitterBuffer::CheckDestination(const std::size_t destination_length, const std::size_t elements) const {
+  const std::size_t required_bytes = elements * element_size;
+  if (destination_length < required_bytes) {
+    std::ostringstream message;
+    message << "Provided buffer too small. Was: " << destination_length << ", need: " << required_bytes;
+    throw std::invalid_argument(message.str());
+  }
+}
+
+std::size_t JitterBuffer::DequeueV(const ScatterSpan *spans, const std::size_t num_spans, const std::size_t elements) {
+  const MetricsUpdate metrics_update(reader_metrics_version);
+  if (!state->play) {
+    return 0;
+  }
+
+  // Check every slice fits in its element, and every destination is big enough.
+  for (const ScatterSpan *span = spans; span != spans + num_spans; span++) {
+    if (span->bytes == 0 || span->offset + span->bytes > element_size || span->stride < span->bytes) {
+      std::ostringstream message;
+      message << "Scatter span must take 1 to " << element_size << " bytes from within an element, with a stride of at least that. Got offset: "
+              << span->offset << ", bytes: " << span->bytes << ", stride: " << span->stride;
+      throw std::invalid_argument(message.str());
+    }
+    const std::size_t required_bytes = elements > 0 ? (elements - 1) * span->stride + span->bytes : 0;
+    if (span->destination_length < required_bytes) {
+      std::ostringstream message;
+      message << "Provided buffer too small. Was: " << span->destination_length << ", need: " << required_bytes;
+      throw std::invalid_argument(message.str());
+    }
+  }
+
+  return DequeueFront(elements, elements, [this, spans, num_spans](Header *header, const std::size_t consumed, const std::size_t to_dequeue, const std::size_t dequeued_elements) {
+    // Real data never changes, so can be scattered straight from the ring. Concealment is settled into scratch first.
+    const std::uint8_t *source = PayloadAt(read_offset) + consumed * element_size;
+    if (header->IsConcealment()) {
+      ReadFront(header, scatter_scratch.data(), consumed, to_dequeue);
+      source = scatter_scratch.data();
+    }
+    for (const ScatterSpan *span = spans; span != spans + num_spans; span++) {
+      ScatterSlices(span->destination + dequeued_elements * span->stride, span->stride, source + span->offset, element_size, span->bytes, to_dequeue);
+    }
+  });
+}
+
+std::size_t JitterBuffer::DequeueAt(const std::uint32_t media_timestamp, std::uint8_t *destination, const std::size_t destination_length, const std::size_t elements) {
+  if (!state->play) {
     return 0;
   }
 
-  // Check the destination buffer is big enough.
+  // Check the destination buffer is big enough before anything is thrown away.
   const std::size_t required_bytes = elements * element_size;
   if (destination_length < required_bytes) {
     std::ostringstream message;
@@ -166,335 +647,1217 @@ std::size_t JitterBuffer::Dequeue(std::uint8_t *destination, const std::size_t &
     throw std::invalid_argument(message.str());
   }
 
-  std::size_t dequeued_bytes = 0;
-  std::size_t destination_offset = 0;
-  while (dequeued_bytes < required_bytes) {
-    // Check there's space for a header.
-    if (written < METADATA_SIZE) {
-      return dequeued_bytes / element_size;
+  {
+    const MetricsUpdate metrics_update(reader_metrics_version);
+    if (!SeekFront(media_timestamp, Now())) {
+      return 0;
     }
+  }
+  return Dequeue(destination, destination_length, elements);
+}
 
-    // Get the header.
-    Header header{};
-    [[maybe_unused]] const std::size_t copied = CopyOutOfBuffer((std::uint8_t *) &header, METADATA_SIZE, METADATA_SIZE, true);
-    assert(copied == METADATA_SIZE);
-    assert(header.elements > 0);
+bool JitterBuffer::SeekFront(const std::uint32_t media_timestamp, const std::uint64_t now_ms) {
+  ReleasePeeked(read_offset);
+  std::size_t seeked = 0;
+  bool reached = false;
+  while (Header *header = GetReadableFront(now_ms)) {
+    const std::size_t consumed = header->Consumed();
+    const std::int32_t behind = SequenceDistance(media_timestamp, static_cast<std::uint32_t>(header->media_timestamp + consumed));
+    if (behind <= 0) {
+      // Already there, or the data starts later and the caller's early.
+      reached = behind == 0;
+      break;
+    }
 
-    // If this is concealement, check the use flag.
-    if (header.concealment && header.in_use.test_and_set(std::memory_order::acquire)) {
-      // This packet is currently being updated from concealment data to real data.
-      // It's not safe for us to read it - skip to the next available packet.
-      logger->warning << "[" << header.sequence_number << "] Dequeue: Can't read concealment packet because it's being updated." << std::flush;
-      ForwardRead(header.elements * element_size);
-      continue;
+    // Step over whole packets without reading them, and into the one the media time falls in.
+    const std::size_t remaining = header->elements - consumed;
+    const std::size_t skip = std::min(static_cast<std::size_t>(behind), remaining);
+    ConsumeFront(header, skip);
+    seeked += skip;
+    if (skip < remaining) {
+      reached = true;
+      break;
     }
+  }
+  // Running out first means the media time isn't here yet.
+  state->written_elements -= seeked;
+  reader_metrics.seeked_frames.Add(seeked);
+  return reached;
+}
+
+Header *JitterBuffer::GetReadableFront(const std::uint64_t now_ms) {
+  // Check there's space for a header.
+  while (state->written >= header_bytes) {
+    Header *header = HeaderAt(read_offset);
+    assert(header->elements > 0);
+    const std::size_t remaining = header->elements - header->Consumed();
+    assert(remaining > 0);
 
-    const std::uint64_t now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-    const std::uint64_t age = now_ms - header.timestamp;
-    if (age >= static_cast<std::uint64_t>(max_length.count())) {
+    if (IsExpired(header, now_ms)) {
       // It's too old, throw this away and run to the next.
-      assert(header.elements <= packet_elements);
-      ForwardRead(header.elements * element_size);
-      skipped_frames += header.elements;
+      assert(header->elements <= packet_elements);
+      reader_metrics.skipped_frames.Add(remaining);
+      state->written_elements -= remaining;
+      ForwardRead(RecordSize(header->elements));
       continue;
     }
 
-    // Get as much real data as we can.
-    const std::size_t available_bytes = header.elements * element_size;
-    const std::size_t available_or_space = std::min(available_bytes, destination_length - destination_offset);
-    const std::size_t remaining_required_bytes = required_bytes - destination_offset;
-    const std::size_t to_dequeue = std::min(available_or_space, remaining_required_bytes);
-    const std::size_t bytes_dequeued = CopyOutOfBuffer(destination + destination_offset, destination_length - destination_offset, to_dequeue, true);
-    assert(bytes_dequeued <= to_dequeue);      // We shouldn't get more than we asked for.
-    assert(bytes_dequeued > 0);                // Because we got a header, we should get *something*.
-    assert(bytes_dequeued % element_size == 0);// We should only get whole elements out.
-    destination_offset += bytes_dequeued;
-    [[maybe_unused]] const std::size_t originally_available = header.elements;
-    bool clear_header = true;
-    if (bytes_dequeued < available_bytes) {
-      // We didn't fully empty a packet, update the header to reflect what's left.
-      UnwindRead(METADATA_SIZE);
-      const std::size_t remaining_bytes = available_bytes - bytes_dequeued;
-      assert(remaining_bytes % element_size == 0);// We should only get whole elements.
-      header.elements = remaining_bytes / element_size;
-      assert(header.elements > 0);
-      if (header.concealment) {
-        clear_header = false;
-        header.in_use.clear(std::memory_order::release);
-      }
-      memcpy(buffer + read_offset, &header, METADATA_SIZE);
-
-      // We need to update the next header's previous elements too.
-      if (written >= (METADATA_SIZE * 2) + header.elements * element_size) {
-        std::size_t next_header_offset = (read_offset + METADATA_SIZE + header.elements * element_size) % max_size_bytes;
-        Header *next_header = reinterpret_cast<Header *>(buffer + next_header_offset);
-        assert(next_header->sequence_number == header.sequence_number + 1);
-        if (next_header->in_use.test_and_set(std::memory_order::acquire)) {
-          // We can't alter this packet so we'll have to signal the walk to stop here in the future.
-          logger->error << "[" << header.sequence_number << "] [" << next_header->sequence_number << "] Dequeue: Can't update next header because it's being updated. Walks will stop here." << std::flush;
-          dont_walk_beyond = next_header->sequence_number;
-        } else {
-          // Update the next header for future walkers.
-          next_header->previous_elements = header.elements;
-          next_header->in_use.clear(std::memory_order::release);
-        }
-      }
+    if (depth_mode == DepthMode::Adaptive && header->IsConcealment() && smoothed_depth_elements >= GetTargetElements() + 2 * remaining) {
+      // We've been more than a packet further behind than the network needs for a while, so drop made up data to catch up.
+      smoothed_depth_elements -= remaining;
+      reader_metrics.dropped_frames.Add(remaining);
+      state->written_elements -= remaining;
+      ForwardRead(RecordSize(header->elements));
+      continue;
+    }
+    return header;
+  }
+  return nullptr;
+}
+
+void JitterBuffer::ReadFront(Header *header, std::uint8_t *destination, const std::size_t consumed, const std::size_t elements) {
+  if (CopyRecord(header, destination, PayloadAt(read_offset) + consumed * element_size, elements * element_size)) {
+    Trace(reader_trace, JITTER_TRACE_READ_CONTENDED, header->sequence_number);
+    reader_metrics.contended_claims.Add(1);
+  }
+}
+
+bool JitterBuffer::CopyRecord(Header *header, std::uint8_t *destination, const std::uint8_t *source, const std::size_t length) {
+  bool contended = false;
+  std::uint32_t before = header->state.load(std::memory_order_acquire);
+  while (before & Header::CONCEALMENT) {
+    if (before & Header::WRITING) {
+      // Real data is partway in, and the writer never blocks while copying one packet.
+      before = header->state.load(std::memory_order_acquire);
+      continue;
     }
 
-    if (header.concealment && clear_header) {
-      header.in_use.clear(std::memory_order::release);
+    // Copy the concealment, keeping it only if nothing was written over it meanwhile.
+    // An update happens at most once, so this goes again at most once, and then copies real data.
+    LoadRelaxed(destination, source, length);
+    const std::uint32_t after = header->state.fetch_add(0, std::memory_order_release);
+    if (!((before ^ after) & (Header::CONCEALMENT | Header::WRITING))) {
+      return contended;
     }
-    [[maybe_unused]] const std::size_t dequeued_elements = bytes_dequeued / element_size;
-    assert(dequeued_elements <= originally_available);// We should not get more than available.
-    dequeued_bytes += bytes_dequeued;
+    contended = true;
+    before = after;
   }
+  // Real data is never rewritten.
+  memcpy(destination, source, length);
+  return contended;
+}
 
-  assert(dequeued_bytes % element_size == 0);// We should only get whole elements.
-  const std::size_t dequeued_elements = dequeued_bytes / element_size;
-  assert(dequeued_elements <= elements);// We should not get more than asked for.
-  written_elements -= dequeued_elements;
-  return dequeued_elements;
+void JitterBuffer::ConsumeFront(Header *header, const std::size_t elements) {
+  // Headers stay where they were written, partial reads are tracked in the header.
+  const std::size_t consumed = header->Consumed() + elements;
+  assert(consumed <= header->elements);
+  if (consumed < header->elements) {
+    header->state.fetch_add(static_cast<std::uint32_t>(elements) << Header::CONSUMED_SHIFT, std::memory_order_relaxed);
+  }
+  const std::size_t packet_bytes = RecordSize(header->elements);
+  header->Unpin();
+  if (consumed == header->elements) {
+    ForwardRead(packet_bytes);
+  }
 }
 
-std::size_t JitterBuffer::GenerateConcealment(const std::size_t packets, const ConcealmentCallback &callback) {
+std::size_t JitterBuffer::Peek(const std::size_t elements, Packet *spans, const std::size_t max_spans) {
+  const MetricsUpdate metrics_update(reader_metrics_version);
+  // Anything still held from a previous peek is given back first.
+  ReleasePeeked(read_offset);
+
+  if (!state->play || elements == 0 || max_spans == 0) {
+    return 0;
+  }
+
+  // Expired or in-update packets at the front are dropped, as in Dequeue.
+  const std::uint64_t now_ms = Now();
+  TrackDepth();
+  Header *header = GetReadableFront(now_ms);
+  if (header == nullptr) {
+    reader_metrics.underruns.Add(1);
+    return 0;
+  }
+  // Concealment stays pinned until it's committed, so it can't be updated underneath the caller.
+  if (header->Pin()) {
+    reader_metrics.contended_claims.Add(1);
+  }
+  std::size_t offset = read_offset;
+  std::size_t available = state->written;
+  std::size_t consumed = header->Consumed();
+  while (true) {
+    // Point straight at the data, the mirrored mapping keeps it contiguous.
+    const std::size_t span_elements = std::min(header->elements - consumed, elements - peeked_elements);
+    spans[peeked_spans] = Packet{
+            .sequence_number = NarrowSequence(header->sequence_number),
+            .data = PayloadAt(offset) + consumed * element_size,
+            .length = span_elements * element_size,
+            .elements = span_elements,
+            .media_timestamp = static_cast<std::uint32_t>(header->media_timestamp + consumed),
+    };
+    peeked_spans++;
+    peeked_elements += span_elements;
+    if (peeked_elements == elements || peeked_spans == max_spans) {
+      break;
+    }
+
+    // Move on to the next packet, if there's one we can read.
+    const std::size_t packet_bytes = RecordSize(header->elements);
+    assert(packet_bytes <= available);
+    available -= packet_bytes;
+    offset = Advance(offset, packet_bytes);
+    if (available < header_bytes) {
+      break;
+    }
+    header = HeaderAt(offset);
+    consumed = 0;
+
+    if (IsExpired(header, now_ms)) {
+      break;
+    }
+    if (header->Pin()) {
+      reader_metrics.contended_claims.Add(1);
+    }
+  }
+  if (peeked_elements < elements && peeked_spans < max_spans) {
+    // Ran out of data, rather than room for spans.
+    reader_metrics.underruns.Add(1);
+  }
+  return peeked_spans;
+}
+
+std::size_t JitterBuffer::CommitRead(const std::size_t elements) {
+  const MetricsUpdate metrics_update(reader_metrics_version);
+  const std::size_t to_commit = std::min(elements, peeked_elements);
+  std::size_t committed = 0;
+  std::size_t release_from = read_offset;
+  while (committed < to_commit) {
+    assert(peeked_spans > 0);
+    Header *header = HeaderAt(read_offset);
+    const std::size_t remaining = header->elements - header->Consumed();
+    const std::size_t this_packet = std::min(remaining, to_commit - committed);
+    const std::size_t packet_bytes = RecordSize(header->elements);
+    committed += this_packet;
+    peeked_spans--;
+    ConsumeFront(header, this_packet);
+    release_from = this_packet == remaining ? read_offset : Advance(read_offset, packet_bytes);
+  }
+  state->written_elements -= committed;
+  reader_metrics.dequeued_bytes.Add(committed * element_size);
+  ReleasePeeked(release_from);
+  return committed;
+}
+
+void JitterBuffer::ReleasePeeked(std::size_t offset) {
+  for (; peeked_spans > 0; peeked_spans--) {
+    Header *header = HeaderAt(offset);
+    header->Unpin();
+    offset = Advance(offset, RecordSize(header->elements));
+  }
+  peeked_elements = 0;
+}
+
+std::size_t JitterBuffer::GenerateConcealment(const std::size_t packets, const std::uint64_t now_ms, const ConcealmentFunction callback, void *user_data, const bool advance_sequence) {
   // Alter missing to be the smallest of the missing packets or what we can currently fit in the buffer.
-  const std::size_t space = max_size_bytes - written;
-  const std::size_t packet_size = (packet_elements * element_size) + METADATA_SIZE;
+  const std::size_t elements = ConcealmentElements();
+  const std::size_t packet_size = RecordSize(elements);
+  const std::size_t space = FreeSpace(packet_size);
   const std::size_t full_packets_fit = space / packet_size;
-  const std::size_t to_conceal = std::min(packets, full_packets_fit);
-  const unsigned long last = last_written_sequence_number.value();
+  const std::size_t to_conceal = std::min({packets, full_packets_fit, concealment_packets.size()});
+  const std::uint32_t last = last_written_sequence_number.value();
   if (packets != to_conceal) {
-    logger->warning << "Couldn't fit all missing. Asking for: " << to_conceal << "/" << packets << std::flush;
+    Trace(writer_trace, JITTER_TRACE_CONCEALMENT_TRUNCATED, last, to_conceal, packets);
   }
-  std::vector<Packet> concealment_packets = std::vector<Packet>(to_conceal);
-  std::size_t previous = latest_written_elements;
+  assert(to_conceal <= concealment_packets.size());
+  const std::uint64_t position = write_position.load(std::memory_order_relaxed);
   for (std::size_t sequence_offset = 0; sequence_offset < to_conceal; sequence_offset++) {
-    // We need to write the header for this packet.
-    const std::int64_t now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-    Header header = {
-            .sequence_number = static_cast<uint32_t>(last + sequence_offset + 1),
-            .elements = packet_elements,
-            .timestamp = static_cast<uint64_t>(now_ms),
-            .concealment = true,
-            .previous_elements = previous,
+    // We need to write the header for this packet. Extra packets repeat the last sequence number, and can't be updated.
+    const auto sequence_number = static_cast<std::uint32_t>(advance_sequence ? last + sequence_offset + 1 : last);
+    const auto media_timestamp = static_cast<std::uint32_t>(next_media_timestamp + sequence_offset * elements);
+    new (HeaderAt(write_offset)) Header{
+            .sequence_number = sequence_number,
+            .elements = static_cast<std::uint32_t>(elements),
+            .timestamp = static_cast<std::uint32_t>(now_ms),
+            .media_timestamp = media_timestamp,
+            .state = Header::CONCEALMENT,
     };
-    previous = header.elements;
-    CopyIntoBuffer(reinterpret_cast<std::uint8_t *>(&header), METADATA_SIZE, true, 0);
-    write_offset = (write_offset + METADATA_SIZE) % max_size_bytes;
-    const std::size_t length = header.elements * element_size;
+    if (advance_sequence) {
+      IndexSequence(sequence_number, write_offset, position + sequence_offset * packet_size);
+    }
     concealment_packets[sequence_offset] = {
-            .sequence_number = header.sequence_number,
-            .data = buffer + write_offset,
-            .length = length,
-            .elements = header.elements,
+            .sequence_number = NarrowSequence(sequence_number),
+            .data = PayloadAt(write_offset),
+            .length = elements * element_size,
+            .elements = elements,
+            .media_timestamp = media_timestamp,
     };
-    write_offset = (write_offset + length) % max_size_bytes;
+    write_offset = Advance(write_offset, packet_size);
+  }
+
+  if (to_conceal > 0) {
+    callback(concealment_packets.data(), to_conceal, user_data);
   }
-  
-  callback(concealment_packets);
 
   // Now that we've finished providing data, update values for the reader.
-  written += to_conceal * ((packet_elements * element_size) + METADATA_SIZE);
-  assert(written <= max_size_bytes);
-  written_elements += to_conceal * packet_elements;
-  last_written_sequence_number = last + to_conceal;
-  latest_written_elements = previous;
-  return packet_elements * to_conceal;
-}
-
-std::size_t JitterBuffer::Update(const Packet &packet) {
-  // Get a snapshot of the current state.
-  std::size_t local_write_offset = write_offset;
-  std::size_t written_at_start = written;
-
-  // Get the first header by moving back elements + metadata.
-  const std::size_t this_chunk = latest_written_elements * element_size + METADATA_SIZE;
-  if (this_chunk > written_at_start) {
-    logger->warning << "Wanted to go back " << this_chunk << " bytes, but only have " << written_at_start << " bytes." << std::flush;
-    this->metrics.update_missed_frames += packet.elements;
-    return 0;
+  since_previous_real += to_conceal * packet_size;
+  state->written += to_conceal * packet_size;
+  assert(state->written <= max_size_bytes);
+  state->written_elements += to_conceal * elements;
+  write_position.store(write_position.load(std::memory_order_relaxed) + to_conceal * packet_size, std::memory_order_release);
+  if (to_conceal > 0) {
+    NotifyWrite();
   }
-  written_at_start -= this_chunk;
-  local_write_offset = ((local_write_offset - this_chunk) + this_chunk * max_size_bytes) % max_size_bytes;
-  Header *header;
-  while (true) {
-    // Parse the header that should be located here.
-    header = reinterpret_cast<Header *>(buffer + local_write_offset);
-    if (header->sequence_number == packet.sequence_number) break;
-    if (header->in_use.test_and_set(std::memory_order::acquire)) {
-      logger->warning << "[" << packet.sequence_number << "] [" << header->sequence_number << "] Packet in use. Stopping walk." << std::flush;
-      return 0;
-    }
+  next_media_timestamp += static_cast<std::uint32_t>(to_conceal * elements);
+  if (advance_sequence) {
+    last_written_sequence_number = static_cast<std::uint32_t>(last + to_conceal);
+  }
+  return elements * to_conceal;
+}
 
-    if (header->sequence_number <= dont_walk_beyond) {
-      logger->warning << "[" << packet.sequence_number << "] [" << header->sequence_number << "] Unwalkable." << std::flush;
-      return 0;
-    }
+std::size_t JitterBuffer::Update(const Packet &packet, const std::uint32_t sequence_number) {
+  writer_metrics.late_packets.Add(1);
+  writer_metrics.update_depth_packets.Add(SequenceDistance(last_written_sequence_number.value(), sequence_number));
 
-    assert(header->previous_elements > 0);
-    std::size_t to_move = (header->previous_elements * element_size) + METADATA_SIZE;
-    if (to_move > written_at_start) {
-      // Couldn't find it, probably already read.
-      logger->warning << "[" << packet.sequence_number << "] Couldn't find target packet." << std::flush;
-      header->in_use.clear(std::memory_order::release);
-      this->metrics.update_missed_frames += packet.elements;
-      return 0;
-    }
-    local_write_offset = ((local_write_offset - to_move) + to_move * max_size_bytes) % max_size_bytes;
-    written_at_start -= to_move;
-    header->in_use.clear(std::memory_order::release);
+  // Find where this sequence number was written.
+  const SequenceSlot &slot = sequence_index[sequence_number & sequence_index_mask];
+  if (!slot.valid || slot.sequence_number != sequence_number) {
+    Trace(writer_trace, JITTER_TRACE_UPDATE_NOT_FOUND, sequence_number);
+    writer_metrics.update_missed_frames.Add(packet.elements);
+    return 0;
   }
 
-  // We found the target packet.
-  assert(header->concealment);
-  if (header->in_use.test_and_set(std::memory_order::acquire)) {
-    // It's being read, we can't update it.
-    logger->warning << "[" << packet.sequence_number << "] Update called on a packet that is currently being read" << std::flush;
+  // Make sure it hasn't already been read. Offsets come back around, so once the ring wraps the slot's offset
+  // may hold a newer record, or the middle of one. Positions don't, so any record still unread is where the slot says.
+  const std::size_t unread = state->written;
+  if (write_position.load(std::memory_order_relaxed) - slot.position > unread) {
+    Trace(writer_trace, JITTER_TRACE_UPDATE_ALREADY_READ, sequence_number);
+    writer_metrics.update_missed_frames.Add(packet.elements);
     return 0;
   }
 
-  // Copy in the updated data.
-  const std::size_t source_offset_frames = packet.elements - header->elements;
-  memcpy(buffer + ((local_write_offset + METADATA_SIZE) % max_size_bytes), reinterpret_cast<std::uint8_t *>(packet.data) + (source_offset_frames * element_size), header->elements * element_size);
-  header->concealment = false;
-  header->in_use.clear(std::memory_order::release);
-  this->metrics.updated_frames += header->elements;
-  return header->elements;
-}
-
-std::size_t JitterBuffer::CopyIntoBuffer(const Packet &packet) {
-  // Prepare to write the header.
-  const std::size_t space = max_size_bytes - written;
-  if (space < METADATA_SIZE) {
+  Header *header = HeaderAt(slot.offset);
+  if (header->sequence_number != sequence_number) {
+    // The position check should rule this out, but writing into the wrong record would play it, so don't assume.
+    Trace(writer_trace, JITTER_TRACE_UPDATE_NOT_FOUND, sequence_number);
+    writer_metrics.update_missed_frames.Add(packet.elements);
     return 0;
   }
-  const std::int64_t now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-  Header header = Header();
-  header.timestamp = now_ms;
-  header.sequence_number = packet.sequence_number;
-  const std::size_t header_offset = write_offset;
-  const std::size_t enqueued = CopyIntoBuffer(static_cast<std::uint8_t *>(packet.data), element_size * packet.elements, true, METADATA_SIZE);
-  if (enqueued == 0) {
-    // There was space for 0 frames, so write nothing.
+  if (!header->IsConcealment()) {
+    // Real data is already here, e.g. a duplicate.
     return 0;
   }
-  const std::size_t remainder = enqueued % element_size;
-  const std::size_t enqueued_element_bytes = enqueued - remainder;
-  assert(enqueued_element_bytes % element_size == 0);// We should write whole elements.
-  header.elements = enqueued_element_bytes / element_size;
-  assert(header.elements > 0);
-  header.previous_elements = latest_written_elements;
-  latest_written_elements = header.elements;
-  memcpy(buffer + header_offset, &header, METADATA_SIZE);
-  ForwardWrite(enqueued_element_bytes + METADATA_SIZE);
-  assert(written <= max_size_bytes);
-  written_elements += header.elements;
-  return header.elements;
-}
-
-std::size_t JitterBuffer::CopyIntoBuffer(const std::uint8_t *src, const std::size_t length, const bool manual_increment, const std::size_t offset_offset_bytes) {
-  assert(written <= max_size_bytes);
-
-  // Ensure we have enough space.
-  const std::size_t space = max_size_bytes - written;
-  if (length > space) {
-    logger->error << "No space! Wanted: " << length << " space: " << space << std::flush;
+  if (header->elements != packet.elements) {
+    // Concealment guessed this packet's size wrong, so it can't simply be written over.
+    Trace(writer_trace, JITTER_TRACE_UPDATE_SIZE_MISMATCH, sequence_number, packet.elements, header->elements);
+    writer_metrics.update_missed_frames.Add(packet.elements);
+    return 0;
+  }
+  const std::uint32_t header_state = header->state.fetch_or(Header::WRITING, std::memory_order_acquire);
+  if (header_state & Header::PINNED) {
+    // Peek has handed this out to be played, so it plays as concealment.
+    header->state.fetch_and(~Header::WRITING, std::memory_order_release);
+    Trace(writer_trace, JITTER_TRACE_UPDATE_CONTENDED, sequence_number);
+    writer_metrics.contended_claims.Add(1);
     return 0;
   }
 
-  // Copy data into the buffer.
-  const std::size_t offset = (write_offset + offset_offset_bytes) % max_size_bytes;
-  memcpy(buffer + offset, src, length);
-  if (!manual_increment) ForwardWrite(length);
-  assert(written <= max_size_bytes);
-  return length;
+  // Copy in the updated data, skipping anything already read. The reader may be copying the rest, and goes again if so.
+  const std::size_t consumed = header_state >> Header::CONSUMED_SHIFT;
+  const std::size_t remaining = header->elements - consumed;
+  StoreRelaxed(PayloadAt(slot.offset) + consumed * element_size, reinterpret_cast<std::uint8_t *>(packet.data) + (consumed * element_size), remaining * element_size);
+  header->state.fetch_and(~(Header::CONCEALMENT | Header::WRITING), std::memory_order_release);
+  writer_metrics.updated_frames.Add(remaining);
+  writer_metrics.enqueued_bytes.Add(remaining * element_size);
+  return remaining;
 }
 
-std::size_t JitterBuffer::CopyOutOfBuffer(std::uint8_t *destination, const std::size_t length, const std::size_t required_bytes, const bool strict) {
-  if (required_bytes > length) {
-    // Destination not big enough.
-    logger->error << "Provided buffer not big enough" << std::flush;
-    return -1;
-  }
+void JitterBuffer::IndexSequence(const std::uint32_t sequence_number, const std::size_t offset, const std::uint64_t position) {
+  SequenceSlot &slot = sequence_index[sequence_number & sequence_index_mask];
+  slot.sequence_number = sequence_number;
+  slot.offset = offset;
+  slot.position = position;
+  slot.valid = true;
+}
 
-  // How much data is actually available?
-  const std::size_t currently_written = written;
-  if (strict && required_bytes > currently_written) {
-    return 0;
+std::uint8_t *JitterBuffer::WriteHeader(const std::uint32_t sequence_number, const std::size_t elements, const std::uint32_t media_timestamp, const std::uint64_t now_ms) {
+  // Ensure we have space for the header and its data.
+  assert(state->written <= max_size_bytes);
+  assert(elements > 0);
+  const std::size_t record_bytes = RecordSize(elements);
+  const std::size_t space = FreeSpace(record_bytes);
+  if (record_bytes > space) {
+    Trace(writer_trace, JITTER_TRACE_NO_SPACE, sequence_number, record_bytes, space);
+    return nullptr;
   }
 
-  const std::size_t available = std::min(required_bytes, currently_written);
-  if (available == 0) {
-    return 0;
+  // Write the header, this isn't visible to the reader until published.
+  new (HeaderAt(write_offset)) Header{
+          .sequence_number = sequence_number,
+          .elements = static_cast<std::uint32_t>(elements),
+          .timestamp = static_cast<std::uint32_t>(now_ms),
+          .media_timestamp = media_timestamp,
+  };
+  IndexSequence(sequence_number, write_offset, write_position.load(std::memory_order_relaxed));
+  return PayloadAt(write_offset);
+}
+
+std::size_t JitterBuffer::FreeSpace(const std::size_t wanted) {
+  // Space is held from whichever of the reader and taps is furthest behind.
+  std::size_t held = state->written;
+  const std::uint64_t position = write_position.load(std::memory_order_relaxed);
+  for (TapSlot &tap : taps) {
+    std::uint32_t status = tap.status.load(std::memory_order_seq_cst);
+    if (status == TapSlot::JOINING) {
+      // Start from here, the tap sees all that's written from now.
+      tap.position.store(position, std::memory_order_relaxed);
+      tap.offset = write_offset;
+      tap.consumed = 0;
+      tap.status.compare_exchange_strong(status, TapSlot::ACTIVE, std::memory_order_acq_rel);
+      continue;
+    }
+    if (status != TapSlot::ACTIVE) {
+      continue;
+    }
+    const std::size_t tap_held = position - tap.position.load(std::memory_order_acquire);
+    // Only worth dropping if it's the tap, not the reader, that leaves too little space.
+    if (tap.drop_when_behind.load(std::memory_order_relaxed) && max_size_bytes - tap_held < wanted && max_size_bytes - state->written >= wanted &&
+        tap.status.compare_exchange_strong(status, TapSlot::DROPPED, std::memory_order_acq_rel)) {
+      // Rather this tap misses out than every reader loses the packet.
+      Trace(writer_trace, JITTER_TRACE_TAP_DROPPED, last_written_sequence_number.value_or(0), tap_held, wanted);
+      writer_metrics.dropped_taps.Add(1);
+      continue;
+    }
+    held = std::max(held, tap_held);
   }
+  return max_size_bytes - held;
+}
 
-  // Copy the available data into the destination buffer.
-  memcpy(destination, buffer + read_offset, available);
-  ForwardRead(available);
-  return available;
+std::size_t JitterBuffer::PublishPacket(const std::size_t elements) {
+  // Only real data is published this way, remember it as context for concealment.
+  previous_real_offset = write_offset;
+  previous_real_elements = elements;
+  since_previous_real = RecordSize(elements);
+  next_media_timestamp = HeaderAt(write_offset)->media_timestamp + static_cast<std::uint32_t>(elements);
+  ForwardWrite(RecordSize(elements));
+  assert(state->written <= max_size_bytes);
+  state->written_elements += elements;
+  // Only once the elements are counted, or a woken waiter could find them missing and sleep again.
+  NotifyWrite();
+  return elements;
 }
 
 std::uint8_t *JitterBuffer::GetReadPointerAtPacketOffset(const std::size_t read_offset_packets) const {
-  const std::size_t read_offset_bytes = METADATA_SIZE + (read_offset_packets * (METADATA_SIZE + (packet_elements * element_size)));
-  if (read_offset_bytes >= max_size_bytes) {
-    throw std::runtime_error("Offset cannot be greater than the size of the buffer");
+  // Packets can differ in size, so walk their headers from the start of the ring.
+  std::size_t record_offset = 0;
+  for (std::size_t packet = 0; packet < read_offset_packets; packet++) {
+    record_offset += RecordSize(HeaderAt(record_offset)->elements);
+    if (record_offset >= max_size_bytes) {
+      throw std::runtime_error("Offset cannot be greater than the size of the buffer");
+    }
   }
-  return buffer + read_offset_bytes;
+  return buffer + record_offset + header_bytes;
+}
+
+void JitterBuffer::InvokeConcealmentCallback(Packet *packets, const std::size_t num_packets, void *user_data) {
+  std::vector<Packet> vector(packets, packets + num_packets);
+  (*static_cast<ConcealmentCallback *>(user_data))(vector);
+}
+
+void JitterBuffer::InvokeContiguousConcealment(Packet *packets, const std::size_t num_packets, void *user_data) {
+  const auto *contiguous = static_cast<ContiguousConcealment *>(user_data);
+  JitterBuffer &buffer = *contiguous->buffer;
+  // Every packet in a run is the same size.
+  const std::size_t run_packet_elements = packets[0].elements;
+  const std::size_t packet_bytes = run_packet_elements * buffer.element_size;
+  if (buffer.concealment_scratch.size() < num_packets * packet_bytes) {
+    buffer.concealment_scratch.resize(num_packets * packet_bytes);
+  }
+
+  // The last real packet is still intact unless everything written since, this run included, has come back around onto it.
+  const bool has_previous = buffer.since_previous_real > 0 &&
+                            buffer.since_previous_real + num_packets * buffer.RecordSize(run_packet_elements) <= buffer.max_size_bytes;
+  const Packet previous = {
+          .sequence_number = buffer.NarrowSequence(buffer.HeaderAt(buffer.previous_real_offset)->sequence_number),
+          .data = buffer.PayloadAt(buffer.previous_real_offset),
+          .length = buffer.previous_real_elements * buffer.element_size,
+          .elements = buffer.previous_real_elements,
+          .media_timestamp = buffer.HeaderAt(buffer.previous_real_offset)->media_timestamp,
+  };
+  Packet run = {
+          .sequence_number = packets[0].sequence_number,
+          .data = buffer.concealment_scratch.data(),
+          .length = num_packets * packet_bytes,
+          .elements = num_packets * run_packet_elements,
+          .media_timestamp = packets[0].media_timestamp,
+  };
+  contiguous->callback(&run, has_previous ? &previous : nullptr, contiguous->user_data);
+
+  // Scatter into the slots, each of which sits after its own header.
+  for (std::size_t index = 0; index < num_packets; index++) {
+    memcpy(packets[index].data, buffer.concealment_scratch.data() + index * packet_bytes, packet_bytes);
+  }
+}
+
+std::size_t JitterBuffer::CalculateBufferSize(const std::size_t element_size, const std::size_t packet_elements, const std::uint32_t clock_rate, const milliseconds max_length, const SizingMode sizing, const std::size_t record_bytes) {
+  switch (sizing) {
+    case SizingMode::PerElement:
+      return max_length.count() * (clock_rate / 1000) * (element_size + METADATA_SIZE);
+    case SizingMode::PerPacket: {
+      // Enough whole packets to cover max_length, each with its own header.
+      const std::size_t max_elements = max_length.count() * clock_rate;
+      const std::size_t packet_ms_elements = packet_elements * 1000;
+      const std::size_t packets = (max_elements + packet_ms_elements - 1) / packet_ms_elements;
+      return packets * record_bytes;
+    }
+  }
+  throw std::invalid_argument("Unknown sizing mode");
 }
 
 void JitterBuffer::UnwindRead(const std::size_t unwind_bytes) {
   assert(unwind_bytes > 0);
-  written += unwind_bytes;
-  assert(written <= max_size_bytes);
-  read_offset = ((read_offset - unwind_bytes) + unwind_bytes * max_size_bytes) % max_size_bytes;
+  state->written += unwind_bytes;
+  assert(state->written <= max_size_bytes);
+  read_offset = Rewind(read_offset, unwind_bytes);
 }
 
 void JitterBuffer::ForwardRead(const std::size_t forward_bytes) {
   assert(forward_bytes > 0);
-  assert(forward_bytes <= written);
-  assert(written <= max_size_bytes);
-  written -= forward_bytes;
-  read_offset = (read_offset + forward_bytes) % max_size_bytes;
+  assert(forward_bytes <= state->written);
+  assert(state->written <= max_size_bytes);
+  state->written -= forward_bytes;
+  read_offset = Advance(read_offset, forward_bytes);
 }
 
 void JitterBuffer::UnwindWrite(const std::size_t unwind_bytes) {
   assert(unwind_bytes > 0);
-  assert(unwind_bytes <= written);
-  assert(written <= max_size_bytes);
-  written -= unwind_bytes;
-  write_offset = ((write_offset - unwind_bytes) + unwind_bytes * max_size_bytes) % max_size_bytes;
+  assert(unwind_bytes <= state->written);
+  assert(state->written <= max_size_bytes);
+  state->written -= unwind_bytes;
+  write_position.store(write_position.load(std::memory_order_relaxed) - unwind_bytes, std::memory_order_release);
+  write_offset = Rewind(write_offset, unwind_bytes);
 }
 
 void JitterBuffer::ForwardWrite(const std::size_t forward_bytes) {
   assert(forward_bytes > 0);
-  written += forward_bytes;
-  assert(written <= max_size_bytes);
-  write_offset = (write_offset + forward_bytes) % max_size_bytes;
+  state->written += forward_bytes;
+  assert(state->written <= max_size_bytes);
+  write_offset = Advance(write_offset, forward_bytes);
+  write_position.store(write_position.load(std::memory_order_relaxed) + forward_bytes, std::memory_order_release);
+}
+
+void JitterBuffer::NotifyWrite() {
+  // Waiters register before checking the count, so either they see this bump or this sees them.
+  state->write_count.fetch_add(1, std::memory_order_seq_cst);
+  if (state->waiters.load(std::memory_order_seq_cst) > 0) {
+#if defined(_GNU_SOURCE) && defined(SYS_futex)
+    // Not FUTEX_PRIVATE, the waiter may be in another process.
+    syscall(SYS_futex, &state->write_count, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+  }
+#ifdef _GNU_SOURCE
+  // Signalled once per arming, so a busy stream costs the event loop one wakeup per wait, not one per packet.
+  if (event_armed.load(std::memory_order_seq_cst) && event_armed.exchange(false, std::memory_order_seq_cst)) {
+    const std::uint64_t one = 1;
+    if (write(event_fd.load(std::memory_order_relaxed), &one, sizeof(one)) < 0) {
+      Trace(writer_trace, JITTER_TRACE_EVENT_FD_FAILED, last_written_sequence_number.value_or(0), errno);
+    }
+  }
+#endif
 }
 
 milliseconds JitterBuffer::GetCurrentDepth() const {
-  const float ms = written_elements * 1000 / clock_rate.count();
+  const float ms = state->written_elements * 1000 / clock_rate.count();
   return milliseconds(static_cast<std::int64_t>(ms));
 }
 
+void JitterBuffer::Trace([[maybe_unused]] TraceRing &ring,
+                         [[maybe_unused]] const TraceEventType type,
+                         [[maybe_unused]] const std::uint32_t sequence_number,
+                         [[maybe_unused]] const std::uint64_t first,
+                         [[maybe_unused]] const std::uint64_t second) const {
+#ifndef LIBJITTER_NO_TRACE
+  if (ring.GetCapacity() == 0) {
+    return;
+  }
+  ring.Push(TraceEvent{
+          .time_ms = Now(),
+          .type = static_cast<std::uint32_t>(type),
+          .sequence_number = NarrowSequence(sequence_number),
+          .values = {first, second},
+  });
+#endif
+}
+
+std::size_t JitterBuffer::DrainTrace(const TraceFunction callback, void *user_data) {
+  const auto sink = [callback, user_data](const TraceEvent &event) {
+    callback(&event, user_data);
+  };
+  return writer_trace.Drain(sink) + reader_trace.Drain(sink);
+}
+
+std::size_t JitterBuffer::DrainTrace() {
+  const auto sink = [this](const TraceEvent &event) {
+    if (event.type == JITTER_TRACE_NO_SPACE) {
+      logger->error << DescribeTraceEvent(event) << std::flush;
+    } else {
+      logger->warning << DescribeTraceEvent(event) << std::flush;
+    }
+  };
+  const std::size_t drained = writer_trace.Drain(sink) + reader_trace.Drain(sink);
+  const std::size_t dropped = writer_trace.GetDropped() + reader_trace.GetDropped();
+  if (dropped != trace_dropped_logged) {
+    logger->warning << "Dropped " << dropped - trace_dropped_logged << " trace events, drain more often or raise trace_capacity" << std::flush;
+    trace_dropped_logged = dropped;
+  }
+  return drained;
+}
+
+std::string JitterBuffer::DescribeTraceEvent(const TraceEvent &event) {
+  std::ostringstream message;
+  message << "[" << event.sequence_number << "] ";
+  switch (event.type) {
+    case JITTER_TRACE_FULL_DROPPED:
+      message << "No more space. This packet was lost";
+      break;
+    case JITTER_TRACE_NO_SPACE:
+      message << "No space! Wanted: " << event.values[0] << " space: " << event.values[1];
+      break;
+    case JITTER_TRACE_CONCEALMENT_TRUNCATED:
+      message << "Couldn't fit all missing. Concealed: " << event.values[0] << "/" << event.values[1];
+      break;
+    case JITTER_TRACE_UPDATE_NOT_FOUND:
+      message << "Couldn't find target packet.";
+      break;
+    case JITTER_TRACE_UPDATE_ALREADY_READ:
+      message << "Target packet has already been read.";
+      break;
+    case JITTER_TRACE_UPDATE_SIZE_MISMATCH:
+      message << "Late packet of " << event.values[0] << " elements doesn't fit its concealment of " << event.values[1];
+      break;
+    case JITTER_TRACE_UPDATE_CONTENDED:
+      message << "Update called on concealment that Peek has handed out to be played";
+      break;
+    case JITTER_TRACE_READ_CONTENDED:
+      message << "Concealment was updated while being read, so was read again.";
+      break;
+    case JITTER_TRACE_EVENT_FD_FAILED:
+      message << "Failed to signal the eventfd. errno: " << event.values[0];
+      break;
+    case JITTER_TRACE_TAP_DROPPED:
+      message << "Dropped a tap holding " << event.values[0] << " bytes, needed " << event.values[1];
+      break;
+    default:
+      message << "Unknown event " << event.type;
+      break;
+  }
+  message << " at " << event.time_ms << "ms";
+  return message.str();
+}
+
+template<typename Read>
+void JitterBuffer::ReadMetrics(const std::atomic<std::uint32_t> &version, Read read) {
+  // Retry while the owning thread is mid call, giving up eventually so a descheduled thread can't stall this.
+  for (int attempt = 0; attempt < 64; attempt++) {
+    const std::uint32_t before = version.load(std::memory_order_acquire);
+    read();
+    if (before % 2 == 0 && version.load(std::memory_order_relaxed) == before) {
+      return;
+    }
+  }
+}
+
 Metrics JitterBuffer::GetMetrics() const {
-  // Get current copy of metrics, updating skipped from other thread's atomic value.
-  auto result = this->metrics;
-  result.skipped_frames = skipped_frames;
+  Metrics result = {};
+  unsigned long writer_contended = 0;
+  ReadMetrics(writer_metrics_version, [this, &result, &writer_contended]() {
+    result.concealed_frames = writer_metrics.concealed_frames.Get();
+    result.filled_packets = writer_metrics.filled_packets.Get();
+    result.updated_frames = writer_metrics.updated_frames.Get();
+    result.update_missed_frames = writer_metrics.update_missed_frames.Get();
+    result.enqueued_bytes = writer_metrics.enqueued_bytes.Get();
+    result.full_dropped_packets = writer_metrics.full_dropped_packets.Get();
+    result.late_packets = writer_metrics.late_packets.Get();
+    result.update_depth_packets = writer_metrics.update_depth_packets.Get();
+    writer_contended = writer_metrics.contended_claims.Get();
+    result.dropped_taps = writer_metrics.dropped_taps.Get();
+  });
+  unsigned long reader_contended = 0;
+  ReadMetrics(reader_metrics_version, [this, &result, &reader_contended]() {
+    result.skipped_frames = reader_metrics.skipped_frames.Get();
+    result.dropped_frames = reader_metrics.dropped_frames.Get();
+    result.accelerated_frames = reader_metrics.accelerated_frames.Get();
+    result.seeked_frames = reader_metrics.seeked_frames.Get();
+    result.dequeued_bytes = reader_metrics.dequeued_bytes.Get();
+    result.underruns = reader_metrics.underruns.Get();
+    reader_contended = reader_metrics.contended_claims.Get();
+  });
+  result.contended_claims = writer_contended + reader_contended;
+  result.trace_dropped_events = writer_trace.GetDropped() + reader_trace.GetDropped();
+  result.target_depth_ms = GetTargetDepth().count();
   return result;
 }
 
-void *JitterBuffer::MakeVirtualMemory(std::size_t &length, [[maybe_unused]] void *user_data) {
-  // Get buffer length as multiple of page size.
+milliseconds JitterBuffer::GetTargetDepth() const {
+  return milliseconds(state->target_depth_ms.load(std::memory_order_relaxed));
+}
+
+std::size_t JitterBuffer::GetTargetElements() const {
+  return GetTargetDepth().count() * clock_rate.count() / 1000;
+}
+
+void JitterBuffer::TrackDepth() {
+  if (depth_mode != DepthMode::Adaptive) {
+    return;
+  }
+
+  // Smooth over reads so a single early burst doesn't look like excess depth.
+  const std::size_t depth = state->written_elements;
+  smoothed_depth_elements = depth > smoothed_depth_elements ? smoothed_depth_elements + (depth - smoothed_depth_elements) / 16
+                                                            : smoothed_depth_elements - (smoothed_depth_elements - depth) / 16;
+}
+
+std::uint32_t JitterBuffer::ExtendSequence(const unsigned long sequence_number) const {
+  if (sequence_mode == SequenceMode::Full || !last_written_sequence_number.has_value()) {
+    return static_cast<std::uint32_t>(sequence_number);
+  }
+  // The closest extended sequence number to the last written with these low bits, either side of it.
+  const std::uint32_t last = last_written_sequence_number.value();
+  const auto delta = static_cast<std::int16_t>(static_cast<std::uint16_t>(sequence_number) - static_cast<std::uint16_t>(last));
+  return last + delta;
+}
+
+std::uint32_t JitterBuffer::NarrowSequence(const std::uint32_t sequence_number) const {
+  return sequence_mode == SequenceMode::Rtp ? sequence_number & 0xFFFF : sequence_number;
+}
+
+std::int32_t JitterBuffer::SequenceDistance(const std::uint32_t to, const std::uint32_t from) {
+  // Serial number arithmetic, positive when to is newer.
+  return static_cast<std::int32_t>(to - from);
+}
+
+void JitterBuffer::TrackArrival(const std::uint32_t sequence_number, const std::size_t elements, const std::uint64_t now_ms) {
+  if (depth_mode != DepthMode::Adaptive) {
+    return;
+  }
+
+  // Unwrap the sequence number, so the expected times carry on smoothly over rollover.
+  // Anything in between is assumed to be the size of this packet.
+  const auto packet_elements_signed = static_cast<std::int64_t>(elements);
+  arrival_position = arrival_sequence_number.has_value() ? arrival_position + SequenceDistance(sequence_number, arrival_sequence_number.value()) * packet_elements_signed : sequence_number * packet_elements_signed;
+  arrival_sequence_number = sequence_number;
+
+  // How late this is compared with a perfect network, give or take a constant offset.
+  const auto expected_ms = static_cast<std::int64_t>(arrival_position * 1000 / static_cast<std::int64_t>(clock_rate.count()));
+  arrival_delays[arrival_delays_next] = static_cast<std::int64_t>(now_ms) - expected_ms;
+  arrival_delays_next = (arrival_delays_next + 1) % arrival_delays.size();
+  arrival_delays_count = std::min(arrival_delays_count + 1, arrival_delays.size());
+}
+
+std::size_t JitterBuffer::ConcealmentElements() const {
+  // Missing packets are most likely the size of the last one that arrived.
+  return previous_real_elements > 0 ? previous_real_elements : packet_elements;
+}
+
+void JitterBuffer::CheckPacketElements(const std::size_t elements) const {
+  if (packet_mode == PacketMode::Fixed && elements != packet_elements) {
+    std::ostringstream message;
+    message << "Supplied packet elements must match declared number of elements. Got: " << elements << ", expected: " << packet_elements;
+    throw std::invalid_argument(message.str());
+  }
+  if (packet_mode == PacketMode::Variable && (elements < min_packet_elements || elements > packet_elements)) {
+    std::ostringstream message;
+    message << "Supplied packet elements must be between " << min_packet_elements << " and " << packet_elements << ". Got: " << elements;
+    throw std::invalid_argument(message.str());
+  }
+}
+
+std::size_t JitterBuffer::MinPacketElements(const std::size_t packet_elements, const std::uint32_t clock_rate, const PacketMode packets) {
+  // Packets are at least 1ms, which bounds how many headers a ring might need to hold.
+  return packets == PacketMode::Variable ? std::min<std::size_t>(packet_elements, (clock_rate + 999) / 1000) : packet_elements;
+}
+
+void JitterBuffer::UpdateTargetDepth() {
+  if (depth_mode != DepthMode::Adaptive || arrival_delays_count == 0) {
+    return;
+  }
+
+  // The spread from the earliest arrival to the percentile is how far ahead playout needs to be.
+  const auto begin = arrival_delays_scratch.begin();
+  const auto end = begin + static_cast<std::ptrdiff_t>(arrival_delays_count);
+  std::copy_n(arrival_delays.begin(), arrival_delays_count, begin);
+  const auto percentile = begin + static_cast<std::ptrdiff_t>(depth_percentile * static_cast<double>(arrival_delays_count - 1));
+  std::nth_element(begin, percentile, end);
+  const std::int64_t jitter_ms = *percentile - *std::min_element(begin, percentile + 1);
+  state->target_depth_ms.store(std::clamp(jitter_ms, static_cast<std::int64_t>(min_length.count()), static_cast<std::int64_t>(max_length.count())), std::memory_order_relaxed);
+}
+
+void JitterBuffer::Reset() {
+  // The ring's contents are left alone, nothing is read without a header being written first.
+  state->written = 0;
+  state->written_elements = 0;
+  state->play = false;
+  state->target_depth_ms = min_length.count();
+  write_offset = 0;
+  write_position = 0;
+  for (TapSlot &tap : taps) {
+    // Attached taps carry on from the start of the next stream.
+    if (tap.status == TapSlot::ACTIVE || tap.status == TapSlot::DROPPED) {
+      tap.status = TapSlot::JOINING;
+    }
+  }
+  previous_real_elements = 0;
+  since_previous_real = 0;
+  last_written_sequence_number.reset();
+  reserved_sequence_number.reset();
+  {
+    // GetMetrics from another thread sees all of these cleared or none.
+    const MetricsUpdate writer_update(writer_metrics_version);
+    const MetricsUpdate reader_update(reader_metrics_version);
+    for (Counter *counter : {&writer_metrics.concealed_frames, &writer_metrics.filled_packets, &writer_metrics.updated_frames,
+                             &writer_metrics.update_missed_frames, &writer_metrics.enqueued_bytes, &writer_metrics.full_dropped_packets,
+                             &writer_metrics.late_packets, &writer_metrics.update_depth_packets, &writer_metrics.contended_claims,
+                             &writer_metrics.dropped_taps,
+                             &reader_metrics.skipped_frames, &reader_metrics.dropped_frames, &reader_metrics.accelerated_frames,
+                             &reader_metrics.seeked_frames, &reader_metrics.dequeued_bytes, &reader_metrics.underruns, &reader_metrics.contended_claims}) {
+      counter->Clear();
+    }
+  }
+  std::fill(sequence_index.begin(), sequence_index.end(), SequenceSlot{});
+  arrival_delays_count = 0;
+  arrival_delays_next = 0;
+  arrival_sequence_number.reset();
+  arrival_position = 0;
+  next_media_timestamp = 0;
+  read_offset = 0;
+  peeked_spans = 0;
+  peeked_elements = 0;
+  smoothed_depth_elements = 0;
+  draining = false;
+  event_armed = false;
+  waiting = nullptr;
+  waiting_elements = 0;
+  // Events from the last stream would be misleading in the next.
+  const auto discard = [](const TraceEvent &) {};
+  writer_trace.Drain(discard);
+  reader_trace.Drain(discard);
+}
+
+std::uint32_t JitterBuffer::GetWriteCount() const {
+  return state->write_count.load(std::memory_order_seq_cst);
+}
+
+bool JitterBuffer::WaitForWrite(const std::uint32_t write_count, const milliseconds timeout) {
+  const auto deadline = steady_clock::now() + timeout;
+  state->waiters.fetch_add(1, std::memory_order_seq_cst);
+  bool published = true;
+  while (state->write_count.load(std::memory_order_seq_cst) == write_count) {
+    const auto remaining = deadline - steady_clock::now();
+    if (remaining <= steady_clock::duration::zero()) {
+      published = false;
+      break;
+    }
+#if defined(_GNU_SOURCE) && defined(SYS_futex)
+    // Sleeps only if the count is still what was seen, so a bump in between isn't lost.
+    const auto seconds = duration_cast<std::chrono::seconds>(remaining);
+    const timespec relative = {.tv_sec = static_cast<time_t>(seconds.count()), .tv_nsec = static_cast<long>(duration_cast<nanoseconds>(remaining - seconds).count())};
+    syscall(SYS_futex, &state->write_count, FUTEX_WAIT, write_count, &relative, nullptr, 0);
+#else
+    std::this_thread::sleep_for(std::min<steady_clock::duration>(remaining, milliseconds(1)));
+#endif
+  }
+  state->waiters.fetch_sub(1, std::memory_order_relaxed);
+  return published;
+}
+
+bool JitterBuffer::WaitForElements(const std::size_t elements, const milliseconds timeout) {
+  const auto deadline = steady_clock::now() + timeout;
+  while (true) {
+    // Read the count first, so a publish after the check still wakes the wait.
+    const std::uint32_t write_count = GetWriteCount();
+    if (HasElements(elements)) {
+      return true;
+    }
+    const auto remaining = duration_cast<milliseconds>(deadline - steady_clock::now());
+    if (remaining.count() <= 0 || !WaitForWrite(write_count, remaining)) {
+      return HasElements(elements);
+    }
+  }
+}
+
+bool JitterBuffer::HasElements(const std::size_t elements) const {
+  return state->play.load(std::memory_order_seq_cst) && state->written_elements.load(std::memory_order_seq_cst) >= elements;
+}
+
+int JitterBuffer::GetEventFd() {
+  if (state != &local_state) {
+    // The arming flag is in this object, so a writer in another process would never see it.
+    throw std::logic_error("GetEventFd isn't supported on shared buffers, use WaitForWrite");
+  }
+#ifdef _GNU_SOURCE
+  if (event_fd < 0) {
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("Failed to create eventfd: ") + strerror(errno));
+    }
+    event_fd.store(fd, std::memory_order_release);
+  }
+  return event_fd;
+#else
+  throw std::runtime_error("No eventfd on this platform");
+#endif
+}
+
+JitterBuffer::ElementsAwaitable JitterBuffer::WaitForElementsAsync(const std::size_t elements) {
+  return ElementsAwaitable(*this, elements);
+}
+
+bool JitterBuffer::Suspend(const std::coroutine_handle<> handle, const std::size_t elements) {
+  if (event_fd < 0) {
+    throw std::logic_error("GetEventFd must be registered before waiting, or nothing would resume the wait");
+  }
+  if (waiting) {
+    throw std::logic_error("Only one coroutine can wait on a buffer at a time");
+  }
+  if (ArmEventFd(elements)) {
+    return false;
+  }
+  waiting = handle;
+  waiting_elements = elements;
+  return true;
+}
+
+void JitterBuffer::OnEventFd() {
+#ifdef _GNU_SOURCE
+  std::uint64_t count;
+  [[maybe_unused]] const ssize_t drained = read(event_fd, &count, sizeof(count));
+#endif
+  if (!waiting) {
+    return;
+  }
+  if (!HasElements(waiting_elements) && !ArmEventFd(waiting_elements)) {
+    return;
+  }
+  std::exchange(waiting, nullptr).resume();
+}
+
+bool JitterBuffer::ArmEventFd(const std::size_t elements) {
+  // Arm before checking, so anything published in between still signals.
+  event_armed.store(true, std::memory_order_seq_cst);
+  return HasElements(elements);
+}
+
+std::size_t JitterBuffer::GetMappedSize() const {
+  return max_size_bytes;
+}
+
+void JitterBuffer::Export([[maybe_unused]] const int socket) {
+  if (reserved_sequence_number.has_value()) {
+    throw std::logic_error("Export called between Reserve and CommitWrite");
+  }
+  if (!owns_buffer) {
+    throw std::logic_error("Only a buffer that mapped its own ring can be exported");
+  }
+  for (const TapSlot &tap : taps) {
+    if (tap.status != TapSlot::FREE) {
+      throw std::logic_error("Taps must be detached before Export");
+    }
+  }
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+  // Nothing lent out by Peek survives the move.
+  ReleasePeeked(read_offset);
+  const Snapshot snapshot = {
+          .version = SNAPSHOT_VERSION,
+          .element_size = element_size,
+          .packet_elements = packet_elements,
+          .header_bytes = header_bytes,
+          .mapped_size = max_size_bytes,
+          .sequence_mode = static_cast<std::uint32_t>(sequence_mode),
+          .packet_mode = static_cast<std::uint32_t>(packet_mode),
+          .shared = state_bytes > 0,
+          .read_offset = read_offset,
+          .write_offset = write_offset,
+          .written = state->written.load(),
+          .written_elements = state->written_elements.load(),
+          .play = state->play.load(),
+          .has_last_written = last_written_sequence_number.has_value(),
+          .last_written_sequence_number = last_written_sequence_number.value_or(0),
+          .next_media_timestamp = next_media_timestamp,
+          .previous_real_offset = previous_real_offset,
+          .previous_real_elements = previous_real_elements,
+          .since_previous_real = since_previous_real,
+          .target_depth_ms = state->target_depth_ms.load(),
+          .manual_time_ms = manual_time_ms.load(),
+          .smoothed_depth_elements = smoothed_depth_elements,
+          .draining = draining,
+          .metrics = GetMetrics(),
+  };
+
+  // The ring goes as a file descriptor alongside, the kernel duplicates it into the receiver.
+  int fd;
+  memcpy(&fd, vm_user_data, sizeof(fd));
+  iovec data = {.iov_base = const_cast<Snapshot *>(&snapshot), .iov_len = sizeof(snapshot)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fd))] = {};
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  cmsghdr *rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(sizeof(fd));
+  memcpy(CMSG_DATA(rights), &fd, sizeof(fd));
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent != static_cast<ssize_t>(sizeof(snapshot))) {
+    throw std::runtime_error(std::string("Failed to send buffer: ") + (sent < 0 ? strerror(errno) : "short write"));
+  }
+#else
+  throw std::runtime_error("No shared memory implementation");
+#endif
+}
+
+std::unique_ptr<JitterBuffer> JitterBuffer::Import([[maybe_unused]] const int socket,
+                                                   [[maybe_unused]] const std::size_t element_size,
+                                                   [[maybe_unused]] const std::size_t packet_elements,
+                                                   [[maybe_unused]] const std::uint32_t clock_rate,
+                                                   [[maybe_unused]] const milliseconds max_length,
+                                                   [[maybe_unused]] const milliseconds min_length,
+                                                   [[maybe_unused]] const cantina::LoggerPointer &logger,
+                                                   [[maybe_unused]] const JitterBufferOptions &options) {
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+  Snapshot snapshot;
+  int fd = -1;
+  iovec data = {.iov_base = &snapshot, .iov_len = sizeof(snapshot)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fd))] = {};
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = recvmsg(socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  for (cmsghdr *rights = received >= 0 ? CMSG_FIRSTHDR(&message) : nullptr; rights != nullptr; rights = CMSG_NXTHDR(&message, rights)) {
+    if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd, CMSG_DATA(rights), sizeof(fd));
+    }
+  }
+  if (received != static_cast<ssize_t>(sizeof(snapshot)) || fd < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::runtime_error(std::string("Failed to receive buffer: ") + (received < 0 ? strerror(errno) : "no ring sent"));
+  }
+
+  // Only map what this configuration would have mapped itself.
+  const std::size_t length = CalculateMappedSize(element_size, packet_elements, clock_rate, max_length, options);
+  const std::size_t state_bytes = options.shared ? RoundToPage(sizeof(SharedState), options.hugetlb) : 0;
+  struct stat ring_status;
+  if (snapshot.version != SNAPSHOT_VERSION || snapshot.mapped_size != length || snapshot.shared != options.shared ||
+      fstat(fd, &ring_status) != 0 || static_cast<std::size_t>(ring_status.st_size) != length + state_bytes) {
+    close(fd);
+    throw std::invalid_argument("Exported buffer doesn't match this configuration");
+  }
+  const std::size_t alignment = length % HUGE_PAGE_SIZE == 0 ? HUGE_PAGE_SIZE : getpagesize();
+  void *ring = MapRings(fd, length, 1, options, alignment);
+  if (ring == MAP_FAILED) {
+    close(fd);
+    throw std::runtime_error("Failed to map ring memory");
+  }
+  void *user_data = calloc(1, sizeof(int));
+  memcpy(user_data, &fd, sizeof(fd));
+
+  // Construct around the mapping, without touching what's in it, then take ownership.
+  JitterBufferOptions adopted = options;
+  adopted.populate = PopulateMode::Lazy;
+  adopted.shared = false;
+  std::unique_ptr<JitterBuffer> imported;
+  try {
+    imported.reset(new JitterBuffer(element_size, packet_elements, clock_rate, max_length, min_length, logger, adopted, reinterpret_cast<std::uint8_t *>(ring), length));
+  } catch (...) {
+    FreeVirtualMemory(ring, length, user_data);
+    throw;
+  }
+  imported->owns_buffer = true;
+  imported->vm_user_data = user_data;
+  if (state_bytes > 0) {
+    imported->state = MapSharedState(fd, length, state_bytes, false);
+    if (imported->state == nullptr) {
+      imported->state = &imported->local_state;
+      throw std::runtime_error("Failed to map shared state");
+    }
+    imported->state_bytes = state_bytes;
+  }
+  if (snapshot.element_size != imported->element_size || snapshot.packet_elements != imported->packet_elements ||
+      snapshot.header_bytes != imported->header_bytes || snapshot.sequence_mode != static_cast<std::uint32_t>(imported->sequence_mode) ||
+      snapshot.packet_mode != static_cast<std::uint32_t>(imported->packet_mode) ||
+      snapshot.read_offset >= length || snapshot.write_offset >= length || snapshot.written > length) {
+    throw std::invalid_argument("Exported buffer doesn't match this configuration");
+  }
+
+  // Carry on from where the exporter stopped.
+  JitterBuffer &buffer = *imported;
+  buffer.read_offset = snapshot.read_offset;
+  buffer.write_offset = snapshot.write_offset;
+  if (state_bytes == 0) {
+    // A shared buffer's writer may still be going, and its state is already in the mapping.
+    buffer.state->written = snapshot.written;
+    buffer.state->written_elements = snapshot.written_elements;
+    buffer.state->play = snapshot.play != 0;
+    buffer.state->target_depth_ms = snapshot.target_depth_ms;
+  }
+  if (snapshot.has_last_written) {
+    buffer.last_written_sequence_number = snapshot.last_written_sequence_number;
+  }
+  buffer.next_media_timestamp = snapshot.next_media_timestamp;
+  buffer.previous_real_offset = snapshot.previous_real_offset;
+  buffer.previous_real_elements = snapshot.previous_real_elements;
+  buffer.since_previous_real = snapshot.since_previous_real;
+  buffer.manual_time_ms = snapshot.manual_time_ms;
+  buffer.smoothed_depth_elements = snapshot.smoothed_depth_elements;
+  buffer.draining = snapshot.draining != 0;
+  const Metrics &metrics = snapshot.metrics;
+  buffer.writer_metrics.concealed_frames.Add(metrics.concealed_frames);
+  buffer.writer_metrics.filled_packets.Add(metrics.filled_packets);
+  buffer.writer_metrics.updated_frames.Add(metrics.updated_frames);
+  buffer.writer_metrics.update_missed_frames.Add(metrics.update_missed_frames);
+  buffer.writer_metrics.enqueued_bytes.Add(metrics.enqueued_bytes);
+  buffer.writer_metrics.full_dropped_packets.Add(metrics.full_dropped_packets);
+  buffer.writer_metrics.late_packets.Add(metrics.late_packets);
+  buffer.writer_metrics.update_depth_packets.Add(metrics.update_depth_packets);
+  buffer.writer_metrics.contended_claims.Add(metrics.contended_claims);
+  buffer.writer_metrics.dropped_taps.Add(metrics.dropped_taps);
+  buffer.reader_metrics.skipped_frames.Add(metrics.skipped_frames);
+  buffer.reader_metrics.dropped_frames.Add(metrics.dropped_frames);
+  buffer.reader_metrics.accelerated_frames.Add(metrics.accelerated_frames);
+  buffer.reader_metrics.seeked_frames.Add(metrics.seeked_frames);
+  buffer.reader_metrics.dequeued_bytes.Add(metrics.dequeued_bytes);
+  buffer.reader_metrics.underruns.Add(metrics.underruns);
+
+  // Rebuild the sequence lookup from the unread headers, so late packets can still update concealment.
+  // Fill repeats the sequence number before it, and was never looked up. A shared buffer's lookup stays with its writer.
+  std::optional<std::uint32_t> previous;
+  for (std::size_t offset = buffer.read_offset, walked = 0; state_bytes == 0 && walked < buffer.state->written;) {
+    const Header *header = buffer.HeaderAt(offset);
+    if (header->sequence_number != previous) {
+      // Positions are only compared with each other, so these count back from wherever this buffer's write_position is.
+      buffer.IndexSequence(header->sequence_number, offset, buffer.write_position.load(std::memory_order_relaxed) - (buffer.state->written - walked));
+    }
+    previous = header->sequence_number;
+    const std::size_t record_bytes = buffer.RecordSize(header->elements);
+    walked += record_bytes;
+    offset = buffer.Advance(offset, record_bytes);
+  }
+  return imported;
+#else
+  throw std::runtime_error("No shared memory implementation");
+#endif
+}
+
+void JitterBuffer::SetTime(const milliseconds now) {
+  manual_time_ms.store(now.count(), std::memory_order_relaxed);
+}
+
+std::size_t JitterBuffer::RecordSize(const std::size_t elements) const {
+  // Header slot, data, then padding up to the next aligned header slot.
+  return (header_bytes + elements * element_size + payload_alignment - 1) & ~(payload_alignment - 1);
+}
+
+Header *JitterBuffer::HeaderAt(const std::size_t offset) const {
+  // The header sits at the end of its slot, directly in front of the data.
+  return reinterpret_cast<Header *>(buffer + offset + header_bytes - METADATA_SIZE);
+}
+
+std::uint8_t *JitterBuffer::PayloadAt(const std::size_t offset) const {
+  return buffer + offset + header_bytes;
+}
+
+std::size_t JitterBuffer::Advance(const std::size_t offset, const std::size_t bytes) const {
+  // Nothing moves by more than the ring, so one subtract wraps it, where modulo would be a division.
+  assert(offset < max_size_bytes && bytes <= max_size_bytes);
+  const std::size_t advanced = offset + bytes;
+  return advanced >= max_size_bytes ? advanced - max_size_bytes : advanced;
+}
+
+std::size_t JitterBuffer::Rewind(const std::size_t offset, const std::size_t bytes) const {
+  assert(offset < max_size_bytes && bytes <= max_size_bytes);
+  return offset >= bytes ? offset - bytes : offset + (max_size_bytes - bytes);
+}
+
+std::size_t JitterBuffer::Distance(const std::size_t from, const std::size_t to) const {
+  assert(from < max_size_bytes && to < max_size_bytes);
+  return to >= from ? to - from : to + (max_size_bytes - from);
+}
+
+bool JitterBuffer::IsExpired(const Header *header, const std::uint64_t now_ms) const {
+  return IsExpired(header->timestamp, now_ms, max_length);
+}
+
+bool JitterBuffer::IsExpired(const std::uint32_t timestamp, const std::uint64_t now_ms, const milliseconds max_length) {
+  // Timestamps are truncated, so age with wrapping arithmetic. Packets from the future aren't expired.
+  const auto age = static_cast<std::int32_t>(static_cast<std::uint32_t>(now_ms) - timestamp);
+  return age >= max_length.count();
+}
+
+std::uint64_t JitterBuffer::Now() const {
+  switch (clock) {
+    case ClockMode::Manual:
+      return manual_time_ms.load(std::memory_order_relaxed);
+    case ClockMode::Steady:
+      break;
+  }
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+std::size_t JitterBuffer::RoundToPage(const std::size_t length, [[maybe_unused]] const bool hugetlb) {
 #ifdef __APPLE__
-  length = round_page(length);
+  return round_page(length);
+#elif _WIN32
+  // Views have to start on allocation granularity boundaries, not just pages.
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  const std::size_t page_size = info.dwAllocationGranularity;
+  return ((length + page_size - 1) / page_size) * page_size;
 #elif _GNU_SOURCE
-  const int page_size = getpagesize();
-  length = length + page_size - (length % page_size);
+#ifdef MFD_HUGETLB
+  const std::size_t page_size = hugetlb ? HUGE_PAGE_SIZE : getpagesize();
+#else
+  const std::size_t page_size = getpagesize();
+#endif
+  return ((length + page_size - 1) / page_size) * page_size;
+#else
+  // Keeps records aligned across the wrap for any supported payload_alignment.
+  const std::size_t page_size = 4096;
+  return ((length + page_size - 1) / page_size) * page_size;
 #endif
+}
+
+std::size_t JitterBuffer::CalculateRecordSize(const std::size_t element_size, const std::size_t elements, const std::size_t payload_alignment) {
+  const std::size_t header_bytes = (METADATA_SIZE + payload_alignment - 1) & ~(payload_alignment - 1);
+  return (header_bytes + elements * element_size + payload_alignment - 1) & ~(payload_alignment - 1);
+}
+
+std::size_t JitterBuffer::CalculateMappedSize(const std::size_t element_size, const std::size_t packet_elements, const std::uint32_t clock_rate, const milliseconds max_length, const JitterBufferOptions &options) {
+  const std::size_t sized_elements = MinPacketElements(packet_elements, clock_rate, options.packets);
+  const std::size_t record_bytes = CalculateRecordSize(element_size, sized_elements, options.payload_alignment);
+  return RoundToPage(CalculateBufferSize(element_size, sized_elements, clock_rate, max_length, options.sizing, record_bytes), options.hugetlb);
+}
+
+void *JitterBuffer::MakeVirtualMemory(std::size_t &length, [[maybe_unused]] const std::size_t overrun, void *&user_data, [[maybe_unused]] const JitterBufferOptions &options) {
+  // Get buffer length as multiple of page size.
+  length = RoundToPage(length, options.hugetlb);
 
   void *address;
-#if __APPLE__
+  user_data = nullptr;
+#if LIBJITTER_LINEAR_RING
+  // Nothing to mirror with, so records run on past the end instead. Every access to a record
+  // is relative to its start, so the bytes it would have wrapped onto are never needed.
+  address = ::operator new(length + overrun, std::align_val_t(4096));
+#elif __APPLE__
   vm_address_t buffer_address;
   kern_return_t result = vm_allocate(mach_task_self(), &buffer_address, length * 2, VM_FLAGS_ANYWHERE);
   if (result != ERR_SUCCESS) {
@@ -529,34 +1892,180 @@ void *JitterBuffer::MakeVirtualMemory(std::size_t &length, [[maybe_unused]] void
     throw std::runtime_error(message.str());
   }
   address = reinterpret_cast<void *>(buffer_address);
+#elif _WIN32
+  // Split a placeholder reservation in two and map the section into both halves, so nothing else
+  // can be allocated in the gap between reserving and mapping.
+  HANDLE section = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<std::uint64_t>(length) >> 32), static_cast<DWORD>(length & 0xFFFFFFFF), nullptr);
+  if (section == nullptr) {
+    throw std::runtime_error("Failed to create ring section");
+  }
+  auto *placeholder = reinterpret_cast<std::uint8_t *>(VirtualAlloc2(nullptr, nullptr, 2 * length, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0));
+  if (placeholder == nullptr) {
+    CloseHandle(section);
+    throw std::runtime_error("Failed to reserve virtual memory");
+  }
+  if (!VirtualFree(placeholder, length, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+    VirtualFree(placeholder, 0, MEM_RELEASE);
+    CloseHandle(section);
+    throw std::runtime_error("Failed to split virtual memory");
+  }
+  void *view = MapViewOfFile3(section, nullptr, placeholder, 0, length, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
+  void *mirror = MapViewOfFile3(section, nullptr, placeholder + length, 0, length, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
+  if (view == nullptr || mirror == nullptr) {
+    if (view != nullptr) {
+      UnmapViewOfFile(view);
+    } else {
+      VirtualFree(placeholder, 0, MEM_RELEASE);
+    }
+    if (mirror != nullptr) {
+      UnmapViewOfFile(mirror);
+    } else {
+      VirtualFree(placeholder + length, 0, MEM_RELEASE);
+    }
+    CloseHandle(section);
+    throw std::runtime_error("Failed to map ring views");
+  }
+  user_data = section;
+  address = view;
 #elif _GNU_SOURCE
-  int fd = memfd_create("buffer", 0);
+  int fd;
+  address = MapMirroredFile("buffer", length, 1, options, fd);
+  user_data = calloc(1, sizeof(int));
   memcpy(user_data, &fd, sizeof(fd));
-  [[maybe_unused]] int truncated = ftruncate(fd, length);
-  assert(truncated == 0);
-  address = mmap(nullptr, 2 * length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  mmap(address, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
-  auto typed_address = reinterpret_cast<std::uint8_t *>(address);
-  mmap(reinterpret_cast<void *>(typed_address + length), length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+#endif
+  return address;
+}
+
+void *JitterBuffer::MapMirroredFile([[maybe_unused]] const char *name,
+                                    [[maybe_unused]] const std::size_t length,
+                                    [[maybe_unused]] const std::size_t count,
+                                    [[maybe_unused]] const JitterBufferOptions &options,
+                                    int &fd) {
+#ifdef _GNU_SOURCE
+  const auto map = [name, length, count, &options, &fd](const unsigned int memfd_flags, const std::size_t alignment) -> void * {
+    fd = memfd_create(name, memfd_flags);
+    if (fd < 0) {
+      return MAP_FAILED;
+    }
+    void *address = ftruncate(fd, static_cast<off_t>(length * count)) == 0 ? MapRings(fd, length, count, options, alignment) : MAP_FAILED;
+    if (address == MAP_FAILED) {
+      close(fd);
+    }
+    return address;
+  };
+
+  void *address = MAP_FAILED;
+#ifdef MFD_HUGETLB
+  if (options.hugetlb && length % HUGE_PAGE_SIZE == 0) {
+    // Reserved huge pages are often not configured, which only shows up when mapping.
+    address = map(MFD_HUGETLB, HUGE_PAGE_SIZE);
+  }
+#endif
+  if (address == MAP_FAILED) {
+    address = map(0, getpagesize());
+  }
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("Failed to map ring memory");
+  }
+  if (options.huge_pages) {
+    // Advisory, so failure just means normal pages.
+    madvise(address, 2 * length * count, MADV_HUGEPAGE);
+  }
+  return address;
 #else
-  throw std::runtime_error("No virtual memory implementation");
+  fd = -1;
+  throw std::runtime_error("No shared memory implementation");
 #endif
+}
+
+#ifdef _GNU_SOURCE
+void *JitterBuffer::MapRings(const int fd, const std::size_t length, const std::size_t count, const JitterBufferOptions &options, const std::size_t alignment) {
+  // Over reserve so the first ring starts on an alignment boundary, then hand the slack back.
+  const std::size_t total = 2 * length * count;
+  auto *reserved = reinterpret_cast<std::uint8_t *>(mmap(nullptr, total + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (reserved == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  auto *address = reinterpret_cast<std::uint8_t *>((reinterpret_cast<std::uintptr_t>(reserved) + alignment - 1) & ~(alignment - 1));
+  if (address != reserved) {
+    munmap(reserved, address - reserved);
+  }
+  if (address + total != reserved + total + alignment) {
+    munmap(address + total, reserved + total + alignment - (address + total));
+  }
+
+  // Each ring is mapped twice back to back for the wrap around. Neighbouring rings are contiguous
+  // in the file too, so the kernel can merge them. Pages bound to a node are populated after binding.
+  const int populate = options.populate == PopulateMode::Prefault && options.numa_node < 0 ? MAP_POPULATE : 0;
+  for (std::size_t ring = 0; ring < count; ring++) {
+    std::uint8_t *ring_address = address + 2 * length * ring;
+    const auto offset = static_cast<off_t>(length * ring);
+    if (mmap(ring_address, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fd, offset) == MAP_FAILED ||
+        mmap(ring_address + length, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fd, offset) == MAP_FAILED) {
+      munmap(address, total);
+      return MAP_FAILED;
+    }
+  }
   return address;
 }
+#endif
 
-void JitterBuffer::FreeVirtualMemory(void *address, const std::size_t length, [[maybe_unused]] void *user_data) {
-#ifdef __APPLE__
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+JitterBuffer::SharedState *JitterBuffer::MapSharedState(const int fd, const std::size_t offset, const std::size_t length, const bool create) {
+  if (create && ftruncate(fd, static_cast<off_t>(offset + length)) != 0) {
+    return nullptr;
+  }
+  void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(offset));
+  if (address == MAP_FAILED) {
+    return nullptr;
+  }
+  // Lock free atomics are address free, so the same state works from every process mapping it.
+  return create ? new (address) SharedState() : std::launder(reinterpret_cast<SharedState *>(address));
+}
+#endif
+
+bool JitterBuffer::BindToNode([[maybe_unused]] void *address, [[maybe_unused]] const std::size_t length, [[maybe_unused]] const int node) {
+#if defined(_GNU_SOURCE) && defined(SYS_mbind)
+  // Raw syscall rather than libnuma, to avoid the dependency.
+  constexpr std::size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / bits + 1);
+  mask[node / bits] = 1UL << (node % bits);
+  // Both mappings of a ring share the same pages, so binding one binds the file.
+  return syscall(SYS_mbind, address, length, MPOL_BIND, mask.data(), mask.size() * bits + 1, MPOL_MF_MOVE) == 0;
+#else
+  return false;
+#endif
+}
+
+int JitterBuffer::CurrentNumaNode() {
+#if defined(_GNU_SOURCE) && defined(SYS_getcpu)
+  unsigned int cpu;
+  unsigned int node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return static_cast<int>(node);
+  }
+#endif
+  return -1;
+}
+
+void JitterBuffer::FreeVirtualMemory(void *address, [[maybe_unused]] const std::size_t length, [[maybe_unused]] void *user_data) {
+#if LIBJITTER_LINEAR_RING
+  ::operator delete(address, std::align_val_t(4096));
+#elif __APPLE__
   kern_return_t result = vm_deallocate(mach_task_self(), reinterpret_cast<vm_address_t>(address), length * 2);
   if (result != ERR_SUCCESS) {
     throw std::runtime_error("Failed to deallocate virtual memory");
   }
+#elif _WIN32
+  auto typed_address = reinterpret_cast<std::uint8_t *>(address);
+  UnmapViewOfFile(typed_address + length);
+  UnmapViewOfFile(address);
+  CloseHandle(user_data);
 #elif _GNU_SOURCE
   auto typed_address = reinterpret_cast<std::uint8_t *>(address);
   munmap(typed_address + length, length);
   munmap(address, length);
   close(*reinterpret_cast<int *>(user_data));
   free(user_data);
-#else
-  throw std::runtime_error("No virtual memory implementation");
 #endif
 }
@@ -0,0 +1,155 @@
+#include "JitterBufferPool.hh"
+
+#include <sstream>
+#include <stdexcept>
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono;
+
+JitterBufferPool::JitterBufferPool(const std::size_t capacity,
+                                   const std::size_t element_size,
+                                   const std::size_t packet_elements,
+                                   const std::uint32_t clock_rate,
+                                   const milliseconds max_length,
+                                   const milliseconds min_length,
+                                   const cantina::LoggerPointer &logger,
+                                   const JitterBufferOptions &options)
+    : element_size(element_size),
+      packet_elements(packet_elements),
+      clock_rate(clock_rate),
+      max_length(max_length),
+      min_length(min_length),
+      logger(std::make_shared<cantina::Logger>("POOL", logger)),
+      options(options),
+      ring_size(JitterBuffer::CalculateMappedSize(element_size, packet_elements, clock_rate, max_length, options)),
+      arena(nullptr),
+      arena_fd(-1) {
+  if (capacity == 0) {
+    throw std::invalid_argument("Pool capacity must be >0");
+  }
+
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+  // One file backs every ring, each mapped twice back to back for the wrap around.
+  arena = reinterpret_cast<std::uint8_t *>(JitterBuffer::MapMirroredFile("pool", ring_size, capacity, options, arena_fd));
+  for (std::size_t slot = 0; slot < capacity; slot++) {
+    rings.push_back(arena + 2 * ring_size * slot);
+  }
+  if (options.numa_node >= 0 && !JitterBuffer::BindToNode(arena, 2 * ring_size * capacity, options.numa_node)) {
+    this->logger->warning << "Failed to bind pool to NUMA node " << options.numa_node << std::flush;
+  }
+#else
+  // No shared arena here, but rings are still mapped once and reused.
+  const std::size_t overrun = JitterBuffer::CalculateRecordSize(element_size, packet_elements, options.payload_alignment);
+  ring_user_data.resize(capacity);
+  rings.reserve(capacity);
+  try {
+    for (std::size_t slot = 0; slot < capacity; slot++) {
+      std::size_t length = ring_size;
+      rings.push_back(reinterpret_cast<std::uint8_t *>(JitterBuffer::MakeVirtualMemory(length, overrun, ring_user_data[slot], options)));
+#if !LIBJITTER_LINEAR_RING
+      if (options.numa_node >= 0 && !JitterBuffer::BindToNode(rings.back(), ring_size, options.numa_node)) {
+        this->logger->warning << "Failed to bind pool ring to NUMA node " << options.numa_node << std::flush;
+      }
+#endif
+    }
+  } catch (...) {
+    // The destructor won't run, so give back the rings mapped so far.
+    FreeRings();
+    throw;
+  }
+#endif
+
+  streams.resize(capacity);
+  active.resize(capacity);
+  free_slots.reserve(capacity);
+  for (std::size_t slot = capacity; slot > 0; slot--) {
+    free_slots.push_back(slot - 1);
+  }
+  this->logger->debug << "Allocated JitterBufferPool of " << capacity << " rings of " << ring_size << " bytes" << std::flush;
+}
+
+JitterBufferPool::~JitterBufferPool() {
+  streams.clear();
+#if defined(_GNU_SOURCE) && !LIBJITTER_LINEAR_RING
+  munmap(arena, 2 * ring_size * rings.size());
+  close(arena_fd);
+#else
+  FreeRings();
+#endif
+}
+
+void JitterBufferPool::FreeRings() {
+#if !defined(_GNU_SOURCE) || LIBJITTER_LINEAR_RING
+  for (std::size_t slot = 0; slot < rings.size(); slot++) {
+    try {
+      JitterBuffer::FreeVirtualMemory(rings[slot], ring_size, ring_user_data[slot]);
+    } catch (...) {
+      logger->error << "Failed to free virtual memory" << std::flush;
+    }
+  }
+  rings.clear();
+#endif
+}
+
+std::optional<std::size_t> JitterBufferPool::Acquire() {
+  if (free_slots.empty()) {
+    return std::nullopt;
+  }
+  // Buffers are kept when released, and only need emptying to be used again.
+  const std::size_t slot = free_slots.back();
+  if (streams[slot]) {
+    streams[slot]->Reset();
+  } else {
+    streams[slot] = std::unique_ptr<JitterBuffer>(new JitterBuffer(element_size, packet_elements, clock_rate, max_length, min_length, logger, options, rings[slot], ring_size));
+  }
+  active[slot] = true;
+  free_slots.pop_back();
+  return slot;
+}
+
+JitterBuffer &JitterBufferPool::Get(const std::size_t slot) const {
+  if (slot >= streams.size() || !active[slot]) {
+    std::ostringstream message;
+    message << "No active stream in slot " << slot;
+    throw std::invalid_argument(message.str());
+  }
+  return *streams[slot];
+}
+
+void JitterBufferPool::Release(const std::size_t slot) {
+  if (slot >= streams.size() || !active[slot]) {
+    std::ostringstream message;
+    message << "No active stream in slot " << slot;
+    throw std::invalid_argument(message.str());
+  }
+  active[slot] = false;
+  free_slots.push_back(slot);
+}
+
+std::size_t JitterBufferPool::DequeueAll(std::uint8_t *destination, const std::size_t destination_length, const std::size_t elements, std::size_t *dequeued) {
+  const std::size_t stride = elements * element_size;
+  if (destination_length < stride * streams.size()) {
+    std::ostringstream message;
+    message << "Provided buffer too small. Was: " << destination_length << ", need: " << stride * streams.size();
+    throw std::invalid_argument(message.str());
+  }
+
+  // Slots are in address order, so this walks the arena front to back.
+  std::size_t total = 0;
+  for (std::size_t slot = 0; slot < streams.size(); slot++) {
+    dequeued[slot] = active[slot] ? streams[slot]->Dequeue(destination + slot * stride, stride, elements) : 0;
+    total += dequeued[slot];
+  }
+  return total;
+}
+
+std::size_t JitterBufferPool::GetCapacity() const {
+  return streams.size();
+}
+
+std::size_t JitterBufferPool::GetActive() const {
+  return streams.size() - free_slots.size();
+}
@@ -0,0 +1,103 @@
+#include "JitterTap.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std::chrono;
+
+JitterTap::JitterTap(JitterBuffer &buffer, const milliseconds max_length, const bool drop_when_behind)
+    : buffer(buffer),
+      slot(Claim(buffer)),
+      max_length(max_length),
+      skipped_frames(0) {
+  if (max_length.count() <= 0) {
+    slot.status.store(JitterBuffer::TapSlot::FREE, std::memory_order_release);
+    throw std::invalid_argument("Max length must be >0");
+  }
+  slot.drop_when_behind.store(drop_when_behind, std::memory_order_relaxed);
+  // The writer picks this up on its next write, starting the tap at the newest data.
+  slot.status.store(JitterBuffer::TapSlot::JOINING, std::memory_order_seq_cst);
+}
+
+JitterTap::~JitterTap() {
+  slot.status.store(JitterBuffer::TapSlot::FREE, std::memory_order_release);
+}
+
+JitterBuffer::TapSlot &JitterTap::Claim(JitterBuffer &buffer) {
+  for (JitterBuffer::TapSlot &candidate : buffer.taps) {
+    std::uint32_t expected = JitterBuffer::TapSlot::FREE;
+    if (candidate.status.compare_exchange_strong(expected, JitterBuffer::TapSlot::CLAIMED, std::memory_order_acquire)) {
+      return candidate;
+    }
+  }
+  throw std::runtime_error("No free tap slots, raise JitterBufferOptions::taps");
+}
+
+std::size_t JitterTap::Dequeue(std::uint8_t *destination, const std::size_t destination_length, const std::size_t elements) {
+  const std::size_t element_size = buffer.element_size;
+  const std::size_t required_bytes = elements * element_size;
+  if (destination_length < required_bytes) {
+    std::ostringstream message;
+    message << "Provided buffer too small. Was: " << destination_length << ", need: " << required_bytes;
+    throw std::invalid_argument(message.str());
+  }
+  if (slot.status.load(std::memory_order_acquire) != JitterBuffer::TapSlot::ACTIVE) {
+    return 0;
+  }
+
+  const std::uint64_t now_ms = buffer.Now();
+  std::uint64_t position = slot.position.load(std::memory_order_relaxed);
+  std::size_t offset = slot.offset;
+  std::size_t dequeued = 0;
+  unsigned long skipped = 0;
+  while (dequeued < elements && buffer.write_position.load(std::memory_order_acquire) > position) {
+    Header *header = buffer.HeaderAt(offset);
+    // Once dropped, the writer may be reusing this space, so read the header with relaxed loads.
+    const std::size_t record_elements = std::atomic_ref(header->elements).load(std::memory_order_relaxed);
+    if (record_elements <= slot.consumed || record_elements > buffer.packet_elements) {
+      // Only once dropped can this be written over, and then nothing read counts.
+      break;
+    }
+    const std::size_t remaining = record_elements - slot.consumed;
+    if (JitterBuffer::IsExpired(std::atomic_ref(header->timestamp).load(std::memory_order_relaxed), now_ms, max_length)) {
+      skipped += remaining;
+    } else {
+      const std::size_t to_dequeue = std::min(remaining, elements - dequeued);
+      JitterBuffer::CopyRecord(header, destination + dequeued * element_size, buffer.PayloadAt(offset) + slot.consumed * element_size, to_dequeue * element_size);
+      dequeued += to_dequeue;
+      if (to_dequeue < remaining) {
+        slot.consumed += to_dequeue;
+        break;
+      }
+    }
+    const std::size_t record_bytes = buffer.RecordSize(record_elements);
+    position += record_bytes;
+    offset = buffer.Advance(offset, record_bytes);
+    slot.consumed = 0;
+  }
+
+  // Check the writer didn't drop us meanwhile, as it may then have reused the space. A release read-modify-write keeps
+  // the reads above from moving past the check.
+  if (slot.status.fetch_add(0, std::memory_order_acq_rel) != JitterBuffer::TapSlot::ACTIVE) {
+    return 0;
+  }
+  skipped_frames += skipped;
+  slot.offset = offset;
+  slot.position.store(position, std::memory_order_release);
+  return dequeued;
+}
+
+bool JitterTap::IsDropped() const {
+  return slot.status.load(std::memory_order_acquire) == JitterBuffer::TapSlot::DROPPED;
+}
+
+void JitterTap::Rejoin() {
+  std::uint32_t expected = JitterBuffer::TapSlot::DROPPED;
+  slot.status.compare_exchange_strong(expected, JitterBuffer::TapSlot::JOINING, std::memory_order_seq_cst);
+}
+
+unsigned long JitterTap::GetSkippedFrames() const {
+  return skipped_frames;
+}
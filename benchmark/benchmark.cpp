@@ -1,152 +1,417 @@
 #include <JitterBuffer.hh>
+#include <JitterBufferT.hh>
+#include <libjitter.h>
 #include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
 std::unique_ptr<JitterBuffer> buffer;
 void *data;
 const std::size_t frame_size = 1;
 const std::size_t frames_per_packet = 480;
+const std::uint32_t sample_rate = 48000;
 
-static void DoSetup(const benchmark::State &state) {
-  const std::size_t sample_rate = 48000;
+static void DoSetup(const benchmark::State &) {
   const std::chrono::milliseconds max_time = std::chrono::milliseconds(10000);
   const std::chrono::milliseconds min_time = std::chrono::milliseconds(0);
   buffer = std::make_unique<JitterBuffer>(frame_size, frames_per_packet, sample_rate, max_time, min_time, std::make_shared<cantina::Logger>("", ""));
   data = malloc(frame_size * frames_per_packet);
 }
 
-static void DoTeardown(const benchmark::State &state) {
+static void DoTeardown(const benchmark::State &) {
   buffer.reset();
   free(data);
 }
 
+/// @brief Records the latency of individual calls, reported as percentiles since the mean hides the tail.
+class Latencies {
+  public:
+  explicit Latencies(const std::size_t capacity) {
+    // Allocate up front so recording doesn't disturb what's measured.
+    samples.reserve(capacity);
+  }
+
+  template<typename Call>
+  auto Time(Call &&call) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto result = call();
+    const auto end = std::chrono::steady_clock::now();
+    if (samples.size() < samples.capacity()) {
+      samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+    return result;
+  }
+
+  void Report(benchmark::State &state, const std::string &prefix = "") {
+    if (samples.empty()) {
+      return;
+    }
+    std::sort(samples.begin(), samples.end());
+    state.counters[prefix + "p50_ns"] = Percentile(0.5);
+    state.counters[prefix + "p99_ns"] = Percentile(0.99);
+    state.counters[prefix + "p999_ns"] = Percentile(0.999);
+    state.counters[prefix + "max_ns"] = static_cast<double>(samples.back());
+  }
+
+  private:
+  std::vector<std::int64_t> samples;
+
+  double Percentile(const double percentile) const {
+    const auto index = std::min(samples.size() - 1, static_cast<std::size_t>(percentile * samples.size()));
+    return static_cast<double>(samples[index]);
+  }
+};
+
+static Packet MakePacket(const unsigned long sequence_number, void *payload) {
+  return Packet{
+          .sequence_number = sequence_number,
+          .data = payload,
+          .length = frame_size * frames_per_packet,
+          .elements = frames_per_packet};
+}
+
+static void ZeroConcealment(Packet *packets, const std::size_t num_packets, void *) {
+  for (std::size_t index = 0; index < num_packets; index++) {
+    memset(packets[index].data, 0, packets[index].length);
+  }
+}
+
+static void NoConcealment(Packet *, std::size_t, void *) {
+  assert(false);
+}
+
 static void libjitter_enqueue(benchmark::State &state) {
-  std::size_t sequence_number = 0;
+  Latencies latencies(state.max_iterations);
+  unsigned long sequence_number = 0;
   for (auto _: state) {
-    auto packet = Packet{
-            .data = data,
-            .elements = frames_per_packet,
-            .length = frame_size * frames_per_packet,
-            .sequence_number = sequence_number++};
-    std::vector<Packet> packets = std::vector<Packet>();
-    packets.push_back(packet);
-    const std::size_t enqueued = buffer->Enqueue(
-            packets,
-            [](const std::vector<Packet> &) {
-              assert(false);
-            });
+    const Packet packet = MakePacket(sequence_number++, data);
+    const std::size_t enqueued = latencies.Time([&packet]() {
+      return buffer->Enqueue(&packet, 1, &NoConcealment, nullptr);
+    });
     if (enqueued == 0) {
       state.SkipWithMessage("Full");
       break;
     }
   }
+  latencies.Report(state);
 }
 BENCHMARK(libjitter_enqueue)->Setup(DoSetup)->Teardown(DoTeardown)->Iterations(1500);
 
 static void libjitter_concealment(benchmark::State &state) {
-  std::size_t sequence_number = 0;
-
+  Latencies latencies(state.max_iterations);
+  unsigned long sequence_number = 0;
   for (auto _: state) {
-    auto packet = Packet{
-            .data = data,
-            .elements = frames_per_packet,
-            .length = frame_size * frames_per_packet,
-            .sequence_number = ++sequence_number};
-    std::vector<Packet> packets = std::vector<Packet>();
-    packets.push_back(packet);
-    const std::size_t enqueued = buffer->Enqueue(
-            packets,
-            [](const std::vector<Packet> &) {
-              assert(false);
-            });
-    if (enqueued == 0) {
+    const Packet packet = MakePacket(++sequence_number, data);
+    if (buffer->Enqueue(&packet, 1, &NoConcealment, nullptr) == 0) {
       state.SkipWithMessage("Full");
       break;
     }
+
+    // Skip ahead, concealing the gap.
     sequence_number += state.range(0);
-    auto next = Packet{
-            .data = data,
-            .elements = frames_per_packet,
-            .length = frame_size * frames_per_packet,
-            .sequence_number = sequence_number};
-    std::vector<Packet> nexts = std::vector<Packet>();
-    nexts.push_back(next);
-    const std::size_t concealed = buffer->Enqueue(
-            nexts,
-            [](std::vector<Packet> &packets) {
-              for (Packet &packet: packets) {
-                memset(packet.data, 0, packet.length);
-              }
-            });
+    const Packet next = MakePacket(sequence_number, data);
+    const std::size_t concealed = latencies.Time([&next]() {
+      return buffer->Enqueue(&next, 1, &ZeroConcealment, nullptr);
+    });
     if (concealed == 0) {
       state.SkipWithMessage("Full");
       break;
     }
   }
+  latencies.Report(state);
 }
 BENCHMARK(libjitter_concealment)->DenseRange(1, 20, 1)->Setup(DoSetup)->Teardown(DoTeardown)->Iterations(1000);
 
-static void libjitter_concealment_update(benchmark::State &state) {
-  std::size_t sequence_number = 0;
+static void ZeroContiguousConcealment(Packet *run, const Packet *, void *) {
+  memset(run->data, 0, run->length);
+}
 
+static void libjitter_concealment_contiguous(benchmark::State &state) {
+  // As libjitter_concealment, with the whole gap concealed in one region.
+  Latencies latencies(state.max_iterations);
+  unsigned long sequence_number = 0;
   for (auto _: state) {
-    auto packet = Packet{
-            .data = data,
-            .elements = frames_per_packet,
-            .length = frame_size * frames_per_packet,
-            .sequence_number = ++sequence_number};
-    std::vector<Packet> packets = std::vector<Packet>();
-    packets.push_back(packet);
-    const std::size_t enqueued = buffer->Enqueue(
-            packets,
-            [](const std::vector<Packet> &) {
-              assert(false);
-            });
-    if (enqueued == 0) {
+    const Packet packet = MakePacket(++sequence_number, data);
+    if (buffer->Enqueue(&packet, 1, &NoConcealment, nullptr) == 0) {
       state.SkipWithMessage("Full");
       break;
     }
+
     sequence_number += state.range(0);
-    auto next = Packet{
-            .data = data,
-            .elements = frames_per_packet,
-            .length = frame_size * frames_per_packet,
-            .sequence_number = sequence_number};
-    std::vector<Packet> nexts = std::vector<Packet>();
-    nexts.push_back(next);
-    const std::size_t concealed = buffer->Enqueue(
-            nexts,
-            [](std::vector<Packet> &packets) {
-              for (Packet &packet: packets) {
-                memset(packet.data, 0, packet.length);
-              }
-            });
+    const Packet next = MakePacket(sequence_number, data);
+    const std::size_t concealed = latencies.Time([&next]() {
+      return buffer->Enqueue(&next, 1, &ZeroContiguousConcealment, nullptr);
+    });
     if (concealed == 0) {
       state.SkipWithMessage("Full");
       break;
     }
+  }
+  latencies.Report(state);
+}
+BENCHMARK(libjitter_concealment_contiguous)->DenseRange(1, 20, 1)->Setup(DoSetup)->Teardown(DoTeardown)->Iterations(1000);
+
+static void libjitter_concealment_update(benchmark::State &state) {
+  // Each iteration one packet arrives late, behind range(0) packets that overtook it,
+  // so it updates its concealment. Reading back what was written keeps the buffer in steady state.
+  Latencies latencies(state.max_iterations);
+  const unsigned long depth = state.range(0);
+  std::vector<std::uint8_t> destination(frame_size * frames_per_packet * (depth + 1));
+  const Packet first = MakePacket(0, data);
+  buffer->Enqueue(&first, 1, &NoConcealment, nullptr);
+  unsigned long sequence_number = 1;
+  for (auto _: state) {
+    for (unsigned long ahead = 1; ahead <= depth; ahead++) {
+      const Packet overtaking = MakePacket(sequence_number + ahead, data);
+      buffer->Enqueue(&overtaking, 1, &ZeroConcealment, nullptr);
+    }
+    const Packet late = MakePacket(sequence_number, data);
+    const std::size_t updated = latencies.Time([&late]() {
+      return buffer->Enqueue(&late, 1, &NoConcealment, nullptr);
+    });
+    if (updated == 0) {
+      state.SkipWithMessage("Update missed");
+      break;
+    }
+    buffer->Dequeue(destination.data(), destination.size(), frames_per_packet * (depth + 1));
+    sequence_number += depth + 1;
+  }
+  latencies.Report(state);
+}
+BENCHMARK(libjitter_concealment_update)->RangeMultiplier(2)->Range(1, 32)->Setup(DoSetup)->Teardown(DoTeardown)->Iterations(10000);
+
+static void libjitter_dequeue(benchmark::State &state) {
+  // Reads of range(0) elements, so most reads split a packet.
+  Latencies latencies(state.max_iterations);
+  const std::size_t elements = state.range(0);
+  std::vector<std::uint8_t> destination(frame_size * elements);
+  unsigned long sequence_number = 0;
+  for (auto _: state) {
+    while (buffer->GetCurrentDepth() < std::chrono::milliseconds(100)) {
+      const Packet packet = MakePacket(sequence_number++, data);
+      buffer->Enqueue(&packet, 1, &NoConcealment, nullptr);
+    }
+    const std::size_t dequeued = latencies.Time([&destination, elements]() {
+      return buffer->Dequeue(destination.data(), destination.size(), elements);
+    });
+    if (dequeued != elements) {
+      state.SkipWithMessage("Short read");
+      break;
+    }
+  }
+  latencies.Report(state);
+}
+BENCHMARK(libjitter_dequeue)->Arg(160)->Arg(441)->Arg(480)->Arg(1024)->Setup(DoSetup)->Teardown(DoTeardown)->Iterations(10000);
 
-    // Update all the concealement packets with real data.
-    for (unsigned long index = 2; index <= state.range() + 1; index++) {
-        auto update = Packet{
-            .data = data,
-            .elements = frames_per_packet,
-            .length = frame_size * frames_per_packet,
-            .sequence_number = index};
-        std::vector<Packet> updates = std::vector<Packet>();
-        updates.push_back(next);
-        const std::size_t updated = buffer->Enqueue(
-            updates,
-            [](std::vector<Packet> &packets) {
-              assert(false);
-            });
-        if (updated == 0) {
-            state.SkipWithMessage("Full");
-            break;
-        }
-    }
-  }
-}
-BENCHMARK(libjitter_concealment_update)->DenseRange(1, 20, 1)->Setup(DoSetup)->Teardown(DoTeardown)->Iterations(100);
\ No newline at end of file
+static void libjitter_dequeue_expired(benchmark::State &state) {
+  // Each read has to drop range(0) expired packets before finding live data.
+  const std::chrono::milliseconds max_time = std::chrono::milliseconds(1000);
+  JitterBuffer expiring(frame_size, frames_per_packet, sample_rate, max_time, std::chrono::milliseconds(0), std::make_shared<cantina::Logger>("", ""), {.clock = ClockMode::Manual});
+  Latencies latencies(state.max_iterations);
+  std::vector<std::uint8_t> payload(frame_size * frames_per_packet);
+  std::vector<std::uint8_t> destination(frame_size * frames_per_packet);
+  std::chrono::milliseconds now(0);
+  unsigned long sequence_number = 0;
+  for (auto _: state) {
+    for (long stale = 0; stale < state.range(0); stale++) {
+      const Packet packet = MakePacket(sequence_number++, payload.data());
+      expiring.Enqueue(&packet, 1, &NoConcealment, nullptr);
+    }
+    now += max_time;
+    expiring.SetTime(now);
+    const Packet live = MakePacket(sequence_number++, payload.data());
+    expiring.Enqueue(&live, 1, &NoConcealment, nullptr);
+    const std::size_t dequeued = latencies.Time([&expiring, &destination]() {
+      return expiring.Dequeue(destination.data(), destination.size(), frames_per_packet);
+    });
+    if (dequeued != frames_per_packet) {
+      state.SkipWithMessage("Short read");
+      break;
+    }
+  }
+  latencies.Report(state);
+}
+BENCHMARK(libjitter_dequeue_expired)->RangeMultiplier(4)->Range(1, 64)->Iterations(10000);
+
+static void libjitter_dequeue_planar(benchmark::State &state) {
+  // 16 bit stereo into planar buffers: Dequeue then split (range(0) == 0), or scatter straight out with DequeueV.
+  const std::size_t sample_size = sizeof(std::int16_t);
+  const std::size_t stereo_size = 2 * sample_size;
+  JitterBuffer stereo(stereo_size, frames_per_packet, sample_rate, std::chrono::milliseconds(1000), std::chrono::milliseconds(0), std::make_shared<cantina::Logger>("", ""));
+  Latencies latencies(state.max_iterations);
+  std::vector<std::uint8_t> payload(stereo_size * frames_per_packet);
+  std::vector<std::uint8_t> interleaved(stereo_size * frames_per_packet);
+  std::vector<std::int16_t> left(frames_per_packet);
+  std::vector<std::int16_t> right(frames_per_packet);
+  const ScatterSpan spans[] = {
+          {.destination = reinterpret_cast<std::uint8_t *>(left.data()), .destination_length = left.size() * sample_size, .offset = 0, .bytes = sample_size, .stride = sample_size},
+          {.destination = reinterpret_cast<std::uint8_t *>(right.data()), .destination_length = right.size() * sample_size, .offset = sample_size, .bytes = sample_size, .stride = sample_size},
+  };
+  const bool scatter = state.range(0) != 0;
+  unsigned long sequence_number = 0;
+  for (auto _: state) {
+    while (stereo.GetCurrentDepth() < std::chrono::milliseconds(100)) {
+      const Packet packet = {.sequence_number = sequence_number++, .data = payload.data(), .length = payload.size(), .elements = frames_per_packet};
+      stereo.Enqueue(&packet, 1, &NoConcealment, nullptr);
+    }
+    const std::size_t dequeued = latencies.Time([&]() {
+      if (scatter) {
+        return stereo.DequeueV(spans, 2, frames_per_packet);
+      }
+      const std::size_t elements = stereo.Dequeue(interleaved.data(), interleaved.size(), frames_per_packet);
+      const auto *samples = reinterpret_cast<const std::int16_t *>(interleaved.data());
+      for (std::size_t index = 0; index < elements; index++) {
+        left[index] = samples[2 * index];
+        right[index] = samples[2 * index + 1];
+      }
+      return elements;
+    });
+    if (dequeued != frames_per_packet) {
+      state.SkipWithMessage("Short read");
+      break;
+    }
+    benchmark::DoNotOptimize(left.data());
+    benchmark::DoNotOptimize(right.data());
+  }
+  latencies.Report(state);
+}
+BENCHMARK(libjitter_dequeue_planar)->Arg(0)->Arg(1)->Iterations(10000);
+
+static void libjitter_stretch_pcm16(benchmark::State &state) {
+  // Squeezing a 10ms stereo read out of range(0)% more input, as a draining Dequeue does.
+  const std::size_t stereo_size = 2 * sizeof(std::int16_t);
+  const std::size_t input_elements = frames_per_packet + frames_per_packet * state.range(0) / 100;
+  std::vector<std::int16_t> input(2 * input_elements);
+  for (std::size_t index = 0; index < input.size(); index++) {
+    input[index] = static_cast<std::int16_t>(index * 37);
+  }
+  std::vector<std::uint8_t> output(stereo_size * frames_per_packet);
+  for (auto _: state) {
+    JitterBuffer::StretchPcm16(reinterpret_cast<const std::uint8_t *>(input.data()), input_elements, output.data(), frames_per_packet, stereo_size, nullptr);
+    benchmark::DoNotOptimize(output.data());
+  }
+}
+BENCHMARK(libjitter_stretch_pcm16)->Arg(5)->Arg(10)->Arg(25);
+
+template<typename Trip>
+static void RoundTrip(benchmark::State &state, Trip round_trip) {
+  Latencies latencies(state.max_iterations);
+  std::vector<std::uint8_t> payload(frame_size * frames_per_packet);
+  std::vector<std::uint8_t> destination(frame_size * frames_per_packet);
+  unsigned long sequence_number = 0;
+  for (auto _: state) {
+    const Packet packet = MakePacket(sequence_number++, payload.data());
+    const std::size_t dequeued = latencies.Time([&round_trip, &packet, &destination]() {
+      return round_trip(packet, destination);
+    });
+    if (dequeued != frames_per_packet) {
+      state.SkipWithMessage("Short read");
+      break;
+    }
+  }
+  latencies.Report(state);
+}
+
+static void libjitter_round_trip_fixed_shape(benchmark::State &state) {
+  // The same packet in and out, through the runtime shape for 0 and one fixed at compile time for 1.
+  const std::chrono::milliseconds max_time = std::chrono::milliseconds(1000);
+  const auto logger = std::make_shared<cantina::Logger>("", "");
+  if (state.range(0) == 0) {
+    JitterBuffer runtime(frame_size, frames_per_packet, sample_rate, max_time, std::chrono::milliseconds(0), logger);
+    RoundTrip(state, [&runtime](const Packet &packet, std::vector<std::uint8_t> &destination) {
+      runtime.Enqueue(&packet, 1, &NoConcealment, nullptr);
+      return runtime.Dequeue(destination.data(), destination.size(), frames_per_packet);
+    });
+  } else {
+    JitterBufferT<frame_size, frames_per_packet> fixed(sample_rate, max_time, std::chrono::milliseconds(0), logger);
+    RoundTrip(state, [&fixed](const Packet &packet, std::vector<std::uint8_t> &destination) {
+      fixed.EnqueueFixed(&packet, 1, &NoConcealment, nullptr);
+      return fixed.DequeueFixed(destination.data(), destination.size(), frames_per_packet);
+    });
+  }
+}
+BENCHMARK(libjitter_round_trip_fixed_shape)->Arg(0)->Arg(1)->Iterations(100000);
+
+static void PinToCore([[maybe_unused]] const unsigned int core) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core % std::thread::hardware_concurrency(), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void libjitter_duplex(benchmark::State &state) {
+  // Writer and reader on two pinned threads, as in production.
+  const std::chrono::milliseconds max_time = std::chrono::milliseconds(1000);
+  auto duplex = std::make_unique<JitterBuffer>(frame_size, frames_per_packet, sample_rate, max_time, std::chrono::milliseconds(0), std::make_shared<cantina::Logger>("", ""));
+  std::atomic<bool> running = true;
+  Latencies enqueue_latencies(1 << 20);
+  std::thread writer([&duplex, &running, &enqueue_latencies, max_time]() {
+    PinToCore(0);
+    std::vector<std::uint8_t> payload(frame_size * frames_per_packet);
+    unsigned long sequence_number = 0;
+    while (running.load(std::memory_order_relaxed)) {
+      if (duplex->GetCurrentDepth() > max_time / 2) continue;
+      const Packet packet = MakePacket(sequence_number, payload.data());
+      const std::size_t enqueued = enqueue_latencies.Time([&duplex, &packet]() {
+        return duplex->Enqueue(&packet, 1, &ZeroConcealment, nullptr);
+      });
+      sequence_number += enqueued > 0;
+    }
+  });
+
+  PinToCore(1);
+  Latencies dequeue_latencies(1 << 20);
+  std::vector<std::uint8_t> destination(frame_size * frames_per_packet);
+  std::size_t dequeued = 0;
+  for (auto _: state) {
+    dequeued += dequeue_latencies.Time([&duplex, &destination]() {
+      return duplex->Dequeue(destination.data(), destination.size(), frames_per_packet);
+    });
+  }
+  running = false;
+  writer.join();
+  state.counters["elements"] = benchmark::Counter(static_cast<double>(dequeued), benchmark::Counter::kIsRate);
+  dequeue_latencies.Report(state, "dequeue_");
+  enqueue_latencies.Report(state, "enqueue_");
+}
+BENCHMARK(libjitter_duplex)->UseRealTime();
+
+static void clibjitter_round_trip(benchmark::State &state) {
+  // The same write then read through the C API, the path taken by non C++ hosts.
+  void *jitter = JitterInit(frame_size, frames_per_packet, sample_rate, 1000, 0, new cantina::Logger("", ""));
+  Latencies enqueue_latencies(state.max_iterations);
+  Latencies dequeue_latencies(state.max_iterations);
+  std::vector<std::uint8_t> payload(frame_size * frames_per_packet);
+  std::vector<std::uint8_t> destination(frame_size * frames_per_packet);
+  unsigned long sequence_number = 0;
+  for (auto _: state) {
+    const Packet packet = MakePacket(sequence_number++, payload.data());
+    enqueue_latencies.Time([jitter, &packet]() {
+      return JitterEnqueue(jitter, &packet, 1, &ZeroConcealment, nullptr);
+    });
+    const std::size_t dequeued = dequeue_latencies.Time([jitter, &destination]() {
+      return JitterDequeue(jitter, destination.data(), destination.size(), frames_per_packet);
+    });
+    if (dequeued != frames_per_packet) {
+      state.SkipWithMessage("Short read");
+      break;
+    }
+  }
+  JitterDestroy(jitter);
+  enqueue_latencies.Report(state, "enqueue_");
+  dequeue_latencies.Report(state, "dequeue_");
+}
+BENCHMARK(clibjitter_round_trip)->Iterations(10000);
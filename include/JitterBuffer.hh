@@ -2,47 +2,215 @@
 
 #include "Packet.h"
 #include "Metrics.h"
+#include "Scatter.h"
+#include "TraceRing.hh"
 
 #include <cantina/logger.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <chrono>
+#include <coroutine>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <optional>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+// Where the ring can't be mapped twice back to back, it's allocated once with room for a record to run
+// past the end. Define LIBJITTER_NO_MIRROR to use this everywhere, e.g. for platforms without memfd.
+#if defined(LIBJITTER_NO_MIRROR) || !(defined(__APPLE__) || defined(_WIN32) || defined(_GNU_SOURCE))
+#define LIBJITTER_LINEAR_RING 1
+#endif
+
+/// @brief Written into the ring immediately before each packet's data.
 struct Header {
+  /// @brief State bit set while the data is concealment, cleared once it's updated with real data.
+  constexpr static std::uint32_t CONCEALMENT = 1u << 0;
+  /// @brief State bit set by the writer while it copies real data over concealment.
+  constexpr static std::uint32_t WRITING = 1u << 1;
+  /// @brief State bit set by the reader while Peek lends out concealment, so it isn't rewritten underneath the caller.
+  constexpr static std::uint32_t PINNED = 1u << 2;
+  /// @brief Elements already read are kept in the state above the flag bits.
+  constexpr static unsigned CONSUMED_SHIFT = 3;
+
   std::uint32_t sequence_number;
-  std::size_t elements;
-  std::uint64_t timestamp;
-  bool concealment;
-  std::atomic_flag in_use = ATOMIC_FLAG_INIT;
-  std::size_t previous_elements;
+  std::uint32_t elements;
+  /// @brief Low 32 bits of the enqueue time in milliseconds, aged with wrapping arithmetic.
+  std::uint32_t timestamp;
+  /// @brief Media time of the first element in clock_rate units, wrapping. Made up ones continue on from the previous record.
+  std::uint32_t media_timestamp;
+  /// @brief Flags and consumed count. Concealment is updated at most once, so the flags double as the record's version.
+  std::atomic<std::uint32_t> state = 0;
+
+  bool IsConcealment() const { return state.load(std::memory_order_acquire) & CONCEALMENT; }
+  std::uint32_t Consumed() const { return state.load(std::memory_order_relaxed) >> CONSUMED_SHIFT; }
+
+  /// @brief Stop concealment being updated while the reader hands it out. Real data is never rewritten, so needs no pin.
+  /// @returns True if an update was in flight, and had to be waited out.
+  bool Pin() {
+    std::uint32_t expected = state.load(std::memory_order_acquire);
+    bool waited = false;
+    while (expected & CONCEALMENT) {
+      if (expected & WRITING) {
+        // The writer is partway through one packet's copy, and never blocks during it.
+        waited = true;
+        expected = state.load(std::memory_order_acquire);
+        continue;
+      }
+      if (state.compare_exchange_weak(expected, expected | PINNED, std::memory_order_acquire, std::memory_order_acquire)) break;
+    }
+    return waited;
+  }
+
+  /// @brief Give back a Pin.
+  void Unpin() {
+    if (state.load(std::memory_order_relaxed) & PINNED) state.fetch_and(~PINNED, std::memory_order_release);
+  }
+};
+
+/// @brief How the ring backing a JitterBuffer is sized.
+enum class SizingMode {
+  /// @brief Reserve a header's worth of space for every element.
+  PerElement,
+  /// @brief Reserve a header's worth of space for every packet.
+  PerPacket,
+};
+
+/// @brief Where a JitterBuffer gets the current time from when ageing packets.
+enum class ClockMode {
+  /// @brief Sample std::chrono::steady_clock once per Enqueue/Dequeue call.
+  Steady,
+  /// @brief Use the time last given to JitterBuffer::SetTime, e.g. a media clock.
+  Manual,
+};
+
+/// @brief How a JitterBuffer picks the depth it fills to before and during playout.
+enum class DepthMode {
+  /// @brief Always min_length.
+  Fixed,
+  /// @brief Follow arrival jitter, within min_length and max_length.
+  Adaptive,
+};
+
+/// @brief The width of the sequence numbers packets arrive with. Either way they're compared with serial
+/// number arithmetic (RFC 1982), so they can roll over.
+enum class SequenceMode {
+  /// @brief 32 bit sequence numbers.
+  Full,
+  /// @brief 16 bit RTP sequence numbers, extended with a rollover count as in RFC 3550 A.1.
+  /// Sequence numbers handed back, e.g. in concealment and Peek, are 16 bit too.
+  Rtp,
+};
+
+/// @brief Which packet sizes Enqueue accepts.
+enum class PacketMode {
+  /// @brief Every packet has exactly packet_elements.
+  Fixed,
+  /// @brief Packets have anywhere from 1ms up to packet_elements, e.g. across ptime changes or codec switches.
+  /// Concealment repeats the size of the last real packet.
+  Variable,
+};
+
+/// @brief When the pages backing a JitterBuffer's ring are faulted in.
+enum class PopulateMode {
+  /// @brief Touch every page at construction.
+  Eager,
+  /// @brief Leave pages to be faulted in as they're first written. A fresh mapping is already zeroed.
+  Lazy,
+  /// @brief Have the kernel populate pages while mapping (MAP_POPULATE), else as Eager.
+  Prefault,
+};
+
+/// @brief Optional construction time settings for a JitterBuffer.
+struct JitterBufferOptions {
+  /// @brief How to size the ring to hold max_length worth of data.
+  SizingMode sizing = SizingMode::PerElement;
+  /// @brief Where timestamps come from.
+  ClockMode clock = ClockMode::Steady;
+  /// @brief Alignment of every packet's data in the ring, e.g. 16 or 64 for SIMD reads.
+  /// Must be a power of two between alignof(Header) and 4096. Records are padded to keep it.
+  std::size_t payload_alignment = alignof(Header);
+  /// @brief Whether the target depth is fixed or follows the network.
+  DepthMode depth = DepthMode::Fixed;
+  /// @brief Adaptive only: number of recent arrivals the jitter estimate covers.
+  std::size_t depth_window = 100;
+  /// @brief Adaptive only: fraction of recent arrivals the target depth should absorb.
+  double depth_percentile = 0.95;
+  /// @brief When to take the page faults for the ring.
+  PopulateMode populate = PopulateMode::Eager;
+  /// @brief Ask for transparent huge pages for the ring, where supported. Best effort, and only useful
+  /// for rings that are a multiple of the huge page size.
+  bool huge_pages = false;
+  /// @brief Back the ring with reserved huge pages (MFD_HUGETLB), rounding its size up to HUGE_PAGE_SIZE.
+  /// Falls back to normal pages if none are available, e.g. when vm.nr_hugepages is 0.
+  bool hugetlb = false;
+  /// @brief Bind the ring's memory to this NUMA node, ideally the one running the playout thread (see CurrentNumaNode).
+  /// -1 leaves placement to the kernel. Best effort, a failed bind is logged and ignored. Ignored for linear rings
+  /// (LIBJITTER_LINEAR_RING), which are allocated from the heap.
+  int numa_node = -1;
+  /// @brief The width of packet sequence numbers.
+  SequenceMode sequence = SequenceMode::Full;
+  /// @brief Whether packets are all packet_elements long, or may vary up to it. Variable sizes the ring and
+  /// sequence lookup for 1ms packets, so any mix of sizes still holds max_length.
+  PacketMode packets = PacketMode::Fixed;
+  /// @brief Trace events each of the writer and reader can hold until drained by DrainTrace. 0 turns tracing off,
+  /// as does building with LIBJITTER_TRACING off, which holds none whatever this asks for.
+  std::size_t trace_capacity = 256;
+  /// @brief Depth beyond which a stretching Dequeue plays out faster, until back down to the target. 0 never does.
+  std::chrono::milliseconds drain_depth = std::chrono::milliseconds(0);
+  /// @brief Most extra input a draining Dequeue takes, as a fraction of the output asked for. E.g. 0.1 plays 10% fast.
+  double drain_rate = 0.1;
+  /// @brief Keep what the writer and reader both change inside the ring's mapping rather than the object, so Export
+  /// can hand the reader to another process while this one carries on writing. Needs the mirrored ring on Linux.
+  bool shared = false;
+  /// @brief Extra readers that can attach with JitterTap, each reading the stream at its own pace.
+  /// Space is only reused once the slowest has read past it, so a stalled tap holds up the writer unless it's droppable.
+  std::size_t taps = 0;
 };
 
 class JitterBuffer {
   public:
-  const static std::size_t METADATA_SIZE = sizeof(Header);
+  constexpr static std::size_t METADATA_SIZE = sizeof(Header);
+
+  /// @brief Size rings are rounded up to when backed by reserved huge pages.
+  constexpr static std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  /// @brief Alignment used to keep writer, reader and shared state on separate cache lines.
+  /// Defined once with TraceRing, which this builds on, so both pad to the platform's line size.
+  constexpr static std::size_t CACHE_LINE_SIZE = TraceRing::CACHE_LINE_SIZE;
 
   typedef std::function<void(std::vector<Packet> &packets)> ConcealmentCallback;
+  typedef void (*ConcealmentFunction)(Packet *packets, std::size_t num_packets, void *user_data);
+  /// @brief Conceals a whole run of missing packets at once into run, one contiguous region of run->elements.
+  /// previous is the last real packet written before the run, for context, or nullptr if it's no longer held.
+  typedef void (*ContiguousConcealmentFunction)(Packet *run, const Packet *previous, void *user_data);
+  typedef void (*TraceFunction)(const TraceEvent *event, void *user_data);
+  /// @brief Plays input_elements of input in output_elements of output, fewer, for accelerated playout. E.g. StretchPcm16.
+  typedef void (*StretchFunction)(const std::uint8_t *input, std::size_t input_elements, std::uint8_t *output, std::size_t output_elements, std::size_t element_size, void *user_data);
 
   /**
    * @brief Construct a new Jitter Buffer object.
    *
    * @param element_size Size of held elements in bytes.
-   * @param packet_elements Number of elements in packets.
+   * @param packet_elements Number of elements in packets, or the most in any one for PacketMode::Variable.
    * @param clock_rate Clock rate of elements contained in Hz. E.g 48kHz audio is 48000.
    * @param max_length The maximum lenghth of the buffer in milliseconds.
    * @param min_length The minimum age of packets in milliseconds before eligible for dequeue.
+   * @param logger Parent logger.
+   * @param options Optional construction time settings.
    */
   JitterBuffer(std::size_t element_size,
                std::size_t packet_elements,
                std::uint32_t clock_rate,
                std::chrono::milliseconds max_length,
                std::chrono::milliseconds min_length,
-               const cantina::LoggerPointer &logger);
+               const cantina::LoggerPointer &logger,
+               const JitterBufferOptions &options = JitterBufferOptions());
 
   /**
    * @brief Destroy the Jitter Buffer object
@@ -57,6 +225,24 @@ class JitterBuffer {
    */
   std::size_t Prepare(const std::uint32_t sequence_number, const ConcealmentCallback &concealment_callback);
 
+  /**
+   * @brief Prepare the buffer for the given sequence number, without allocating.
+   *
+   * @param sequence_number The sequence number to prepare for.
+   * @param concealment_callback Fired when concealment data needs to be generated.
+   * @param user_data Passed to concealment_callback.
+   */
+  std::size_t Prepare(std::uint32_t sequence_number, ConcealmentFunction concealment_callback, void *user_data);
+
+  /**
+   * @brief Prepare the buffer for the given sequence number, concealing the gap in one contiguous region.
+   *
+   * @param sequence_number The sequence number to prepare for.
+   * @param concealment_callback Fired with the whole run when concealment data needs to be generated.
+   * @param user_data Passed to concealment_callback.
+   */
+  std::size_t Prepare(std::uint32_t sequence_number, ContiguousConcealmentFunction concealment_callback, void *user_data);
+
   /**
    * @brief Enqueue a number of packets onto the buffer. This must be called from a single writer thread.
    *
@@ -66,6 +252,54 @@ class JitterBuffer {
    */
   std::size_t Enqueue(const std::vector<Packet> &packets, const ConcealmentCallback &concealment_callback);
 
+  /**
+   * @brief Enqueue a number of packets onto the buffer, without allocating. This must be called from a single writer thread.
+   *
+   * @param packets The packets to enqueue.
+   * @param num_packets Number of packets in packets.
+   * @param concealment_callback Fired when concealment data needs to be generated.
+   * @param user_data Passed to concealment_callback.
+   * @returns The number of elements actually enqueued, including concealment.
+   */
+  std::size_t Enqueue(const Packet *packets, std::size_t num_packets, ConcealmentFunction concealment_callback, void *user_data);
+
+  /**
+   * @brief Enqueue a number of packets onto the buffer, concealing each gap in one contiguous region.
+   * The run is generated in scratch memory then copied into place, and the scratch only grows to fit the longest run seen.
+   * This must be called from a single writer thread.
+   *
+   * @param packets The packets to enqueue.
+   * @param num_packets Number of packets in packets.
+   * @param concealment_callback Fired with the whole run when concealment data needs to be generated.
+   * @param user_data Passed to concealment_callback.
+   * @returns The number of elements actually enqueued, including concealment.
+   */
+  std::size_t Enqueue(const Packet *packets, std::size_t num_packets, ContiguousConcealmentFunction concealment_callback, void *user_data);
+
+  /**
+   * @brief Reserve space for the next packet so it can be written in place, e.g. decoded straight into the buffer.
+   * Nothing is visible to the reader until CommitWrite. Gaps are not concealed, call Prepare first for that.
+   * This must be called from the single writer thread, and nothing else may be written until CommitWrite.
+   *
+   * @param sequence_number The sequence number of the packet to be written. Must be newer than any written so far.
+   * @returns Pointer to packet_elements * element_size writable bytes, or nullptr if this can't be written.
+   * @throws std::logic_error if called again, or Enqueue or Prepare are called, before CommitWrite.
+   */
+  std::uint8_t *Reserve(std::uint32_t sequence_number);
+
+  /**
+   * @brief Publish the packet written into the space from the last Reserve.
+   * @returns The number of elements enqueued.
+   */
+  std::size_t CommitWrite();
+
+  /**
+   * @brief Publish the packet written into the space from the last Reserve, when it turned out shorter.
+   * @param elements Number of elements written. Anything but packet_elements needs PacketMode::Variable.
+   * @returns The number of elements enqueued.
+   */
+  std::size_t CommitWrite(std::size_t elements);
+
   /**
    * @brief Dequeue a number of packets into the given destination. This must be called from a single reader thread.
    *
@@ -76,6 +310,73 @@ class JitterBuffer {
    */
   std::size_t Dequeue(std::uint8_t *destination, const std::size_t &destination_length, const std::size_t &elements);
 
+  /**
+   * @brief Dequeue a number of elements, scattering slices of each into separate destinations as they come out of the ring.
+   * E.g. for 16 bit stereo into planar buffers: {left, .., 0, 2, 2} and {right, .., 2, 2, 2}.
+   * This must be called from the single reader thread.
+   *
+   * @param spans Where each slice of every element goes.
+   * @param num_spans Number of spans.
+   * @param elements The number of elements to dequeue.
+   * @returns The number of elements actually dequeued.
+   */
+  std::size_t DequeueV(const ScatterSpan *spans, std::size_t num_spans, std::size_t elements);
+
+  /**
+   * @brief Dequeue the elements starting at a media time, first throwing away everything before it in one pass.
+   * Whole packets are stepped over without being read, e.g. to resync with video after a stall.
+   * This must be called from the single reader thread.
+   *
+   * @param media_timestamp Media time to start from, in the units of Packet::media_timestamp.
+   * @param destination The buffer to copy the data into.
+   * @param destination_length Length of destination buffer in bytes.
+   * @param elements The number of elements to dequeue.
+   * @returns The number of elements actually dequeued. 0, with nothing dropped, if the buffered data starts after media_timestamp.
+   */
+  std::size_t DequeueAt(std::uint32_t media_timestamp, std::uint8_t *destination, std::size_t destination_length, std::size_t elements);
+
+  /**
+   * @brief Dequeue as Dequeue, but once depth passes drain_depth, take up to drain_rate more input and have stretch
+   * squeeze it into the elements asked for, until depth is back to the target. This catches up after a burst without
+   * the jump expiry makes. This must be called from the single reader thread.
+   *
+   * @param destination The buffer to copy the data into.
+   * @param destination_length Length of destination buffer in bytes.
+   * @param elements The number of elements to output.
+   * @param stretch Compresses input into output while draining.
+   * @param user_data Passed to stretch.
+   * @returns The number of elements output.
+   */
+  std::size_t Dequeue(std::uint8_t *destination, std::size_t destination_length, std::size_t elements, StretchFunction stretch, void *user_data);
+
+  /**
+   * @brief A StretchFunction for interleaved 16 bit PCM, with element_size / 2 channels.
+   * Splices out the surplus where the signal best matches itself, cross fading over the join (WSOLA style).
+   */
+  static void StretchPcm16(const std::uint8_t *input, std::size_t input_elements, std::uint8_t *output, std::size_t output_elements, std::size_t element_size, void *user_data);
+
+  /**
+   * @brief Get pointers straight into the buffer for up to the next N playable elements, without copying.
+   * Expired packets at the front are dropped, as in Dequeue. Concealment packets returned are held
+   * until CommitRead, so they can't be updated while being read. Another Peek or any Dequeue gives back whatever
+   * wasn't committed. This must be called from the single reader thread.
+   *
+   * @param elements The number of elements wanted.
+   * @param spans Filled with one span per packet, each pointing into the buffer.
+   * @param max_spans Capacity of spans.
+   * @returns The number of spans filled.
+   */
+  std::size_t Peek(std::size_t elements, Packet *spans, std::size_t max_spans);
+
+  /**
+   * @brief Consume elements returned by the last Peek, releasing them for reuse.
+   * Any peeked but uncommitted data stays in the buffer.
+   *
+   * @param elements The number of elements actually used, up to the number peeked.
+   * @returns The number of elements consumed.
+   */
+  std::size_t CommitRead(std::size_t elements);
+
   /**
    * @brief Get a read pointer for the buffer at the given packet offset.
    * @param read_offset_elements Offset in packets.
@@ -89,45 +390,524 @@ class JitterBuffer {
    */
   std::chrono::milliseconds GetCurrentDepth() const;
 
+  /**
+   * @brief Get a snapshot of the metrics. May be called from any thread.
+   * Each thread's counters are read from between its calls, so related counters agree, e.g. updates never exceed concealment.
+   * If a thread is stuck inside a call throughout, its counters are read as they are.
+   * @return The metrics.
+   */
   Metrics GetMetrics() const;
 
+  /**
+   * @brief Hand trace events from the writer and reader to a callback, in place of logging on those threads.
+   * Call periodically from one background thread.
+   * @param callback Called with each event, writer's then reader's.
+   * @param user_data Passed to callback.
+   * @return Number of events drained.
+   */
+  std::size_t DrainTrace(TraceFunction callback, void *user_data);
+
+  /**
+   * @brief Log trace events from the writer and reader. Call periodically from one background thread.
+   * @return Number of events drained.
+   */
+  std::size_t DrainTrace();
+
+  /**
+   * @brief Describe a trace event in words, as DrainTrace logs it.
+   * @param event The event.
+   * @return The description.
+   */
+  static std::string DescribeTraceEvent(const TraceEvent &event);
+
+  /**
+   * @brief Empty the buffer so it can be reused for a new stream, without remapping.
+   * Neither the writer nor the reader may be using the buffer during this call, nor DrainTrace, as undrained
+   * trace events are discarded. A coroutine still waiting in WaitForElementsAsync is forgotten, not resumed, and
+   * the eventfd is disarmed.
+   */
+  void Reset();
+
+  /**
+   * @brief Hand this buffer to another process, e.g. for a rolling upgrade, by sending its ring's file descriptor and
+   * position over a Unix domain socket. The ring isn't copied, the importer maps the same pages and carries on.
+   * Neither the writer nor the reader may use this buffer during or after this call, it can only be destroyed.
+   * If it's shared (JitterBufferOptions::shared), call this from the writer: the importer becomes the reader,
+   * and the writer carries on here, e.g. receiving from the network in one process and playing out in another.
+   *
+   * @param socket Connected AF_UNIX socket, with Import waiting on the other end.
+   * @throws std::logic_error if a Reserve is outstanding, or the ring belongs to a pool.
+   * @throws std::runtime_error if sending fails, or rings can't be shared on this platform.
+   */
+  void Export(int socket);
+
+  /**
+   * @brief Take over a buffer from Export, mapping its ring and continuing from where the exporter stopped.
+   * Arguments must match the exporter's. Arrival history and trace events start afresh.
+   *
+   * @param socket Connected AF_UNIX socket, with Export sending on the other end.
+   * @param element_size Size of held elements in bytes.
+   * @param packet_elements Number of elements in packets.
+   * @param clock_rate Clock rate of elements contained in Hz. E.g 48kHz audio is 48000.
+   * @param max_length The maximum length of the buffer in milliseconds.
+   * @param min_length The minimum age of packets in milliseconds before eligible for dequeue.
+   * @param logger Parent logger.
+   * @param options Construction time settings, shared as the exporter's. Populate is ignored, the ring already holds data.
+   * @returns The buffer, ready for a writer and reader.
+   * @throws std::invalid_argument if the exported buffer doesn't match this configuration.
+   * @throws std::runtime_error if receiving or mapping fails, or rings can't be shared on this platform.
+   */
+  static std::unique_ptr<JitterBuffer> Import(int socket,
+                                              std::size_t element_size,
+                                              std::size_t packet_elements,
+                                              std::uint32_t clock_rate,
+                                              std::chrono::milliseconds max_length,
+                                              std::chrono::milliseconds min_length,
+                                              const cantina::LoggerPointer &logger,
+                                              const JitterBufferOptions &options = JitterBufferOptions());
+
+  /**
+   * @brief Get a count the writer bumps each time it publishes packets or concealment, to pass to WaitForWrite.
+   * Safe to call from any thread, or from the other process of a shared buffer.
+   * @return The count, wrapping.
+   */
+  std::uint32_t GetWriteCount() const;
+
+  /**
+   * @brief Block until the writer publishes again, or the timeout passes. Works across processes for a shared buffer.
+   * @param write_count From GetWriteCount, read before checking for data, so anything published since isn't missed.
+   * @param timeout Longest to wait.
+   * @return True if the writer published since write_count, false on timeout.
+   */
+  bool WaitForWrite(std::uint32_t write_count, std::chrono::milliseconds timeout);
+
+  /**
+   * @brief Block the reader until elements can be dequeued, or the timeout passes, rather than polling Dequeue.
+   * @param elements Number of elements wanted.
+   * @param timeout Longest to wait.
+   * @return True if they're there, false on timeout.
+   */
+  bool WaitForElements(std::size_t elements, std::chrono::milliseconds timeout);
+
+  /**
+   * @brief Check whether elements can be dequeued now, i.e. playing with at least that many buffered.
+   * @param elements Number of elements wanted.
+   */
+  bool HasElements(std::size_t elements) const;
+
+  /**
+   * @brief Get an eventfd the writer signals after publishing, once armed by a WaitForElementsAsync or ArmEventFd.
+   * Register it with epoll or io_uring, and call OnEventFd when it's readable. Created on the first call, from the reader.
+   * Not available on shared buffers, exported or imported, as the writer in the other process couldn't see it armed;
+   * use WaitForWrite there instead.
+   * @return The descriptor, owned by the buffer.
+   * @throws std::runtime_error if it couldn't be created, or there's no eventfd on this platform.
+   * @throws std::logic_error if the buffer is shared.
+   */
+  int GetEventFd();
+
+  /**
+   * @brief Have the writer signal GetEventFd on its next publish, unless elements can already be dequeued.
+   * OnEventFd does this itself, it's for event loops driving the eventfd without coroutines. Read the eventfd to
+   * clear it before arming again.
+   * @param elements Number of elements wanted.
+   * @return True if they're already there, so there's no need to wait.
+   */
+  bool ArmEventFd(std::size_t elements);
+
+  /// @brief Awaitable from WaitForElementsAsync.
+  class ElementsAwaitable {
+    public:
+    ElementsAwaitable(JitterBuffer &buffer, std::size_t elements) : buffer(buffer), elements(elements) {}
+    bool await_ready() const { return buffer.HasElements(elements); }
+    bool await_suspend(std::coroutine_handle<> handle) { return buffer.Suspend(handle, elements); }
+    void await_resume() const {}
+
+    private:
+    JitterBuffer &buffer;
+    std::size_t elements;
+  };
+
+  /**
+   * @brief co_await until elements can be dequeued, without a thread per reader. The coroutine is resumed from
+   * OnEventFd, so GetEventFd must already be registered with the event loop. Only one coroutine may wait at a time.
+   * @param elements Number of elements wanted.
+   */
+  ElementsAwaitable WaitForElementsAsync(std::size_t elements);
+
+  /**
+   * @brief Call from the event loop when GetEventFd is readable. Resumes the waiting coroutine if what it asked for has
+   * arrived, else waits on.
+   */
+  void OnEventFd();
+
+  /**
+   * @brief Get the size of the ring as actually mapped, after rounding to pages.
+   * @return Size of the ring in bytes. The virtual reservation is twice this.
+   */
+  std::size_t GetMappedSize() const;
+
+  /**
+   * @brief Get the NUMA node of the CPU the calling thread is running on.
+   * Call from the playout thread to find the node to pass as JitterBufferOptions::numa_node.
+   * @return The node, or -1 if unknown on this platform.
+   */
+  static int CurrentNumaNode();
+
+  /**
+   * @brief Set the current time, used when constructed with ClockMode::Manual.
+   * Safe to call from any thread.
+   * @param now The current time. Should not go backwards.
+   */
+  void SetTime(std::chrono::milliseconds now);
+
 #ifdef LIBJITTER_BUILD_TESTS
   friend class BufferInspector;
 #endif
+  friend class JitterBufferPool;
+  friend class JitterTap;
+  template<std::size_t ElementSize, std::size_t PacketElements>
+  friend class JitterBufferT;
 
   public:
   cantina::LoggerPointer logger;
 
   private:
+  JitterBuffer(std::size_t element_size,
+               std::size_t packet_elements,
+               std::uint32_t clock_rate,
+               std::chrono::milliseconds max_length,
+               std::chrono::milliseconds min_length,
+               const cantina::LoggerPointer &logger,
+               const JitterBufferOptions &options,
+               std::uint8_t *ring,
+               std::size_t ring_size);
+
+  /// @brief What the writer and reader both change. In this object, or in the mapping after the ring when shared.
+  struct SharedState {
+    std::atomic<std::size_t> written = 0;
+    std::atomic<std::size_t> written_elements = 0;
+    std::atomic<bool> play = false;
+    std::atomic<std::int64_t> target_depth_ms = 0;
+    /// @brief Bumped on every publish, and what WaitForWrite sleeps on. 32 bits to be a futex word.
+    std::atomic<std::uint32_t> write_count = 0;
+    std::atomic<std::uint32_t> waiters = 0;
+  };
+
+  /// @brief Where one JitterTap has read up to, so the writer holds space until it's past.
+  struct TapSlot {
+    /// @brief Free for a tap to claim.
+    constexpr static std::uint32_t FREE = 0;
+    /// @brief Claimed by a tap that's still setting up.
+    constexpr static std::uint32_t CLAIMED = 1;
+    /// @brief Waiting for the writer to start it at the newest data.
+    constexpr static std::uint32_t JOINING = 2;
+    /// @brief Reading, and holding space.
+    constexpr static std::uint32_t ACTIVE = 3;
+    /// @brief Dropped by the writer for holding up space. Holds none.
+    constexpr static std::uint32_t DROPPED = 4;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<std::uint32_t> status = FREE;
+    /// @brief Bytes read past, in write_position's terms. Set by the writer on joining, then only by the tap.
+    std::atomic<std::uint64_t> position = 0;
+    /// @brief Where the record at position is in the ring.
+    std::size_t offset = 0;
+    /// @brief Elements already read from the record at position.
+    std::size_t consumed = 0;
+    /// @brief Set by the tap before joining, read by the writer. Atomic as a slot can be claimed again while the writer reads.
+    std::atomic<bool> drop_when_behind = false;
+  };
+
+  // Set at construction, read by both threads.
   std::size_t element_size;
   std::size_t packet_elements;
   std::chrono::milliseconds clock_rate;
   std::chrono::milliseconds min_length;
   std::chrono::milliseconds max_length;
-
+  std::chrono::milliseconds drain_depth;
+  double drain_rate;
+  ClockMode clock;
+  DepthMode depth_mode;
+  double depth_percentile;
+  SequenceMode sequence_mode;
+  PacketMode packet_mode;
+  std::size_t min_packet_elements;
+  bool owns_buffer;
   std::uint8_t *buffer;
-  std::size_t read_offset;
-  std::size_t write_offset;
   std::size_t max_size_bytes;
-  std::atomic<std::size_t> written;
-  std::atomic<std::size_t> written_elements;
-  std::optional<unsigned long> last_written_sequence_number;
-  std::atomic<bool> play;
+  std::size_t payload_alignment;
+  std::size_t header_bytes;
   void *vm_user_data;
-  std::size_t latest_written_elements;
-  std::atomic<unsigned long> dont_walk_beyond;
-  std::atomic<unsigned long> skipped_frames;
-  Metrics metrics;
-
-  std::size_t GenerateConcealment(std::size_t packets, const ConcealmentCallback &callback);
-  std::size_t Update(const Packet &packet);
-  std::size_t CopyIntoBuffer(const Packet &packet);
-  std::size_t CopyIntoBuffer(const std::uint8_t *source, std::size_t length, bool manual_increment, std::size_t offset_offset_bytes);
-  std::size_t CopyOutOfBuffer(std::uint8_t *destination, std::size_t length, std::size_t required_bytes, bool strict);
+  SharedState *state;
+  std::size_t state_bytes;
+
+  // Shared between the writer and reader, through state unless it's mapped elsewhere.
+  alignas(CACHE_LINE_SIZE) SharedState local_state;
+  std::atomic<std::int64_t> manual_time_ms;
+  /// @brief Set by the reader when a coroutine waits, taken by the writer to signal event_fd once.
+  std::atomic<bool> event_armed;
+  std::atomic<int> event_fd;
+  /// @brief Bytes the writer has ever published, which taps measure their positions against.
+  std::atomic<std::uint64_t> write_position;
+  std::vector<TapSlot> taps;
+
+  /// @brief A counter only ever added to by one thread, safe to read from any.
+  class Counter {
+    public:
+    void Add(const unsigned long amount) {
+      // No other thread writes, so there's no need for a locked read-modify-write.
+      // Release keeps it after the version bump from MetricsUpdate, for GetMetrics to spot.
+      value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_release);
+    }
+    unsigned long Get() const {
+      return value.load(std::memory_order_acquire);
+    }
+    void Clear() {
+      value.store(0, std::memory_order_relaxed);
+    }
+
+    private:
+    std::atomic<unsigned long> value = 0;
+  };
+
+  struct WriterMetrics {
+    Counter concealed_frames;
+    Counter filled_packets;
+    Counter updated_frames;
+    Counter update_missed_frames;
+    Counter enqueued_bytes;
+    Counter full_dropped_packets;
+    Counter late_packets;
+    Counter update_depth_packets;
+    Counter contended_claims;
+    Counter dropped_taps;
+  };
+
+  struct ReaderMetrics {
+    Counter skipped_frames;
+    Counter dropped_frames;
+    Counter accelerated_frames;
+    Counter seeked_frames;
+    Counter dequeued_bytes;
+    Counter underruns;
+    Counter contended_claims;
+  };
+
+  /// @brief Marks one thread's counters as changing for its lifetime, so GetMetrics only reads them between calls.
+  class MetricsUpdate {
+    public:
+    explicit MetricsUpdate(std::atomic<std::uint32_t> &version) : version(version) {
+      version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    ~MetricsUpdate() {
+      version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    MetricsUpdate(const MetricsUpdate &) = delete;
+    MetricsUpdate &operator=(const MetricsUpdate &) = delete;
+
+    private:
+    std::atomic<std::uint32_t> &version;
+  };
+
+  // Only touched by the writer.
+  alignas(CACHE_LINE_SIZE) std::size_t write_offset;
+  std::optional<std::uint32_t> last_written_sequence_number;
+  std::optional<std::uint32_t> reserved_sequence_number;
+  WriterMetrics writer_metrics;
+  std::atomic<std::uint32_t> writer_metrics_version;
+  TraceRing writer_trace;
+
+  /// @brief Where the header for a sequence number was written.
+  struct SequenceSlot {
+    std::uint32_t sequence_number;
+    std::size_t offset;
+    /// @brief write_position of the record, which unlike offset never comes back around, so can't alias a newer one.
+    std::uint64_t position;
+    bool valid;
+  };
+  std::vector<SequenceSlot> sequence_index;
+  std::size_t sequence_index_mask;
+  std::vector<Packet> concealment_packets;
+  std::vector<std::uint8_t> concealment_scratch;
+  std::size_t previous_real_offset;
+  std::size_t previous_real_elements;
+  std::size_t since_previous_real;
+  std::vector<std::int64_t> arrival_delays;
+  std::vector<std::int64_t> arrival_delays_scratch;
+  std::size_t arrival_delays_count;
+  std::size_t arrival_delays_next;
+  std::optional<std::uint32_t> arrival_sequence_number;
+  /// @brief Where the newest arrival sits in the stream, in elements.
+  std::int64_t arrival_position;
+  /// @brief Media time just past the newest record, where concealment and reserved packets are placed.
+  std::uint32_t next_media_timestamp;
+
+  // Only touched by the reader.
+  alignas(CACHE_LINE_SIZE) std::size_t read_offset;
+  std::size_t peeked_spans;
+  std::size_t peeked_elements;
+  std::size_t smoothed_depth_elements;
+  std::vector<std::uint8_t> scatter_scratch;
+  std::vector<std::uint8_t> drain_scratch;
+  bool draining;
+  std::coroutine_handle<> waiting;
+  std::size_t waiting_elements;
+  ReaderMetrics reader_metrics;
+  std::atomic<std::uint32_t> reader_metrics_version;
+  TraceRing reader_trace;
+
+  // Only touched by whichever thread drains the trace.
+  alignas(CACHE_LINE_SIZE) std::size_t trace_dropped_logged;
+
+  std::uint64_t Now() const;
+  void Trace(TraceRing &ring, TraceEventType type, std::uint32_t sequence_number, std::uint64_t first = 0, std::uint64_t second = 0) const;
+  template<typename Read>
+  static void ReadMetrics(const std::atomic<std::uint32_t> &version, Read read);
+  std::size_t RecordSize(std::size_t elements) const;
+  Header *HeaderAt(std::size_t offset) const;
+  std::uint8_t *PayloadAt(std::size_t offset) const;
+  std::size_t Advance(std::size_t offset, std::size_t bytes) const;
+  std::size_t Rewind(std::size_t offset, std::size_t bytes) const;
+  std::size_t Distance(std::size_t from, std::size_t to) const;
+  bool IsExpired(const Header *header, std::uint64_t now_ms) const;
+  static bool IsExpired(std::uint32_t timestamp, std::uint64_t now_ms, std::chrono::milliseconds max_length);
+  std::chrono::milliseconds GetTargetDepth() const;
+  std::size_t GetTargetElements() const;
+  void TrackDepth();
+  std::uint32_t ExtendSequence(unsigned long sequence_number) const;
+  std::uint32_t NarrowSequence(std::uint32_t sequence_number) const;
+  static std::int32_t SequenceDistance(std::uint32_t to, std::uint32_t from);
+  void TrackArrival(std::uint32_t sequence_number, std::size_t elements, std::uint64_t now_ms);
+  std::size_t ConcealmentElements() const;
+  void CheckPacketElements(std::size_t elements) const;
+  static std::size_t MinPacketElements(std::size_t packet_elements, std::uint32_t clock_rate, PacketMode packets);
+  void UpdateTargetDepth();
+  template<typename Copy>
+  std::size_t EnqueuePackets(const Packet *packets, std::size_t num_packets, ConcealmentFunction concealment_callback, void *user_data, Copy copy);
+  std::size_t FillToTarget(std::uint64_t now_ms, ConcealmentFunction concealment_callback, void *user_data);
+  std::size_t GenerateConcealment(std::size_t packets, std::uint64_t now_ms, ConcealmentFunction callback, void *user_data, bool advance_sequence);
+  std::size_t Update(const Packet &packet, std::uint32_t sequence_number);
+  void IndexSequence(std::uint32_t sequence_number, std::size_t offset, std::uint64_t position);
+  Header *GetReadableFront(std::uint64_t now_ms);
+  void ConsumeFront(Header *header, std::size_t elements);
+  bool SeekFront(std::uint32_t media_timestamp, std::uint64_t now_ms);
+  void ReadFront(Header *header, std::uint8_t *destination, std::size_t consumed, std::size_t elements);
+  static bool CopyRecord(Header *header, std::uint8_t *destination, const std::uint8_t *source, std::size_t length);
+  template<typename Read>
+  std::size_t DequeueFront(std::size_t elements, std::size_t required, Read read);
+  void CheckDestination(std::size_t destination_length, std::size_t elements) const;
+  template<typename Copy>
+  std::size_t CopyIntoBuffer(const Packet &packet, std::uint32_t sequence_number, std::uint64_t now_ms, Copy copy);
+  std::size_t FreeSpace(std::size_t wanted);
+  std::uint8_t *WriteHeader(std::uint32_t sequence_number, std::size_t elements, std::uint32_t media_timestamp, std::uint64_t now_ms);
+  std::size_t PublishPacket(std::size_t elements);
+  void UpdatePlayState();
+  void ReleasePeeked(std::size_t offset);
   void UnwindRead(std::size_t unwind_bytes);
   void ForwardRead(std::size_t forward_bytes);
   void UnwindWrite(std::size_t unwind_bytes);
   void ForwardWrite(std::size_t forward_bytes);
-  [[nodiscard]] static void *MakeVirtualMemory(std::size_t &length, void *user_data);
+  void NotifyWrite();
+  bool Suspend(std::coroutine_handle<> handle, std::size_t elements);
+  static void InvokeConcealmentCallback(Packet *packets, std::size_t num_packets, void *user_data);
+  static void InvokeContiguousConcealment(Packet *packets, std::size_t num_packets, void *user_data);
+  static std::size_t CalculateBufferSize(std::size_t element_size, std::size_t packet_elements, std::uint32_t clock_rate, std::chrono::milliseconds max_length, SizingMode sizing, std::size_t record_bytes);
+  static std::size_t CalculateRecordSize(std::size_t element_size, std::size_t elements, std::size_t payload_alignment);
+  static std::size_t CalculateMappedSize(std::size_t element_size, std::size_t packet_elements, std::uint32_t clock_rate, std::chrono::milliseconds max_length, const JitterBufferOptions &options);
+  static std::size_t RoundToPage(std::size_t length, bool hugetlb);
+  [[nodiscard]] static void *MakeVirtualMemory(std::size_t &length, std::size_t overrun, void *&user_data, const JitterBufferOptions &options);
+  [[nodiscard]] static void *MapMirroredFile(const char *name, std::size_t length, std::size_t count, const JitterBufferOptions &options, int &fd);
+  static SharedState *MapSharedState(int fd, std::size_t offset, std::size_t length, bool create);
+  [[nodiscard]] static void *MapRings(int fd, std::size_t length, std::size_t count, const JitterBufferOptions &options, std::size_t alignment);
+  static bool BindToNode(void *address, std::size_t length, int node);
   static void FreeVirtualMemory(void *address, std::size_t length, void *user_data);
 };
+
+// The paths JitterBufferT builds again with its shape fixed. Copy and Read do the moves in and out of the ring.
+
+template<typename Copy>
+std::size_t JitterBuffer::EnqueuePackets(const Packet *packets, const std::size_t num_packets, const ConcealmentFunction concealment_callback, void *user_data, Copy copy) {
+  if (reserved_sequence_number.has_value()) {
+    throw std::logic_error("Enqueue called between Reserve and CommitWrite");
+  }
+  const MetricsUpdate metrics_update(writer_metrics_version);
+  std::size_t enqueued = 0;
+  const std::uint64_t now_ms = Now();
+
+  for (const Packet *packet_pointer = packets; packet_pointer != packets + num_packets; packet_pointer++) {
+    const Packet &packet = *packet_pointer;
+    const std::uint32_t sequence_number = ExtendSequence(packet.sequence_number);
+    TrackArrival(sequence_number, packet.elements, now_ms);
+    const std::int32_t distance = last_written_sequence_number.has_value() ? SequenceDistance(sequence_number, last_written_sequence_number.value()) : 1;
+    if (distance <= 0) {
+      // This might be an update for an existing concealment packet.
+      // Update it and continue on.
+      enqueued += Update(packet, sequence_number);
+      continue;
+    } else {
+      // Only new packets take space, late ones of the wrong size just miss their update.
+      CheckPacketElements(packet.elements);
+      const std::size_t missing = distance - 1;
+      if (missing > 0) {
+        const auto concealed = GenerateConcealment(missing, now_ms, concealment_callback, user_data, true);
+        enqueued += concealed;
+        writer_metrics.concealed_frames.Add(concealed);
+      }
+    }
+
+    // Enqueue this packet of real data.
+    const std::size_t enqueued_elements = CopyIntoBuffer(packet, sequence_number, now_ms, copy);
+    if (enqueued_elements == 0 && packet.elements > 0) {
+      // There's no more space.
+      Trace(writer_trace, JITTER_TRACE_FULL_DROPPED, sequence_number);
+      writer_metrics.full_dropped_packets.Add(packets + num_packets - packet_pointer);
+      break;
+    }
+    enqueued += enqueued_elements;
+    last_written_sequence_number = sequence_number;
+  }
+  return enqueued + FillToTarget(now_ms, concealment_callback, user_data);
+}
+
+template<typename Copy>
+std::size_t JitterBuffer::CopyIntoBuffer(const Packet &packet, const std::uint32_t sequence_number, const std::uint64_t now_ms, Copy copy) {
+  std::uint8_t *destination = WriteHeader(sequence_number, packet.elements, packet.media_timestamp, now_ms);
+  if (destination == nullptr) {
+    // There was no space, so write nothing.
+    return 0;
+  }
+  copy(destination, packet);
+  writer_metrics.enqueued_bytes.Add(packet.elements * element_size);
+  return PublishPacket(packet.elements);
+}
+
+template<typename Read>
+std::size_t JitterBuffer::DequeueFront(const std::size_t elements, const std::size_t required, Read read) {
+  // Reading moves the front, so anything held from a peek is given back first, as Peek does.
+  ReleasePeeked(read_offset);
+  const std::uint64_t now_ms = Now();
+  TrackDepth();
+  std::size_t dequeued_elements = 0;
+  while (dequeued_elements < elements) {
+    Header *header = GetReadableFront(now_ms);
+    if (header == nullptr) {
+      break;
+    }
+
+    // Get as much real data as we can.
+    const std::size_t consumed = header->Consumed();
+    const std::size_t to_dequeue = std::min(header->elements - consumed, elements - dequeued_elements);
+    assert(to_dequeue > 0);
+    read(header, consumed, to_dequeue, dequeued_elements);
+    ConsumeFront(header, to_dequeue);
+    dequeued_elements += to_dequeue;
+  }
+
+  assert(dequeued_elements <= elements);// We should not get more than asked for.
+  state->written_elements -= dequeued_elements;
+  reader_metrics.dequeued_bytes.Add(dequeued_elements * element_size);
+  if (dequeued_elements < required) {
+    reader_metrics.underruns.Add(1);
+  }
+  return dequeued_elements;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "JitterBuffer.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+/// @brief A fixed number of identically configured JitterBuffers carved from one mapping.
+/// Rings are mapped once up front, and buffers reused as streams come and go, so opening a stream costs no syscalls.
+/// Acquire, Release and DequeueAll must not be called concurrently with each other.
+class JitterBufferPool {
+  public:
+  /**
+   * @brief Map rings for a number of streams.
+   *
+   * @param capacity Maximum number of streams active at once.
+   * @param element_size Size of held elements in bytes.
+   * @param packet_elements Number of elements in packets.
+   * @param clock_rate Clock rate of elements contained in Hz. E.g 48kHz audio is 48000.
+   * @param max_length The maximum length of each buffer in milliseconds.
+   * @param min_length The minimum age of packets in milliseconds before eligible for dequeue.
+   * @param logger Parent logger.
+   * @param options Optional construction time settings, shared by every stream.
+   */
+  JitterBufferPool(std::size_t capacity,
+                   std::size_t element_size,
+                   std::size_t packet_elements,
+                   std::uint32_t clock_rate,
+                   std::chrono::milliseconds max_length,
+                   std::chrono::milliseconds min_length,
+                   const cantina::LoggerPointer &logger,
+                   const JitterBufferOptions &options = JitterBufferOptions());
+
+  /**
+   * @brief Destroy every stream and unmap the rings.
+   */
+  ~JitterBufferPool();
+
+  JitterBufferPool(const JitterBufferPool &) = delete;
+  JitterBufferPool &operator=(const JitterBufferPool &) = delete;
+
+  /**
+   * @brief Start a new stream on a free ring.
+   * @return The stream's slot, or nullopt if every ring is in use.
+   */
+  std::optional<std::size_t> Acquire();
+
+  /**
+   * @brief Get the buffer for an active stream. Enqueue through this as normal.
+   * @param slot Slot returned from Acquire.
+   */
+  JitterBuffer &Get(std::size_t slot) const;
+
+  /**
+   * @brief Stop a stream, returning its ring to the pool.
+   * @param slot Slot returned from Acquire.
+   */
+  void Release(std::size_t slot);
+
+  /**
+   * @brief Dequeue from every active stream in one pass, walking the rings in memory order.
+   *
+   * @param destination Output for all streams, stream N's data is at N * elements * element_size.
+   * @param destination_length Length of destination in bytes, at least capacity * elements * element_size.
+   * @param elements The number of elements to dequeue from each stream.
+   * @param dequeued Filled with the number of elements dequeued per slot, 0 for inactive ones. At least capacity long.
+   * @returns The total number of elements dequeued.
+   */
+  std::size_t DequeueAll(std::uint8_t *destination, std::size_t destination_length, std::size_t elements, std::size_t *dequeued);
+
+  /**
+   * @return Maximum number of streams active at once.
+   */
+  std::size_t GetCapacity() const;
+
+  /**
+   * @return Number of streams currently active.
+   */
+  std::size_t GetActive() const;
+
+  private:
+  /// @brief Unmap every ring mapped on its own, where there's no arena.
+  void FreeRings();
+
+  std::size_t element_size;
+  std::size_t packet_elements;
+  std::uint32_t clock_rate;
+  std::chrono::milliseconds max_length;
+  std::chrono::milliseconds min_length;
+  cantina::LoggerPointer logger;
+  JitterBufferOptions options;
+  std::size_t ring_size;
+  std::uint8_t *arena;
+  int arena_fd;
+  std::vector<std::uint8_t *> rings;
+  std::vector<void *> ring_user_data;
+  std::vector<std::unique_ptr<JitterBuffer>> streams;
+  std::vector<bool> active;
+  std::vector<std::size_t> free_slots;
+};
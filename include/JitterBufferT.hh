@@ -0,0 +1,83 @@
+#pragma once
+
+#include "JitterBuffer.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/// @brief A JitterBuffer with its element and packet size fixed at compile time, e.g. JitterBufferT<4, 480> for
+/// 10ms of 48kHz 16 bit stereo. EnqueueFixed and DequeueFixed copy whole packets in and out of the ring with a constant
+/// size the compiler can inline. They're named apart from Enqueue and Dequeue so nothing is hidden: the same calls get
+/// the same path whether through this or a JitterBuffer &. Everything else behaves exactly as JitterBuffer.
+template<std::size_t ElementSize, std::size_t PacketElements>
+class JitterBufferT : public JitterBuffer {
+  static_assert(ElementSize > 0 && PacketElements > 0, "Elements and packets can't be empty");
+  static_assert(PacketElements < (std::size_t{1} << (32 - Header::CONSUMED_SHIFT)), "Too many elements per packet");
+
+  public:
+  /// @brief Bytes in a full packet.
+  constexpr static std::size_t PACKET_BYTES = ElementSize * PacketElements;
+
+  /**
+   * @brief Construct a new Jitter Buffer object of this shape.
+   *
+   * @param clock_rate Clock rate of elements contained in Hz. E.g 48kHz audio is 48000.
+   * @param max_length The maximum length of the buffer in milliseconds.
+   * @param min_length The minimum age of packets in milliseconds before eligible for dequeue.
+   * @param logger Parent logger.
+   * @param options Optional construction time settings. With PacketMode::Variable, only full packets take the fast path.
+   */
+  JitterBufferT(const std::uint32_t clock_rate,
+                const std::chrono::milliseconds max_length,
+                const std::chrono::milliseconds min_length,
+                const cantina::LoggerPointer &logger,
+                const JitterBufferOptions &options = JitterBufferOptions())
+      : JitterBuffer(ElementSize, PacketElements, clock_rate, max_length, min_length, logger, options) {}
+
+  /**
+   * @brief Enqueue as JitterBuffer::Enqueue, copying full packets with a fixed size.
+   *
+   * @param packets The packets to enqueue.
+   * @param num_packets Number of packets in packets.
+   * @param concealment_callback Fired when concealment data needs to be generated.
+   * @param user_data Passed to concealment_callback.
+   * @returns The number of elements actually enqueued, including concealment.
+   */
+  std::size_t EnqueueFixed(const Packet *packets, std::size_t num_packets, ConcealmentFunction concealment_callback, void *user_data) {
+    return EnqueuePackets(packets, num_packets, concealment_callback, user_data, [](std::uint8_t *destination, const Packet &packet) {
+      if (packet.elements == PacketElements) {
+        memcpy(destination, packet.data, PACKET_BYTES);
+      } else {
+        memcpy(destination, packet.data, packet.elements * ElementSize);
+      }
+    });
+  }
+
+  /**
+   * @brief Dequeue as JitterBuffer::Dequeue, copying whole packets of real data with a fixed size.
+   *
+   * @param destination The buffer to copy the data into.
+   * @param destination_length Length of destination buffer in bytes.
+   * @param elements The number of elements to dequeue.
+   * @returns The number of elements actually dequeued.
+   */
+  std::size_t DequeueFixed(std::uint8_t *destination, std::size_t destination_length, std::size_t elements) {
+    const MetricsUpdate metrics_update(reader_metrics_version);
+    if (!state->play) {
+      return 0;
+    }
+    CheckDestination(destination_length, elements);
+
+    return DequeueFront(elements, elements, [this, destination](Header *header, const std::size_t consumed, const std::size_t to_dequeue, const std::size_t dequeued_elements) {
+      std::uint8_t *output = destination + dequeued_elements * ElementSize;
+      if (to_dequeue == PacketElements && !header->IsConcealment()) {
+        // All of a real packet, which is never rewritten.
+        memcpy(output, PayloadAt(read_offset), PACKET_BYTES);
+      } else {
+        ReadFront(header, output, consumed, to_dequeue);
+      }
+    });
+  }
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "JitterBuffer.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Another reader of a JitterBuffer's stream, e.g. a recorder or speech recogniser alongside the mixer.
+/// Each tap reads what the writer publishes at its own pace, without another copy of the data. Taps don't wait for
+/// the buffer to start playing or fill gaps of their own, they see the records as written, concealment included.
+/// The ring only reuses space once the buffer's reader and every tap are past it. The buffer needs a free
+/// JitterBufferOptions::taps slot for each.
+class JitterTap {
+  public:
+  /**
+   * @brief Attach to a buffer, reading from whatever its writer publishes next. Safe to call while it's in use.
+   *
+   * @param buffer Buffer to read from. Must outlive the tap.
+   * @param max_length Age in milliseconds past which this tap skips packets rather than reading them.
+   * @param drop_when_behind Let the writer drop this tap rather than a packet when it's holding up space. See IsDropped.
+   * @throws std::runtime_error if every tap slot is in use.
+   */
+  JitterTap(JitterBuffer &buffer, std::chrono::milliseconds max_length, bool drop_when_behind = false);
+
+  /**
+   * @brief Detach, releasing any space held.
+   */
+  ~JitterTap();
+
+  JitterTap(const JitterTap &) = delete;
+  JitterTap &operator=(const JitterTap &) = delete;
+
+  /**
+   * @brief Dequeue the next elements this tap hasn't read. This must be called from a single thread per tap.
+   *
+   * @param destination The buffer to copy the data into.
+   * @param destination_length Length of destination buffer in bytes.
+   * @param elements The number of elements to dequeue.
+   * @returns The number of elements actually dequeued. 0 while dropped, including when dropped partway through.
+   */
+  std::size_t Dequeue(std::uint8_t *destination, std::size_t destination_length, std::size_t elements);
+
+  /**
+   * @return True if the writer dropped this tap for falling behind. It holds no space and reads nothing until Rejoin.
+   */
+  bool IsDropped() const;
+
+  /**
+   * @brief Start again from whatever the writer publishes next, after being dropped.
+   */
+  void Rejoin();
+
+  /**
+   * @return Number of frames this tap skipped for being older than its max_length.
+   */
+  unsigned long GetSkippedFrames() const;
+
+  private:
+  JitterBuffer &buffer;
+  JitterBuffer::TapSlot &slot;
+  std::chrono::milliseconds max_length;
+  unsigned long skipped_frames;
+
+  static JitterBuffer::TapSlot &Claim(JitterBuffer &buffer);
+};
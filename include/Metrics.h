@@ -13,6 +13,32 @@ struct Metrics {
   unsigned long updated_frames;
   /// @brief Number of real frames that arrived too late to be used to update concealment data.
   unsigned long update_missed_frames;
+  /// @brief Number of concealment frames dropped to shrink towards the target depth.
+  unsigned long dropped_frames;
+  /// @brief Depth currently being filled to, in milliseconds. Fixed at min_length unless adaptive.
+  unsigned long target_depth_ms;
+  /// @brief Bytes of real data written, including updates.
+  unsigned long enqueued_bytes;
+  /// @brief Bytes handed to the reader, real or concealment.
+  unsigned long dequeued_bytes;
+  /// @brief Number of reads, once playing, that returned fewer elements than asked for.
+  unsigned long underruns;
+  /// @brief Number of real packets lost because the buffer was full.
+  unsigned long full_dropped_packets;
+  /// @brief Number of real packets that arrived after a newer one.
+  unsigned long late_packets;
+  /// @brief Total of how far behind the newest packet each late packet was, in packets. Divide by late_packets for the average.
+  unsigned long update_depth_packets;
+  /// @brief Number of reads that raced an update and went again, plus updates to concealment Peek had lent out.
+  unsigned long contended_claims;
+  /// @brief Number of trace events lost because they weren't drained in time.
+  unsigned long trace_dropped_events;
+  /// @brief Number of frames played out early by stretching, to drain excess depth.
+  unsigned long accelerated_frames;
+  /// @brief Number of frames DequeueAt threw away to reach the media time asked for.
+  unsigned long seeked_frames;
+  /// @brief Number of times the writer dropped a JitterTap that had fallen too far behind, rather than a packet.
+  unsigned long dropped_taps;
 };
 
 #endif
@@ -2,6 +2,7 @@
 #define LIBJITTER_PACKET_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 struct Packet {
@@ -9,6 +10,12 @@ struct Packet {
   void *data;
   size_t length;
   size_t elements;
+  /// @brief Media time of the first element in clock_rate units, e.g. the RTP timestamp. Read by DequeueAt.
+#ifdef __cplusplus
+  uint32_t media_timestamp = 0;
+#else
+  uint32_t media_timestamp;
+#endif
 
 #ifdef __cplusplus
   bool operator==(const Packet &other) const {
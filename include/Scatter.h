@@ -0,0 +1,21 @@
+#ifndef LIBJITTER_SCATTER_H
+#define LIBJITTER_SCATTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Where one slice of every element goes in a scattered dequeue, e.g. one channel into a planar buffer.
+struct ScatterSpan {
+  /// @brief Start of the output.
+  uint8_t *destination;
+  /// @brief Capacity of destination in bytes.
+  size_t destination_length;
+  /// @brief Where the slice starts within each element, in bytes.
+  size_t offset;
+  /// @brief Bytes taken from each element.
+  size_t bytes;
+  /// @brief Distance between consecutive elements' slices in destination, in bytes. At least bytes.
+  size_t stride;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LIBJITTER_TRACE_H
+#define LIBJITTER_TRACE_H
+
+#include <stdint.h>
+
+/// @brief What happened on the writer or reader path.
+enum TraceEventType {
+  /// @brief A real packet was lost because the buffer was full.
+  JITTER_TRACE_FULL_DROPPED,
+  /// @brief A record didn't fit. values are the bytes wanted and the space there was.
+  JITTER_TRACE_NO_SPACE,
+  /// @brief Not all missing packets could be concealed. values are the packets concealed and the packets missing.
+  JITTER_TRACE_CONCEALMENT_TRUNCATED,
+  /// @brief A late packet had no concealment to update.
+  JITTER_TRACE_UPDATE_NOT_FOUND,
+  /// @brief A late packet's concealment had already been read.
+  JITTER_TRACE_UPDATE_ALREADY_READ,
+  /// @brief A late packet's concealment had been handed out by Peek to be played, so wasn't updated.
+  JITTER_TRACE_UPDATE_CONTENDED,
+  /// @brief Concealment was updated while the reader copied it, so the reader copied it again.
+  JITTER_TRACE_READ_CONTENDED,
+  /// @brief A late packet was a different size to the concealment standing in for it. values are the two sizes.
+  JITTER_TRACE_UPDATE_SIZE_MISMATCH,
+  /// @brief Signalling the eventfd a waiting reader sleeps on failed. values[0] is errno.
+  JITTER_TRACE_EVENT_FD_FAILED,
+  /// @brief A tap was dropped for holding up space. values are the bytes it held and the bytes wanted.
+  JITTER_TRACE_TAP_DROPPED,
+};
+
+/// @brief A fixed size record of something happening on a hot path, see JitterBuffer::DrainTrace.
+struct TraceEvent {
+  /// @brief When it happened, on the buffer's clock, in milliseconds.
+  uint64_t time_ms;
+  /// @brief One of TraceEventType.
+  uint32_t type;
+  /// @brief The packet concerned, if any.
+  uint32_t sequence_number;
+  /// @brief Event specific values, see TraceEventType.
+  uint64_t values[2];
+};
+
+#endif
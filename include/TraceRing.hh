@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Trace.h"
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <vector>
+
+/// @brief Lock free single producer, single consumer queue of trace events.
+/// One hot path thread pushes, and one background thread drains. Events are dropped when it's full, never blocking the producer.
+class TraceRing {
+  public:
+  /// @brief Alignment keeping the producer and consumer positions on separate cache lines.
+  /// Longer on Apple arm64. JitterBuffer::CACHE_LINE_SIZE is this too.
+#if defined(__APPLE__) && defined(__aarch64__)
+  constexpr static std::size_t CACHE_LINE_SIZE = 128;
+#else
+  constexpr static std::size_t CACHE_LINE_SIZE = 64;
+#endif
+
+  /**
+   * @brief Create a ring.
+   * @param capacity Number of events held, rounded up to a power of two. 0 for a ring that drops everything.
+   */
+  explicit TraceRing(const std::size_t capacity)
+      : events(capacity == 0 ? 0 : std::bit_ceil(capacity)),
+        mask(events.empty() ? 0 : events.size() - 1),
+        head(0),
+        dropped(0),
+        tail(0) {}
+
+  /**
+   * @brief Queue an event. Producer only.
+   * @return True if queued, false if the ring was full and it was dropped.
+   */
+  bool Push(const TraceEvent &event) {
+    const std::size_t position = head.load(std::memory_order_relaxed);
+    if (position - tail.load(std::memory_order_acquire) >= events.size()) {
+      // Only the producer writes this, so no read-modify-write is needed.
+      dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return false;
+    }
+    events[position & mask] = event;
+    head.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Hand every queued event to sink, oldest first. Consumer only.
+   * @param sink Called with each const TraceEvent &.
+   * @return Number of events drained.
+   */
+  template<typename Sink>
+  std::size_t Drain(Sink &&sink) {
+    const std::size_t position = tail.load(std::memory_order_relaxed);
+    const std::size_t end = head.load(std::memory_order_acquire);
+    for (std::size_t index = position; index != end; index++) {
+      sink(events[index & mask]);
+    }
+    tail.store(end, std::memory_order_release);
+    return end - position;
+  }
+
+  /**
+   * @return Number of events dropped so far because the ring was full. May be called from any thread.
+   */
+  std::size_t GetDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @return Number of events the ring holds.
+   */
+  std::size_t GetCapacity() const {
+    return events.size();
+  }
+
+  private:
+  std::vector<TraceEvent> events;
+  std::size_t mask;
+  alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> head;
+  std::atomic<std::size_t> dropped;
+  alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> tail;
+};
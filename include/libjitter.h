@@ -1,17 +1,65 @@
 #ifndef LIBJITTER_LIBJITTER_H
 #define LIBJITTER_LIBJITTER_H
 
+#include "Metrics.h"
 #include "Packet.h"
+#include "Scatter.h"
+#include "Trace.h"
 
 #include <cantina/logger.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void (*LibJitterConcealmentCallback)(struct Packet *, const size_t num_packets, void *user_data);
+typedef void (*LibJitterContiguousConcealmentCallback)(struct Packet *run, const struct Packet *previous, void *user_data);
+typedef void (*LibJitterTraceCallback)(const struct TraceEvent *event, void *user_data);
+typedef void (*LibJitterStretchCallback)(const uint8_t *input, size_t input_elements, uint8_t *output, size_t output_elements, size_t element_size, void *user_data);
+
+/// @brief When the pages backing the ring are faulted in, see PopulateMode.
+enum JitterPopulate {
+  JITTER_POPULATE_EAGER,
+  JITTER_POPULATE_LAZY,
+  JITTER_POPULATE_PREFAULT,
+};
+
+/// @brief Optional construction time settings, see JitterBufferOptions. Fill with JitterDefaultOptions first.
+struct JitterOptions {
+  /// @brief Non-zero to size the ring to hold max_length of full packets.
+  int per_packet_sizing;
+  /// @brief Alignment of every packet's data in the ring.
+  size_t payload_alignment;
+  /// @brief Non-zero for an adaptive target depth.
+  int adaptive_depth;
+  /// @brief One of JitterPopulate.
+  int populate;
+  /// @brief Non-zero to ask for transparent huge pages.
+  int huge_pages;
+  /// @brief Non-zero to back the ring with reserved huge pages, falling back to normal pages.
+  int hugetlb;
+  /// @brief NUMA node to bind the ring to, or -1 for none.
+  int numa_node;
+  /// @brief Non-zero for 16 bit RTP sequence numbers.
+  int rtp_sequence;
+  /// @brief Trace events each of the writer and reader can hold until drained, 0 for none.
+  size_t trace_capacity;
+  /// @brief Non-zero to accept packets of anywhere from 1ms up to packet_elements.
+  int variable_packets;
+  /// @brief Depth in milliseconds beyond which JitterDequeueStretched plays out faster, 0 for never.
+  unsigned long drain_depth_ms;
+  /// @brief Most extra input a draining dequeue takes, as a fraction of the output.
+  double drain_rate;
+  /// @brief Non-zero to keep shared state in the mapping, so JitterExport can hand the reader to another process.
+  int shared;
+};
+
+/// @brief Fill options with the defaults JitterInit uses.
+/// @param options Options to fill.
+void JitterDefaultOptions(struct JitterOptions *options);
 
 /**
    * @brief Construct a new Jitter Buffer object.
@@ -24,6 +72,66 @@ typedef void (*LibJitterConcealmentCallback)(struct Packet *, const size_t num_p
    */
 void *JitterInit(size_t element_size, size_t packet_elements, unsigned long clock_rate, unsigned long max_length_ms, unsigned long min_length_ms, cantina::Logger *logger);
 
+/// @brief Construct a new Jitter Buffer object with construction time settings.
+/// @param element_size Size of held elements in bytes.
+/// @param packet_elements Number of elements in packets.
+/// @param clock_rate Clock rate of elements contained in Hz. E.g 48kHz audio is 48000.
+/// @param max_length_ms The maximum length of the buffer in milliseconds.
+/// @param min_length_ms The minimum age of packets in milliseconds before eligible for dequeue.
+/// @param logger Pointer to external parent logger.
+/// @param options Settings, from JitterDefaultOptions.
+/// @return The jitter buffer instance, or NULL if it couldn't be created.
+void *JitterInitWithOptions(size_t element_size, size_t packet_elements, unsigned long clock_rate, unsigned long max_length_ms, unsigned long min_length_ms, cantina::Logger *logger, const struct JitterOptions *options);
+
+/// @brief Take over a buffer sent by JitterExport from another process, without copying its ring.
+/// @param socket Connected AF_UNIX socket, with JitterExport sending on the other end.
+/// @param element_size Size of held elements in bytes. This and the rest must match the exporter's.
+/// @param packet_elements Number of elements in packets.
+/// @param clock_rate Clock rate of elements contained in Hz. E.g 48kHz audio is 48000.
+/// @param max_length_ms The maximum length of the buffer in milliseconds.
+/// @param min_length_ms The minimum age of packets in milliseconds before eligible for dequeue.
+/// @param logger Pointer to external parent logger.
+/// @param options Settings, from JitterDefaultOptions.
+/// @return The jitter buffer instance, or NULL if it couldn't be imported.
+void *JitterImport(int socket, size_t element_size, size_t packet_elements, unsigned long clock_rate, unsigned long max_length_ms, unsigned long min_length_ms, cantina::Logger *logger, const struct JitterOptions *options);
+
+/// @brief Hand a buffer to another process calling JitterImport. Afterwards it may only be destroyed, unless shared,
+/// when this process carries on as the writer and the importer is the reader.
+/// @param libjitter The jitter buffer instance to send.
+/// @param socket Connected AF_UNIX socket.
+/// @return 1 if sent, 0 on failure.
+int JitterExport(void *libjitter, int socket);
+
+/// @brief Get a count the writer bumps each time it publishes, to pass to JitterWaitForWrite.
+/// @param libjitter The jitter buffer instance.
+/// @return The count, wrapping.
+uint32_t JitterGetWriteCount(void *libjitter);
+
+/// @brief Block until the writer publishes again, from this or, when shared, another process.
+/// @param libjitter The jitter buffer instance.
+/// @param write_count From JitterGetWriteCount, read before checking for data.
+/// @param timeout_ms Longest to wait in milliseconds.
+/// @return 1 if the writer published, 0 on timeout.
+int JitterWaitForWrite(void *libjitter, uint32_t write_count, unsigned long timeout_ms);
+
+/// @brief Block the reader until elements can be dequeued.
+/// @param libjitter The jitter buffer instance.
+/// @param elements Number of elements wanted.
+/// @param timeout_ms Longest to wait in milliseconds.
+/// @return 1 if they're there, 0 on timeout.
+int JitterWaitForElements(void *libjitter, size_t elements, unsigned long timeout_ms);
+
+/// @brief Get an eventfd signalled by the writer after publishing, once armed by JitterArmEventFd, to poll alongside others.
+/// @param libjitter The jitter buffer instance.
+/// @return The descriptor, owned by the buffer, or -1 if unavailable or the buffer is shared.
+int JitterGetEventFd(void *libjitter);
+
+/// @brief Have the writer signal the eventfd on its next publish. Read the eventfd to clear it before arming again.
+/// @param libjitter The jitter buffer instance.
+/// @param elements Number of elements wanted.
+/// @return 1 if they're already there and there's no need to wait, else 0.
+int JitterArmEventFd(void *libjitter, size_t elements);
+
 /// @brief Prepare the buffer for the given sequence number, generating concealment data for any missing packets.
 /// @param libjitter The jitter buffer instance.
 /// @param sequence_number The sequence number to prepare for.
@@ -41,6 +149,40 @@ size_t JitterPrepare(void* libjitter, const unsigned long sequence_number, LibJi
 /// @return Number of elements enqueued.
 size_t JitterEnqueue(void *libjitter, const struct Packet packets[], size_t elements, LibJitterConcealmentCallback concealment_callback, void *user_data);
 
+/// @brief Enqueue packets of data, concealing each gap in one contiguous region.
+/// @param libjitter The jitter buffer instance.
+/// @param packets Array of packets of data.
+/// @param elements Number of packets in packets.
+/// @param concealment_callback Fired with the whole run to conceal, and the last real packet for context or NULL.
+/// @param user_data User data pointer passed to concealment_callback.
+/// @return Number of elements enqueued.
+size_t JitterEnqueueContiguous(void *libjitter, const struct Packet packets[], size_t elements, LibJitterContiguousConcealmentCallback concealment_callback, void *user_data);
+
+/// @brief Prepare the buffer for the given sequence number, concealing the gap in one contiguous region.
+/// @param libjitter The jitter buffer instance.
+/// @param sequence_number The sequence number to prepare for.
+/// @param concealment_callback Fired with the whole run to conceal, and the last real packet for context or NULL.
+/// @param user_data User data pointer passed to concealment_callback.
+/// @return Number of elements concealed.
+size_t JitterPrepareContiguous(void *libjitter, const unsigned long sequence_number, LibJitterContiguousConcealmentCallback concealment_callback, void *user_data);
+
+/// @brief Reserve space for the next packet so it can be written in place.
+/// @param libjitter The jitter buffer instance.
+/// @param sequence_number Sequence number of the packet to be written.
+/// @return Pointer to packet_elements * element_size writable bytes, or NULL if it can't be written.
+void *JitterReserve(void *libjitter, unsigned long sequence_number);
+
+/// @brief Publish the packet written into the space from the last JitterReserve.
+/// @param libjitter The jitter buffer instance.
+/// @return Number of elements enqueued.
+size_t JitterCommitWrite(void *libjitter);
+
+/// @brief Publish a shorter packet written into the space from the last JitterReserve. Needs variable_packets.
+/// @param libjitter The jitter buffer instance.
+/// @param elements Number of elements written.
+/// @return Number of elements enqueued.
+size_t JitterCommitWriteElements(void *libjitter, size_t elements);
+
 /// @brief Dequeue num elements from data into buffer.
 /// @param libjitter The jitter buffer instance to dequeue from.
 /// @param destination Pointer to copy bytes to.
@@ -49,6 +191,67 @@ size_t JitterEnqueue(void *libjitter, const struct Packet packets[], size_t elem
 /// @return Number of elements each of length element_size bytes actually dequeued.
 size_t JitterDequeue(void *libjitter, void *destination, size_t destination_length, size_t elements);
 
+/// @brief Dequeue elements, scattering slices of each into separate destinations, e.g. one per channel.
+/// @param libjitter The jitter buffer instance to dequeue from.
+/// @param spans Where each slice of every element goes.
+/// @param num_spans Number of spans.
+/// @param elements Desired number of elements to dequeue.
+/// @return Number of elements actually dequeued.
+size_t JitterDequeueV(void *libjitter, const struct ScatterSpan *spans, size_t num_spans, size_t elements);
+
+/// @brief Dequeue starting from a media time, dropping everything buffered before it.
+/// @param libjitter The jitter buffer instance to dequeue from.
+/// @param media_timestamp Media time to start from, in the units of Packet.media_timestamp.
+/// @param destination Pointer to copy bytes to.
+/// @param destination_length Capacity of destination in bytes.
+/// @param elements Desired number of elements to dequeue.
+/// @return Number of elements actually dequeued, 0 if the buffered data starts later.
+size_t JitterDequeueAt(void *libjitter, uint32_t media_timestamp, void *destination, size_t destination_length, size_t elements);
+
+/// @brief Dequeue as JitterDequeue, playing out faster through stretch while depth is past drain_depth_ms.
+/// @param libjitter The jitter buffer instance to dequeue from.
+/// @param destination Pointer to copy bytes to.
+/// @param destination_length Capacity of destination in bytes.
+/// @param elements Desired number of elements to output.
+/// @param stretch Compresses input into output while draining, e.g. JitterStretchPcm16.
+/// @param user_data User data pointer passed to stretch.
+/// @return Number of elements output.
+size_t JitterDequeueStretched(void *libjitter, void *destination, size_t destination_length, size_t elements, LibJitterStretchCallback stretch, void *user_data);
+
+/// @brief A stretch callback for interleaved 16 bit PCM.
+void JitterStretchPcm16(const uint8_t *input, size_t input_elements, uint8_t *output, size_t output_elements, size_t element_size, void *user_data);
+
+/// @brief Get pointers straight into the buffer for up to the next elements, without copying.
+/// @param libjitter The jitter buffer instance to peek at.
+/// @param elements Desired number of elements.
+/// @param spans Filled with one span per packet, pointing into the buffer.
+/// @param max_spans Capacity of spans.
+/// @return Number of spans filled. Must be followed by JitterCommitRead.
+size_t JitterPeek(void *libjitter, size_t elements, struct Packet spans[], size_t max_spans);
+
+/// @brief Consume elements returned by the last JitterPeek.
+/// @param libjitter The jitter buffer instance.
+/// @param elements Number of peeked elements actually used.
+/// @return Number of elements consumed.
+size_t JitterCommitRead(void *libjitter, size_t elements);
+
+/// @brief Get a snapshot of the buffer's metrics. May be called from any thread.
+/// @param libjitter The jitter buffer instance.
+/// @param metrics Filled with the current metrics.
+void JitterGetMetrics(void *libjitter, struct Metrics *metrics);
+
+/// @brief Hand trace events from the writer and reader to a callback. Call periodically from one background thread.
+/// @param libjitter The jitter buffer instance.
+/// @param callback Called with each event.
+/// @param user_data User data pointer passed to callback.
+/// @return Number of events drained.
+size_t JitterDrainTrace(void *libjitter, LibJitterTraceCallback callback, void *user_data);
+
+/// @brief Log trace events from the writer and reader. Call periodically from one background thread.
+/// @param libjitter The jitter buffer instance.
+/// @return Number of events drained.
+size_t JitterDrainTraceToLog(void *libjitter);
+
 /// @brief Destroy a libjitter instance.
 /// @param libjitter The jitter buffer instance to destroy.
 void JitterDestroy(void *libjitter);
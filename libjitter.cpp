@@ -3,6 +3,27 @@
 
 #include <iostream>
 
+static JitterBufferOptions ToBufferOptions(const JitterOptions *options) {
+  if (options->populate < JITTER_POPULATE_EAGER || options->populate > JITTER_POPULATE_PREFAULT) {
+    throw std::invalid_argument("Unknown populate mode");
+  }
+  JitterBufferOptions buffer_options;
+  buffer_options.sizing = options->per_packet_sizing ? SizingMode::PerPacket : SizingMode::PerElement;
+  buffer_options.payload_alignment = options->payload_alignment;
+  buffer_options.depth = options->adaptive_depth ? DepthMode::Adaptive : DepthMode::Fixed;
+  buffer_options.populate = static_cast<PopulateMode>(options->populate);
+  buffer_options.huge_pages = options->huge_pages != 0;
+  buffer_options.hugetlb = options->hugetlb != 0;
+  buffer_options.numa_node = options->numa_node;
+  buffer_options.sequence = options->rtp_sequence ? SequenceMode::Rtp : SequenceMode::Full;
+  buffer_options.trace_capacity = options->trace_capacity;
+  buffer_options.packets = options->variable_packets ? PacketMode::Variable : PacketMode::Fixed;
+  buffer_options.drain_depth = std::chrono::milliseconds(options->drain_depth_ms);
+  buffer_options.drain_rate = options->drain_rate;
+  buffer_options.shared = options->shared != 0;
+  return buffer_options;
+}
+
 extern "C" {
 void *JitterInit(const size_t element_size,
                  const size_t packet_elements,
@@ -18,16 +39,117 @@ void *JitterInit(const size_t element_size,
                           cantina::LoggerPointer(logger));
 }
 
+void JitterDefaultOptions(JitterOptions *options) {
+  const JitterBufferOptions defaults;
+  *options = JitterOptions{
+          .per_packet_sizing = defaults.sizing == SizingMode::PerPacket,
+          .payload_alignment = defaults.payload_alignment,
+          .adaptive_depth = defaults.depth == DepthMode::Adaptive,
+          .populate = static_cast<int>(defaults.populate),
+          .huge_pages = defaults.huge_pages,
+          .hugetlb = defaults.hugetlb,
+          .numa_node = defaults.numa_node,
+          .rtp_sequence = defaults.sequence == SequenceMode::Rtp,
+          .trace_capacity = defaults.trace_capacity,
+          .variable_packets = defaults.packets == PacketMode::Variable,
+          .drain_depth_ms = static_cast<unsigned long>(defaults.drain_depth.count()),
+          .drain_rate = defaults.drain_rate,
+          .shared = defaults.shared,
+  };
+}
+
+void *JitterInitWithOptions(const size_t element_size,
+                            const size_t packet_elements,
+                            const unsigned long clock_rate,
+                            const unsigned long max_length_ms,
+                            const unsigned long min_length_ms,
+                            cantina::Logger *logger,
+                            const JitterOptions *options) {
+  static_assert(static_cast<int>(PopulateMode::Eager) == JITTER_POPULATE_EAGER);
+  static_assert(static_cast<int>(PopulateMode::Lazy) == JITTER_POPULATE_LAZY);
+  static_assert(static_cast<int>(PopulateMode::Prefault) == JITTER_POPULATE_PREFAULT);
+  cantina::LoggerPointer parent(logger);
+  try {
+    return new JitterBuffer(element_size,
+                            packet_elements,
+                            std::uint32_t(clock_rate),
+                            std::chrono::milliseconds(max_length_ms),
+                            std::chrono::milliseconds(min_length_ms),
+                            parent,
+                            ToBufferOptions(options));
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return nullptr;
+  }
+}
+
+void *JitterImport(const int socket,
+                   const size_t element_size,
+                   const size_t packet_elements,
+                   const unsigned long clock_rate,
+                   const unsigned long max_length_ms,
+                   const unsigned long min_length_ms,
+                   cantina::Logger *logger,
+                   const JitterOptions *options) {
+  cantina::LoggerPointer parent(logger);
+  try {
+    return JitterBuffer::Import(socket,
+                                element_size,
+                                packet_elements,
+                                std::uint32_t(clock_rate),
+                                std::chrono::milliseconds(max_length_ms),
+                                std::chrono::milliseconds(min_length_ms),
+                                parent,
+                                ToBufferOptions(options))
+            .release();
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return nullptr;
+  }
+}
+
+int JitterExport(void *libjitter, const int socket) {
+  try {
+    static_cast<JitterBuffer *>(libjitter)->Export(socket);
+    return 1;
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+uint32_t JitterGetWriteCount(void *libjitter) {
+  return static_cast<JitterBuffer *>(libjitter)->GetWriteCount();
+}
+
+int JitterWaitForWrite(void *libjitter, const uint32_t write_count, const unsigned long timeout_ms) {
+  return static_cast<JitterBuffer *>(libjitter)->WaitForWrite(write_count, std::chrono::milliseconds(timeout_ms));
+}
+
+int JitterWaitForElements(void *libjitter, const size_t elements, const unsigned long timeout_ms) {
+  return static_cast<JitterBuffer *>(libjitter)->WaitForElements(elements, std::chrono::milliseconds(timeout_ms));
+}
+
+int JitterGetEventFd(void *libjitter) {
+  try {
+    return static_cast<JitterBuffer *>(libjitter)->GetEventFd();
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return -1;
+  }
+}
+
+int JitterArmEventFd(void *libjitter, const size_t elements) {
+  return static_cast<JitterBuffer *>(libjitter)->ArmEventFd(elements);
+}
+
 size_t JitterPrepare(void *libjitter,
                      const unsigned long sequence_number,
                      const LibJitterConcealmentCallback concealment_callback,
                      void *user_data) {
   auto *buffer = static_cast<JitterBuffer *>(libjitter);
-  JitterBuffer::ConcealmentCallback callback = [concealment_callback, user_data](std::vector<Packet> &packets) {
-    concealment_callback(&packets[0], packets.capacity(), user_data);
-  };
   try {
-    return buffer->Prepare(sequence_number, callback);
+    return buffer->Prepare(sequence_number, concealment_callback, user_data);
   } catch (const std::exception &ex) {
     std::cerr << ex.what() << std::endl;
     return 0;
@@ -40,14 +162,65 @@ size_t JitterEnqueue(void *libjitter,
                      const LibJitterConcealmentCallback concealment_callback,
                      void *user_data) {
   auto *buffer = static_cast<JitterBuffer *>(libjitter);
+  try {
+    return buffer->Enqueue(packets, elements, concealment_callback, user_data);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
 
-  JitterBuffer::ConcealmentCallback callback = [concealment_callback, user_data](std::vector<Packet> &packets) {
-    concealment_callback(&packets[0], packets.capacity(), user_data);
-  };
+size_t JitterEnqueueContiguous(void *libjitter,
+                               const Packet packets[],
+                               const size_t elements,
+                               const LibJitterContiguousConcealmentCallback concealment_callback,
+                               void *user_data) {
+  auto *buffer = static_cast<JitterBuffer *>(libjitter);
+  try {
+    return buffer->Enqueue(packets, elements, concealment_callback, user_data);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
 
-  const std::vector<Packet> vector(packets, packets + elements);
+size_t JitterPrepareContiguous(void *libjitter,
+                               const unsigned long sequence_number,
+                               const LibJitterContiguousConcealmentCallback concealment_callback,
+                               void *user_data) {
+  auto *buffer = static_cast<JitterBuffer *>(libjitter);
   try {
-    return buffer->Enqueue(vector, callback);
+    return buffer->Prepare(sequence_number, concealment_callback, user_data);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+void *JitterReserve(void *libjitter, const unsigned long sequence_number) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->Reserve(sequence_number);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return nullptr;
+  }
+}
+
+size_t JitterCommitWrite(void *libjitter) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->CommitWrite();
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+size_t JitterCommitWriteElements(void *libjitter, const size_t elements) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->CommitWrite(elements);
   } catch (const std::exception &ex) {
     std::cerr << ex.what() << std::endl;
     return 0;
@@ -67,6 +240,85 @@ size_t JitterDequeue(void *libjitter,
   }
 }
 
+size_t JitterDequeueStretched(void *libjitter,
+                              void *destination,
+                              const size_t destination_length,
+                              const size_t elements,
+                              const LibJitterStretchCallback stretch,
+                              void *user_data) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->Dequeue(static_cast<std::uint8_t *>(destination), destination_length, elements, stretch, user_data);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+void JitterStretchPcm16(const uint8_t *input, const size_t input_elements, uint8_t *output, const size_t output_elements, const size_t element_size, void *user_data) {
+  JitterBuffer::StretchPcm16(input, input_elements, output, output_elements, element_size, user_data);
+}
+
+size_t JitterDequeueV(void *libjitter, const ScatterSpan *spans, const size_t num_spans, const size_t elements) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->DequeueV(spans, num_spans, elements);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+size_t JitterDequeueAt(void *libjitter, const uint32_t media_timestamp, void *destination, const size_t destination_length, const size_t elements) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->DequeueAt(media_timestamp, static_cast<std::uint8_t *>(destination), destination_length, elements);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+size_t JitterPeek(void *libjitter,
+                  const size_t elements,
+                  Packet spans[],
+                  const size_t max_spans) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->Peek(elements, spans, max_spans);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+size_t JitterCommitRead(void *libjitter, const size_t elements) {
+  try {
+    auto *buffer = static_cast<JitterBuffer *>(libjitter);
+    return buffer->CommitRead(elements);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
+void JitterGetMetrics(void *libjitter, Metrics *metrics) {
+  *metrics = static_cast<JitterBuffer *>(libjitter)->GetMetrics();
+}
+
+size_t JitterDrainTrace(void *libjitter, const LibJitterTraceCallback callback, void *user_data) {
+  return static_cast<JitterBuffer *>(libjitter)->DrainTrace(callback, user_data);
+}
+
+size_t JitterDrainTraceToLog(void *libjitter) {
+  try {
+    return static_cast<JitterBuffer *>(libjitter)->DrainTrace();
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 0;
+  }
+}
+
 void JitterDestroy(void *libjitter) {
   delete static_cast<JitterBuffer *>(libjitter);
 }
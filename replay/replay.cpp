@@ -0,0 +1,275 @@
+#include <JitterBuffer.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std::chrono;
+
+/// @brief One packet arrival from a trace.
+struct Arrival {
+  std::uint32_t sequence_number;
+  std::int64_t arrival_ms;
+  std::size_t payload_bytes;
+};
+
+/// @brief Buffer settings under test.
+struct ReplayOptions {
+  std::size_t element_size = 2;
+  std::size_t packet_elements = 480;
+  std::uint32_t clock_rate = 48000;
+  milliseconds max_length = milliseconds(200);
+  milliseconds min_length = milliseconds(40);
+  std::size_t streams = 1;
+  DepthMode depth = DepthMode::Fixed;
+  SequenceMode sequence = SequenceMode::Full;
+};
+
+/// @brief What happened while replaying one stream.
+struct ReplayResult {
+  Metrics metrics;
+  std::size_t played_elements = 0;
+  std::size_t underrun_elements = 0;
+  std::vector<std::int64_t> latencies_ms;
+  milliseconds duration = milliseconds(0);
+};
+
+static void Usage(const char *name) {
+  std::cerr << "Usage: " << name << " [options] <trace>" << std::endl
+            << "Replays packet arrivals through a JitterBuffer on a virtual clock." << std::endl
+            << "Each trace line is: sequence_number arrival_ms [payload_bytes], '#' starts a comment." << std::endl
+            << "Options:" << std::endl
+            << "  --element-size <bytes>     Size of each element (default 2)" << std::endl
+            << "  --packet-elements <count>  Elements per packet (default 480)" << std::endl
+            << "  --clock-rate <hz>          Element clock rate (default 48000)" << std::endl
+            << "  --max-length <ms>          Buffer max length (default 200)" << std::endl
+            << "  --min-length <ms>          Buffer min length (default 40)" << std::endl
+            << "  --adaptive                 Adapt the target depth to the trace's jitter" << std::endl
+            << "  --rtp                      Sequence numbers are 16 bit RTP ones, which may roll over" << std::endl
+            << "  --streams <count>          Replay this many copies, to measure streams per core (default 1)" << std::endl;
+}
+
+static std::vector<Arrival> LoadTrace(std::istream &input) {
+  std::vector<Arrival> arrivals;
+  std::string line;
+  std::size_t line_number = 0;
+  while (std::getline(input, line)) {
+    line_number++;
+    line = line.substr(0, line.find('#'));
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream fields(line);
+    unsigned long sequence_number;
+    double arrival_ms;
+    if (!(fields >> sequence_number)) {
+      // Blank or comment.
+      continue;
+    }
+    if (!(fields >> arrival_ms)) {
+      std::ostringstream message;
+      message << "Line " << line_number << ": missing arrival time";
+      throw std::invalid_argument(message.str());
+    }
+    std::size_t payload_bytes = 0;
+    fields >> payload_bytes;
+    arrivals.push_back({
+            .sequence_number = static_cast<std::uint32_t>(sequence_number),
+            .arrival_ms = std::llround(arrival_ms),
+            .payload_bytes = payload_bytes,
+    });
+  }
+
+  // Replay in arrival order, keeping the trace order for ties.
+  std::stable_sort(arrivals.begin(), arrivals.end(), [](const Arrival &first, const Arrival &second) {
+    return first.arrival_ms < second.arrival_ms;
+  });
+  return arrivals;
+}
+
+static void ZeroConcealment(Packet *packets, const std::size_t num_packets, void *) {
+  for (std::size_t index = 0; index < num_packets; index++) {
+    memset(packets[index].data, 0, packets[index].length);
+  }
+}
+
+/// @brief Unwrap a sequence number to the closest to reference with the same low bits, as the buffer does in RTP mode.
+static std::int64_t ExtendSequence(const std::uint32_t sequence_number, const std::int64_t reference, const SequenceMode mode) {
+  if (mode == SequenceMode::Full) {
+    return sequence_number;
+  }
+  return reference + static_cast<std::int16_t>(static_cast<std::uint16_t>(sequence_number) - static_cast<std::uint16_t>(reference));
+}
+
+static ReplayResult Replay(const std::vector<Arrival> &arrivals, const ReplayOptions &options, const cantina::LoggerPointer &logger) {
+  ReplayResult result;
+  if (arrivals.empty()) {
+    return result;
+  }
+
+  JitterBuffer buffer(options.element_size, options.packet_elements, options.clock_rate, options.max_length, options.min_length, logger, {.clock = ClockMode::Manual, .depth = options.depth, .sequence = options.sequence});
+  std::vector<std::uint8_t> payload(options.element_size * options.packet_elements);
+  const std::size_t max_spans = 4;
+  Packet spans[max_spans];
+
+  // Arrival time per sequence number, to see how long each packet waited before being played.
+  // RTP sequence numbers are unwrapped against the newest delivered, in delivery order, so rollover keeps counting up.
+  std::vector<std::int64_t> extended;
+  extended.reserve(arrivals.size());
+  std::int64_t newest = arrivals.front().sequence_number;
+  for (const Arrival &arrival : arrivals) {
+    extended.push_back(ExtendSequence(arrival.sequence_number, newest, options.sequence));
+    newest = std::max(newest, extended.back());
+  }
+  const std::int64_t first_sequence = *std::min_element(extended.begin(), extended.end());
+  const std::int64_t last_sequence = *std::max_element(extended.begin(), extended.end());
+  std::vector<std::optional<std::int64_t>> arrived(last_sequence - first_sequence + 1);
+  result.latencies_ms.reserve(arrivals.size());
+
+  // Playout pulls one packet's worth every packet duration.
+  const std::int64_t tick_ms = std::max<std::int64_t>(1, options.packet_elements * 1000 / options.clock_rate);
+  const std::int64_t start_ms = arrivals.front().arrival_ms;
+  const std::int64_t end_ms = arrivals.back().arrival_ms + options.max_length.count();
+  auto next = arrivals.begin();
+  newest = arrivals.front().sequence_number;
+  for (std::int64_t now_ms = start_ms; now_ms <= end_ms; now_ms += tick_ms) {
+    buffer.SetTime(milliseconds(now_ms));
+
+    // Deliver everything that arrived by now.
+    for (; next != arrivals.end() && next->arrival_ms <= now_ms; ++next) {
+      buffer.SetTime(milliseconds(next->arrival_ms));
+      const Packet packet = {
+              .sequence_number = next->sequence_number,
+              .data = payload.data(),
+              .length = payload.size(),
+              .elements = options.packet_elements,
+      };
+      buffer.Enqueue(&packet, 1, &ZeroConcealment, nullptr);
+      const std::int64_t sequence_number = extended[next - arrivals.begin()];
+      newest = std::max(newest, sequence_number);
+      auto &slot = arrived[sequence_number - first_sequence];
+      if (!slot.has_value()) {
+        slot = next->arrival_ms;
+      }
+    }
+    buffer.SetTime(milliseconds(now_ms));
+
+    // Play out, noting latency for anything real that's consumed.
+    std::size_t played = 0;
+    const std::size_t filled = buffer.Peek(options.packet_elements, spans, max_spans);
+    for (std::size_t index = 0; index < filled; index++) {
+      const std::int64_t sequence_number = ExtendSequence(static_cast<std::uint32_t>(spans[index].sequence_number), newest, options.sequence);
+      played += spans[index].elements;
+      if (sequence_number < first_sequence || sequence_number > last_sequence) {
+        continue;
+      }
+      auto &slot = arrived[sequence_number - first_sequence];
+      if (slot.has_value()) {
+        result.latencies_ms.push_back(now_ms - slot.value());
+        slot.reset();
+      }
+    }
+    buffer.CommitRead(played);
+    result.played_elements += played;
+    result.underrun_elements += options.packet_elements - played;
+  }
+  result.metrics = buffer.GetMetrics();
+  result.duration = milliseconds(end_ms - start_ms);
+  return result;
+}
+
+static std::int64_t Percentile(const std::vector<std::int64_t> &sorted, const double percentile) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(percentile * sorted.size()))];
+}
+
+int main(const int argc, const char *argv[]) {
+  ReplayOptions options;
+  const char *trace_path = nullptr;
+  for (int index = 1; index < argc; index++) {
+    const std::string argument = argv[index];
+    const bool has_value = index + 1 < argc;
+    if (argument == "--adaptive") {
+      options.depth = DepthMode::Adaptive;
+    } else if (argument == "--rtp") {
+      options.sequence = SequenceMode::Rtp;
+    } else if (argument == "--element-size" && has_value) {
+      options.element_size = std::strtoul(argv[++index], nullptr, 10);
+    } else if (argument == "--packet-elements" && has_value) {
+      options.packet_elements = std::strtoul(argv[++index], nullptr, 10);
+    } else if (argument == "--clock-rate" && has_value) {
+      options.clock_rate = std::strtoul(argv[++index], nullptr, 10);
+    } else if (argument == "--max-length" && has_value) {
+      options.max_length = milliseconds(std::strtol(argv[++index], nullptr, 10));
+    } else if (argument == "--min-length" && has_value) {
+      options.min_length = milliseconds(std::strtol(argv[++index], nullptr, 10));
+    } else if (argument == "--streams" && has_value) {
+      options.streams = std::max<std::size_t>(1, std::strtoul(argv[++index], nullptr, 10));
+    } else if (argument.rfind("--", 0) != 0 && trace_path == nullptr) {
+      trace_path = argv[index];
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (trace_path == nullptr) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  try {
+    std::ifstream input(trace_path);
+    if (!input) {
+      throw std::runtime_error(std::string("Couldn't open trace: ") + trace_path);
+    }
+    const std::vector<Arrival> arrivals = LoadTrace(input);
+    const auto logger = std::make_shared<cantina::Logger>("REPLAY", "");
+
+    // Every stream replays the same trace, the first one's results are reported.
+    const auto wall_start = steady_clock::now();
+    ReplayResult result = Replay(arrivals, options, logger);
+    for (std::size_t stream = 1; stream < options.streams; stream++) {
+      Replay(arrivals, options, logger);
+    }
+    const auto wall = duration_cast<duration<double>>(steady_clock::now() - wall_start);
+
+    std::size_t payload_bytes = 0;
+    for (const Arrival &arrival : arrivals) {
+      payload_bytes += arrival.payload_bytes;
+    }
+    std::sort(result.latencies_ms.begin(), result.latencies_ms.end());
+    const double simulated_seconds = duration_cast<duration<double>>(result.duration).count() * options.streams;
+    std::cout << "Packets: " << arrivals.size() << " over " << result.duration.count() << "ms";
+    if (payload_bytes > 0 && result.duration.count() > 0) {
+      std::cout << " (" << payload_bytes * 8 / result.duration.count() << "kbps)";
+    }
+    std::cout << std::endl
+              << "Played: " << result.played_elements << " elements, underrun: " << result.underrun_elements << " elements" << std::endl
+              << "Concealed: " << result.metrics.concealed_frames << std::endl
+              << "Skipped: " << result.metrics.skipped_frames << std::endl
+              << "Filled: " << result.metrics.filled_packets << std::endl
+              << "Updated: " << result.metrics.updated_frames << std::endl
+              << "Update missed: " << result.metrics.update_missed_frames << std::endl
+              << "Dropped: " << result.metrics.dropped_frames << std::endl
+              << "Late: " << result.metrics.late_packets << " packets, average depth " << (result.metrics.late_packets > 0 ? result.metrics.update_depth_packets / result.metrics.late_packets : 0) << " packets" << std::endl
+              << "Lost to a full buffer: " << result.metrics.full_dropped_packets << " packets" << std::endl
+              << "Final target depth ms: " << result.metrics.target_depth_ms << std::endl
+              << "Added latency ms: p50 " << Percentile(result.latencies_ms, 0.5)
+              << " p99 " << Percentile(result.latencies_ms, 0.99)
+              << " max " << Percentile(result.latencies_ms, 1) << std::endl
+              << "Streams per core: " << (wall.count() > 0 ? simulated_seconds / wall.count() : 0) << std::endl;
+  } catch (const std::exception &exception) {
+    std::cerr << exception.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -6,7 +6,7 @@ BufferInspector::BufferInspector(JitterBuffer *buffer) {
 }
 
 std::size_t BufferInspector::GetWritten() const {
-  return this->buffer->written;
+  return this->buffer->state->written;
 }
 
 std::size_t BufferInspector::GetReadOffset() const {
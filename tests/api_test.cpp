@@ -1,10 +1,24 @@
 #include <doctest/doctest.h>
 #include "JitterBuffer.hh"
+#include "JitterBufferPool.hh"
+#include "JitterBufferT.hh"
+#include "JitterTap.hh"
 #include <chrono>
+#include <cmath>
+#include <coroutine>
 #include <memory>
 #include <map>
+#include <numbers>
 #include "test_functions.h"
 #include <thread>
+#ifdef __linux__
+#include <poll.h>
+#endif
+#if !LIBJITTER_LINEAR_RING && defined(__linux__)
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 using namespace std::chrono;
 
@@ -16,6 +30,35 @@ TEST_CASE("libjitter::construct") {
   auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
 }
 
+TEST_CASE("libjitter::packet_sizing") {
+  const std::size_t frame_size = 1;
+  const std::size_t frames_per_packet = 480;
+  const auto max_length = milliseconds(10000);
+  const auto per_element = JitterBuffer(frame_size, frames_per_packet, 48000, max_length, milliseconds(0), logger);
+  const auto per_packet = JitterBuffer(frame_size, frames_per_packet, 48000, max_length, milliseconds(0), logger, {.sizing = SizingMode::PerPacket});
+
+  // 1000 packets of 10ms, each with one header, rounded up to a page.
+  const std::size_t expected = 1000 * (frames_per_packet * frame_size + JitterBuffer::METADATA_SIZE);
+  CHECK_GE(per_packet.GetMappedSize(), expected);
+  CHECK_LT(per_packet.GetMappedSize(), expected + 4096 * 16);
+  CHECK_LT(per_packet.GetMappedSize(), per_element.GetMappedSize());
+}
+
+TEST_CASE("libjitter::packet_sizing_fill") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.sizing = SizingMode::PerPacket});
+
+  // Should hold at least max_length worth of packets.
+  std::size_t total = 0;
+  for (std::uint32_t sequence_number = 0; sequence_number < 10; sequence_number++) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    total += buffer.Enqueue(std::vector<Packet>{packet}, [](const std::vector<Packet> &) {});
+    free(packet.data);
+  }
+  CHECK_EQ(total, 10 * frames_per_packet);
+}
+
 TEST_CASE("libjitter::enqueue") {
   const std::size_t frame_size = 2 * 2;
   const std::size_t frames_per_packet = 480;
@@ -174,6 +217,84 @@ TEST_CASE("libjitter::runover_read") {
   free(dequeued_data);
 }
 
+TEST_CASE("libjitter::peek_commit") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  Packet packets[] = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(2, frame_size, frames_per_packet)};
+  REQUIRE_EQ(2 * frames_per_packet, buffer.Enqueue(std::vector<Packet>(packets, packets + 2), [](const std::vector<Packet> &) {}));
+
+  // Peek 1.5 packets, should get two spans pointing into the buffer.
+  const std::size_t to_peek = frames_per_packet * 1.5f;
+  Packet spans[4];
+  REQUIRE_EQ(2, buffer.Peek(to_peek, spans, 4));
+  CHECK_EQ(spans[0].sequence_number, 1);
+  CHECK_EQ(spans[0].elements, frames_per_packet);
+  CHECK_EQ(0, memcmp(spans[0].data, packets[0].data, packets[0].length));
+  CHECK_EQ(spans[1].sequence_number, 2);
+  CHECK_EQ(spans[1].elements, to_peek - frames_per_packet);
+  CHECK_EQ(0, memcmp(spans[1].data, packets[1].data, spans[1].length));
+
+  // Peeking again without committing gives the same view.
+  REQUIRE_EQ(2, buffer.Peek(to_peek, spans, 4));
+  CHECK_EQ(spans[0].sequence_number, 1);
+
+  // Commit what we used, the rest should dequeue as normal.
+  CHECK_EQ(to_peek, buffer.CommitRead(to_peek));
+  const std::size_t remaining = 2 * frames_per_packet - to_peek;
+  CHECK_EQ(milliseconds(remaining * 1000 / 48000), buffer.GetCurrentDepth());
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  REQUIRE_EQ(remaining, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), static_cast<std::uint8_t *>(packets[1].data) + (frames_per_packet - remaining) * frame_size, remaining * frame_size));
+  CHECK_EQ(0, buffer.Peek(frames_per_packet, spans, 4));
+
+  // Dequeuing gives back an uncommitted peek, so a late commit can't consume what was never peeked.
+  Packet more[] = {makeTestPacket(3, frame_size, frames_per_packet), makeTestPacket(4, frame_size, frames_per_packet)};
+  REQUIRE_EQ(2 * frames_per_packet, buffer.Enqueue(std::vector<Packet>(more, more + 2), [](const std::vector<Packet> &) {}));
+  REQUIRE_EQ(1, buffer.Peek(frames_per_packet, spans, 4));
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), more[0].data, more[0].length));
+  CHECK_EQ(0, buffer.CommitRead(frames_per_packet));
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), more[1].data, more[1].length));
+  free(packets[0].data);
+  free(packets[1].data);
+  free(more[0].data);
+  free(more[1].data);
+}
+
+TEST_CASE("libjitter::reserve_commit") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+
+  // Write straight into the buffer.
+  std::uint8_t *reserved = buffer.Reserve(1);
+  REQUIRE_NE(reserved, nullptr);
+  memset(reserved, 1, frames_per_packet * frame_size);
+  CHECK_THROWS_AS(buffer.Reserve(2), const std::logic_error &);
+
+  // Nothing else can be written until it's committed, or the reservation would be overwritten.
+  Packet other = makeTestPacket(2, frame_size, frames_per_packet);
+  CHECK_THROWS_AS(buffer.Enqueue(&other, 1, [](Packet *, const std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr), const std::logic_error &);
+  CHECK_THROWS_AS(buffer.Prepare(3, [](Packet *, const std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr), const std::logic_error &);
+  free(other.data);
+  CHECK_EQ(milliseconds(0), buffer.GetCurrentDepth());
+  CHECK_EQ(frames_per_packet, buffer.CommitWrite());
+  CHECK_EQ(0, buffer.CommitWrite());
+  CHECK_EQ(milliseconds(10), buffer.GetCurrentDepth());
+
+  // Old sequence numbers can't be reserved.
+  CHECK_EQ(buffer.Reserve(1), nullptr);
+
+  // It should come back out like any other packet.
+  Packet expected = makeTestPacket(1, frame_size, frames_per_packet);
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), expected.data, expected.length));
+  free(expected.data);
+}
+
 TEST_CASE("libjitter::concealment") {
   const std::size_t frame_size = 2 * 2;
   const std::size_t frames_per_packet = 480;
@@ -212,6 +333,32 @@ TEST_CASE("libjitter::concealment") {
   free(sequence4.data);
 }
 
+TEST_CASE("libjitter::concealment_function") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+
+  // Enqueue 1 then 4 through the span overload, 2 and 3 should be concealed.
+  Packet packets[] = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(4, frame_size, frames_per_packet)};
+  std::vector<unsigned long> concealed;
+  const std::size_t enqueued = buffer.Enqueue(
+          packets, 2,
+          [](Packet *concealment, const std::size_t num_packets, void *user_data) {
+            auto *sequences = static_cast<std::vector<unsigned long> *>(user_data);
+            for (std::size_t index = 0; index < num_packets; index++) {
+              memset(concealment[index].data, 0, concealment[index].length);
+              sequences->push_back(concealment[index].sequence_number);
+            }
+          },
+          &concealed);
+  CHECK_EQ(enqueued, 4 * frames_per_packet);
+  REQUIRE_EQ(concealed.size(), 2);
+  CHECK_EQ(concealed[0], 2);
+  CHECK_EQ(concealed[1], 3);
+  free(packets[0].data);
+  free(packets[1].data);
+}
+
 TEST_CASE("libjitter::current_depth") {
   const std::size_t frame_size = 2 * 2;
   const std::size_t frames_per_packet = 480;
@@ -385,6 +532,36 @@ TEST_CASE("libjitter::too_old") {
   free(destination);
 }
 
+TEST_CASE("libjitter::manual_clock") {
+  const auto max_age = milliseconds(100);
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(sizeof(std::size_t), frames_per_packet, 48000, max_age, milliseconds(0), logger, {.clock = ClockMode::Manual});
+  buffer.SetTime(milliseconds(1000));
+
+  Packet old_packet = makeTestPacket(1, sizeof(std::size_t), frames_per_packet);
+  REQUIRE_EQ(frames_per_packet, buffer.Enqueue(std::vector<Packet>{old_packet}, [](const std::vector<Packet> &) {}));
+  buffer.SetTime(milliseconds(1000) + max_age);
+  Packet packet = makeTestPacket(2, sizeof(std::size_t), frames_per_packet);
+  REQUIRE_EQ(frames_per_packet, buffer.Enqueue(std::vector<Packet>{packet}, [](const std::vector<Packet> &) {}));
+
+  // Only the second packet is still young enough.
+  auto *destination = reinterpret_cast<std::uint8_t *>(calloc(2, sizeof(std::size_t) * frames_per_packet));
+  const std::size_t dequeued = buffer.Dequeue(destination, 2 * sizeof(std::size_t) * frames_per_packet, 2 * frames_per_packet);
+  REQUIRE_EQ(frames_per_packet, dequeued);
+  CHECK_EQ(0, memcmp(destination, packet.data, packet.length));
+  CHECK_EQ(frames_per_packet, buffer.GetMetrics().skipped_frames);
+
+  // Time going backwards should not expire anything.
+  Packet next = makeTestPacket(3, sizeof(std::size_t), frames_per_packet);
+  REQUIRE_EQ(frames_per_packet, buffer.Enqueue(std::vector<Packet>{next}, [](const std::vector<Packet> &) {}));
+  buffer.SetTime(milliseconds(0));
+  CHECK_EQ(frames_per_packet, buffer.Dequeue(destination, 2 * sizeof(std::size_t) * frames_per_packet, frames_per_packet));
+  free(old_packet.data);
+  free(packet.data);
+  free(next.data);
+  free(destination);
+}
+
 TEST_CASE("libjitter::buffer_too_small")
 {
   auto buffer = JitterBuffer(2, 480, 100000, milliseconds(100), milliseconds(0), logger);
@@ -410,6 +587,25 @@ TEST_CASE("libjitter::element_mismatch")
                        const std::invalid_argument&);
 }
 
+TEST_CASE("libjitter::element_mismatch_late") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  Packet packets[] = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(3, frame_size, frames_per_packet)};
+  buffer.Enqueue(packets, 2, [](Packet *concealment, const std::size_t, void *) { memset(concealment->data, 0, concealment->length); }, nullptr);
+
+  // A late packet or duplicate of the wrong size misses its update rather than throwing.
+  Packet late = makeTestPacket(2, frame_size, frames_per_packet / 2);
+  Packet duplicate = makeTestPacket(3, frame_size, 2 * frames_per_packet);
+  CHECK_EQ(0, buffer.Enqueue(&late, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(0, buffer.Enqueue(&duplicate, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(frames_per_packet / 2, buffer.GetMetrics().update_missed_frames);
+  CHECK_EQ(milliseconds(30), buffer.GetCurrentDepth());
+  for (void *data : {packets[0].data, packets[1].data, late.data, duplicate.data}) {
+    free(data);
+  }
+}
+
 TEST_CASE("libjitter::packet_less_than_1ms") {
   CHECK_THROWS_WITH_AS(JitterBuffer(2, 10, 48000, milliseconds(100), milliseconds(0), logger),
                        "Packets should be at least 1ms.",
@@ -488,7 +684,6 @@ TEST_CASE("libjitter::prepare") {
             FAIL("Unexpected concealment");
           });
   CHECK_EQ(enqueued, packet.elements);
-  free(packet.data);
 
   // Update should return nothing.
   {
@@ -535,6 +730,1237 @@ TEST_CASE("libjitter::prepare") {
     CHECK_EQ(prepared, packet.elements);
     CHECK(fired);
   }
+  free(packet.data);
+}
+
+// TODO: Test for only dequeing some of packet, then dequeueing the rest.
+TEST_CASE("libjitter::payload_alignment") {
+  // 200 byte packets don't naturally land on 64 byte boundaries.
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 50;
+  const std::size_t alignment = 64;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.payload_alignment = alignment});
+  CHECK_EQ(20, JitterBuffer::METADATA_SIZE);
+
+  std::vector<Packet> packets;
+  for (std::size_t sequence_number = 1; sequence_number <= 5; sequence_number++) {
+    packets.push_back(makeTestPacket(sequence_number, frame_size, frames_per_packet));
+  }
+  REQUIRE_EQ(5 * frames_per_packet, buffer.Enqueue(packets, [](const std::vector<Packet> &) {
+    FAIL("Unexpected concealment");
+  }));
+  for (std::size_t slot = 0; slot < packets.size(); slot++) {
+    CHECK_EQ(0, reinterpret_cast<std::uintptr_t>(buffer.GetReadPointerAtPacketOffset(slot)) % alignment);
+    CHECK(checkPacketInSlot(&buffer, packets[slot], slot));
+  }
+
+  // Peeked spans point at aligned data too.
+  Packet spans[2];
+  REQUIRE_EQ(2, buffer.Peek(2 * frames_per_packet, spans, 2));
+  CHECK_EQ(0, reinterpret_cast<std::uintptr_t>(spans[1].data) % alignment);
+  CHECK_EQ(0, memcmp(spans[1].data, packets[1].data, packets[1].length));
+  CHECK_EQ(2 * frames_per_packet, buffer.CommitRead(2 * frames_per_packet));
+
+  // Padding is skipped when reading.
+  std::vector<std::uint8_t> destination(3 * frames_per_packet * frame_size);
+  REQUIRE_EQ(3 * frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), 3 * frames_per_packet));
+  for (std::size_t index = 0; index < 3; index++) {
+    CHECK_EQ(0, memcmp(destination.data() + index * packets[index + 2].length, packets[index + 2].data, packets[index + 2].length));
+  }
+  for (auto &packet : packets) {
+    free(packet.data);
+  }
+
+  CHECK_THROWS_AS(JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.payload_alignment = 48}), const std::invalid_argument &);
+}
+
+TEST_CASE("libjitter::adaptive_depth") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(1000), milliseconds(20), logger, {.clock = ClockMode::Manual, .depth = DepthMode::Adaptive, .depth_window = 50});
+  CHECK_EQ(20, buffer.GetMetrics().target_depth_ms);
+
+  // Packets arriving in bursts of 5 are up to 40ms late.
+  unsigned long sequence_number = 0;
+  for (; sequence_number < 50; sequence_number++) {
+    buffer.SetTime(milliseconds((sequence_number / 5 * 5 + 4) * 10));
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+    free(packet.data);
+  }
+  CHECK_EQ(40, buffer.GetMetrics().target_depth_ms);
+
+  // Once the network settles, the target falls back to min_length.
+  for (; sequence_number < 100; sequence_number++) {
+    buffer.SetTime(milliseconds(sequence_number * 10));
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+    free(packet.data);
+  }
+  CHECK_EQ(20, buffer.GetMetrics().target_depth_ms);
+}
+
+TEST_CASE("libjitter::adaptive_depth_shrink") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(1000), milliseconds(20), logger, {.clock = ClockMode::Manual, .depth = DepthMode::Adaptive});
+
+  // Losing 1-59 leaves far more concealment than the 20ms target needs.
+  Packet first = makeTestPacket(0, frame_size, frames_per_packet);
+  buffer.Enqueue(&first, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  Packet last = makeTestPacket(60, frame_size, frames_per_packet);
+  buffer.Enqueue(&last, 1, [](Packet *packets, const std::size_t num_packets, void *) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      memset(packets[index].data, 0, packets[index].length);
+    }
+  }, nullptr);
+  CHECK_EQ(milliseconds(610), buffer.GetCurrentDepth());
+
+  // Playing out, concealment gets dropped to catch up, but real data doesn't.
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), first.data, first.length));
+  std::size_t reads = 1;
+  while (buffer.GetCurrentDepth() > milliseconds(0)) {
+    buffer.SetTime(milliseconds(reads++ * 10));
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  }
+  CHECK_EQ(0, memcmp(destination.data(), last.data, last.length));
+  CHECK_LT(reads, 61);
+  CHECK_EQ((61 - reads) * frames_per_packet, buffer.GetMetrics().dropped_frames);
+  free(first.data);
+  free(last.data);
+}
+
+TEST_CASE("libjitter::pool") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto pool = JitterBufferPool(3, frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  CHECK_EQ(3, pool.GetCapacity());
+
+  // Streams are handed out until the pool runs dry.
+  const auto first = pool.Acquire();
+  const auto second = pool.Acquire();
+  const auto third = pool.Acquire();
+  REQUIRE(first.has_value());
+  REQUIRE(second.has_value());
+  REQUIRE(third.has_value());
+  CHECK_FALSE(pool.Acquire().has_value());
+  CHECK_EQ(3, pool.GetActive());
+  Packet stale = makeTestPacket(5, frame_size, frames_per_packet);
+  pool.Get(*third).Enqueue(&stale, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  free(stale.data);
+  pool.Release(*third);
+  CHECK_EQ(2, pool.GetActive());
+  CHECK_THROWS_AS(pool.Get(*third), const std::invalid_argument &);
+
+  // Each stream's data lands at its own offset, inactive ones are left alone.
+  Packet packets[] = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(1, frame_size, frames_per_packet, 2)};
+  pool.Get(*first).Enqueue(&packets[0], 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  pool.Get(*second).Enqueue(&packets[1], 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  const std::size_t stride = frames_per_packet * frame_size;
+  std::vector<std::uint8_t> destination(3 * stride);
+  std::size_t dequeued[3];
+  CHECK_EQ(2 * frames_per_packet, pool.DequeueAll(destination.data(), destination.size(), frames_per_packet, dequeued));
+  CHECK_EQ(frames_per_packet, dequeued[*first]);
+  CHECK_EQ(frames_per_packet, dequeued[*second]);
+  CHECK_EQ(0, dequeued[*third]);
+  CHECK_EQ(0, memcmp(destination.data() + *first * stride, packets[0].data, stride));
+  CHECK_EQ(0, memcmp(destination.data() + *second * stride, packets[1].data, stride));
+  CHECK_THROWS_AS(pool.DequeueAll(destination.data(), stride, frames_per_packet, dequeued), const std::invalid_argument &);
+
+  // A reused ring starts empty, and still wraps around.
+  const auto reused = pool.Acquire();
+  REQUIRE(reused.has_value());
+  CHECK_EQ(*third, *reused);
+  JitterBuffer &buffer = pool.Get(*reused);
+  CHECK_EQ(milliseconds(0), buffer.GetCurrentDepth());
+  for (unsigned long sequence_number = 1; sequence_number < 100; sequence_number++) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    REQUIRE_EQ(frames_per_packet, buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), stride, frames_per_packet));
+    CHECK_EQ(0, memcmp(destination.data(), packet.data, stride));
+    free(packet.data);
+  }
+  free(packets[0].data);
+  free(packets[1].data);
+}
+
+TEST_CASE("libjitter::reset") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.populate = PopulateMode::Lazy});
+
+  // Leave the buffer mid stream, with concealment and a partial read.
+  Packet packets[] = {makeTestPacket(10, frame_size, frames_per_packet), makeTestPacket(12, frame_size, frames_per_packet)};
+  buffer.Enqueue(packets, 2, [](Packet *concealment, const std::size_t num_packets, void *) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      memset(concealment[index].data, 0, concealment[index].length);
+    }
+  }, nullptr);
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  REQUIRE_EQ(frames_per_packet / 2, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet / 2));
+
+  // After a reset it behaves like a new buffer, older sequence numbers included.
+  buffer.Reset();
+  CHECK_EQ(milliseconds(0), buffer.GetCurrentDepth());
+  CHECK_EQ(0, buffer.GetMetrics().concealed_frames);
+  CHECK_EQ(0, buffer.Peek(frames_per_packet, packets, 1));
+  Packet fresh = makeTestPacket(1, frame_size, frames_per_packet);
+  REQUIRE_EQ(frames_per_packet, buffer.Enqueue(&fresh, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK(checkPacketInSlot(&buffer, fresh, 0));
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), fresh.data, fresh.length));
+  free(fresh.data);
+  free(packets[0].data);
+  free(packets[1].data);
+
+  // Other population modes map just the same.
+  CHECK_NOTHROW(JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.populate = PopulateMode::Prefault, .huge_pages = true}));
 }
 
-// TODO: Test for only dequeing some of packet, then dequeueing the rest.
\ No newline at end of file
+TEST_CASE("libjitter::memory_placement") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+
+  // Reserved huge pages round the ring up, whether or not any are available to back it.
+  auto huge = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.hugetlb = true});
+  CHECK_EQ(0, huge.GetMappedSize() % JitterBuffer::HUGE_PAGE_SIZE);
+
+  // Binding to the current node works or is ignored, either way the buffer is usable.
+  const int node = JitterBuffer::CurrentNumaNode();
+  CHECK_GE(node, -1);
+  auto bound = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.populate = PopulateMode::Prefault, .numa_node = std::max(node, 0)});
+  for (auto *buffer : {&huge, &bound}) {
+    Packet packet = makeTestPacket(1, frame_size, frames_per_packet);
+    REQUIRE_EQ(frames_per_packet, buffer->Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+    std::vector<std::uint8_t> destination(packet.length);
+    REQUIRE_EQ(frames_per_packet, buffer->Dequeue(destination.data(), destination.size(), frames_per_packet));
+    CHECK_EQ(0, memcmp(destination.data(), packet.data, packet.length));
+    free(packet.data);
+  }
+
+  // Pools share the same placement.
+  JitterBufferPool pool(2, frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.hugetlb = true, .numa_node = std::max(node, 0)});
+  const auto slot = pool.Acquire();
+  REQUIRE(slot.has_value());
+  CHECK_EQ(0, pool.Get(*slot).GetMappedSize() % JitterBuffer::HUGE_PAGE_SIZE);
+}
+
+TEST_CASE("libjitter::contiguous_concealment") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+
+  struct Seen {
+    std::size_t calls = 0;
+    Packet run{};
+    std::optional<unsigned long> previous;
+    std::uint8_t previous_content = 0;
+  } seen;
+
+  // A gap of 3 arrives as one run, with the packet before the gap as context.
+  Packet packets[] = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(5, frame_size, frames_per_packet)};
+  REQUIRE_EQ(5 * frames_per_packet, buffer.Enqueue(packets, 2, [](Packet *run, const Packet *previous, void *user_data) {
+    auto *seen = static_cast<Seen *>(user_data);
+    seen->calls++;
+    seen->run = *run;
+    if (previous != nullptr) {
+      seen->previous = previous->sequence_number;
+      seen->previous_content = *static_cast<const std::uint8_t *>(previous->data);
+    }
+    // Mark each packet's worth so the scatter can be checked.
+    for (std::size_t index = 0; index < run->elements / frames_per_packet; index++) {
+      memset(static_cast<std::uint8_t *>(run->data) + index * frames_per_packet * frame_size, static_cast<int>(100 + index), frames_per_packet * frame_size);
+    }
+  }, &seen));
+  CHECK_EQ(1, seen.calls);
+  CHECK_EQ(2, seen.run.sequence_number);
+  CHECK_EQ(3 * frames_per_packet, seen.run.elements);
+  CHECK_EQ(3 * frames_per_packet * frame_size, seen.run.length);
+  REQUIRE(seen.previous.has_value());
+  CHECK_EQ(1, seen.previous.value());
+  CHECK_EQ(1, seen.previous_content);
+  CHECK_EQ(3 * frames_per_packet, buffer.GetMetrics().concealed_frames);
+
+  // Each packet of the run landed in its own slot, and can still be updated.
+  for (std::size_t slot = 0; slot < 3; slot++) {
+    const std::uint8_t *read = buffer.GetReadPointerAtPacketOffset(slot + 1);
+    CHECK_EQ(100 + slot, read[0]);
+    CHECK_EQ(100 + slot, read[frames_per_packet * frame_size - 1]);
+  }
+  Packet late = makeTestPacket(3, frame_size, frames_per_packet);
+  CHECK_EQ(frames_per_packet, buffer.Enqueue(&late, 1, [](Packet *, const Packet *, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK(checkPacketInSlot(&buffer, late, 2));
+
+  // Prepare takes the same callback.
+  seen = Seen{};
+  CHECK_EQ(2 * frames_per_packet, buffer.Prepare(8, [](Packet *run, const Packet *previous, void *user_data) {
+    auto *seen = static_cast<Seen *>(user_data);
+    seen->calls++;
+    seen->run = *run;
+    seen->previous = previous != nullptr ? std::optional<unsigned long>(previous->sequence_number) : std::nullopt;
+    memset(run->data, 0, run->length);
+  }, &seen));
+  CHECK_EQ(1, seen.calls);
+  CHECK_EQ(6, seen.run.sequence_number);
+  CHECK_EQ(5, seen.previous.value());
+  free(late.data);
+  free(packets[0].data);
+  free(packets[1].data);
+}
+
+static void checkRollover(const SequenceMode mode, const unsigned long before, const unsigned long after_gap, const unsigned long missing) {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.sequence = mode});
+
+  // Wrap with one packet missing just after the rollover.
+  Packet packets[] = {makeTestPacket(before, frame_size, frames_per_packet), makeTestPacket(before + 1, frame_size, frames_per_packet), makeTestPacket(after_gap, frame_size, frames_per_packet)};
+  std::vector<unsigned long> concealed;
+  REQUIRE_EQ(4 * frames_per_packet, buffer.Enqueue(packets, 3, [](Packet *concealment, const std::size_t num_packets, void *user_data) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      static_cast<std::vector<unsigned long> *>(user_data)->push_back(concealment[index].sequence_number);
+      memset(concealment[index].data, 0, concealment[index].length);
+    }
+  }, &concealed));
+  REQUIRE_EQ(1, concealed.size());
+  CHECK_EQ(missing, concealed[0]);
+
+  // The late packet updates its concealment rather than looking older than everything.
+  Packet late = makeTestPacket(missing, frame_size, frames_per_packet);
+  CHECK_EQ(frames_per_packet, buffer.Enqueue(&late, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(frames_per_packet, buffer.GetMetrics().updated_frames);
+
+  // Something from before the wrap is just old, not billions of packets ahead.
+  Packet stale = makeTestPacket(before - 10, frame_size, frames_per_packet);
+  CHECK_EQ(0, buffer.Enqueue(&stale, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+
+  // Sequence numbers read back are as they were given.
+  Packet spans[4];
+  REQUIRE_EQ(4, buffer.Peek(4 * frames_per_packet, spans, 4));
+  CHECK_EQ(before, spans[0].sequence_number);
+  CHECK_EQ(before + 1, spans[1].sequence_number);
+  CHECK_EQ(missing, spans[2].sequence_number);
+  CHECK_EQ(after_gap, spans[3].sequence_number);
+  buffer.CommitRead(0);
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+  free(late.data);
+  free(stale.data);
+}
+
+TEST_CASE("libjitter::sequence_rollover") {
+  checkRollover(SequenceMode::Full, 0xFFFFFFFE, 1, 0);
+}
+
+TEST_CASE("libjitter::rtp_sequence_rollover") {
+  checkRollover(SequenceMode::Rtp, 0xFFFE, 1, 0);
+
+  // Many wraps over, only the packets missing between each arrival are ever concealed.
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.sequence = SequenceMode::Rtp});
+  Packet packet = makeTestPacket(0, frame_size, frames_per_packet);
+  std::vector<std::uint8_t> destination(packet.length);
+  std::size_t arrivals = 0;
+  for (unsigned long sequence_number = 60000; sequence_number < 3 * 65536; sequence_number += 7) {
+    packet.sequence_number = sequence_number & 0xFFFF;
+    buffer.Enqueue(&packet, 1, [](Packet *concealment, const std::size_t num_packets, void *) {
+      for (std::size_t index = 0; index < num_packets; index++) {
+        memset(concealment[index].data, 0, concealment[index].length);
+      }
+    }, nullptr);
+    while (buffer.Dequeue(destination.data(), destination.size(), frames_per_packet) > 0) {}
+    arrivals++;
+  }
+  CHECK_EQ((arrivals - 1) * 6 * frames_per_packet, buffer.GetMetrics().concealed_frames);
+  free(packet.data);
+}
+
+TEST_CASE("libjitter::metrics_counters") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  const std::size_t packet_bytes = frame_size * frames_per_packet;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(30), milliseconds(0), logger);
+  const auto conceal = [](Packet *concealment, const std::size_t num_packets, void *) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      memset(concealment[index].data, 0, concealment[index].length);
+    }
+  };
+
+  // 1 and 4 arrive, then 2 late by 2 packets.
+  Packet packets[] = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(4, frame_size, frames_per_packet), makeTestPacket(2, frame_size, frames_per_packet)};
+  REQUIRE_EQ(5 * frames_per_packet, buffer.Enqueue(packets, 3, conceal, nullptr));
+  Metrics metrics = buffer.GetMetrics();
+  CHECK_EQ(3 * packet_bytes, metrics.enqueued_bytes);
+  CHECK_EQ(1, metrics.late_packets);
+  CHECK_EQ(2, metrics.update_depth_packets);
+
+  // Reading more than there is is an underrun.
+  std::vector<std::uint8_t> destination(8 * packet_bytes);
+  CHECK_EQ(4 * frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), 8 * frames_per_packet));
+  metrics = buffer.GetMetrics();
+  CHECK_EQ(4 * packet_bytes, metrics.dequeued_bytes);
+  CHECK_EQ(1, metrics.underruns);
+
+  // Overfilling drops what doesn't fit.
+  std::vector<Packet> more;
+  for (unsigned long sequence_number = 5; sequence_number < 45; sequence_number++) {
+    more.push_back(makeTestPacket(sequence_number, frame_size, frames_per_packet));
+  }
+  const std::size_t enqueued = buffer.Enqueue(more.data(), more.size(), conceal, nullptr);
+  CHECK_LT(enqueued, more.size() * frames_per_packet);
+  CHECK_EQ(more.size() - enqueued / frames_per_packet, buffer.GetMetrics().full_dropped_packets);
+
+  // Reset clears everything.
+  buffer.Reset();
+  metrics = buffer.GetMetrics();
+  CHECK_EQ(0, metrics.enqueued_bytes);
+  CHECK_EQ(0, metrics.dequeued_bytes);
+  CHECK_EQ(0, metrics.full_dropped_packets);
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+  for (Packet &packet : more) {
+    free(packet.data);
+  }
+}
+
+TEST_CASE("libjitter::metrics_snapshot") {
+  // Snapshots from a third thread, while both sides run, are consistent and never go backwards.
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  std::atomic<bool> running = true;
+  std::thread writer([&buffer, &running, frame_size, frames_per_packet]() {
+    Packet packet = makeTestPacket(0, frame_size, frames_per_packet);
+    for (unsigned long sequence_number = 0; running; sequence_number += 2) {
+      // Every other packet is missing, then arrives late.
+      packet.sequence_number = sequence_number + 1;
+      buffer.Enqueue(&packet, 1, [](Packet *concealment, const std::size_t num_packets, void *) {
+        for (std::size_t index = 0; index < num_packets; index++) {
+          memset(concealment[index].data, 0, concealment[index].length);
+        }
+      }, nullptr);
+      packet.sequence_number = sequence_number;
+      buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) {}, nullptr);
+    }
+    free(packet.data);
+  });
+  std::thread reader([&buffer, &running, frame_size, frames_per_packet]() {
+    std::vector<std::uint8_t> destination(frame_size * frames_per_packet);
+    while (running) {
+      buffer.Dequeue(destination.data(), destination.size(), frames_per_packet);
+    }
+  });
+
+  Metrics last = {};
+  for (int snapshot = 0; snapshot < 10000; snapshot++) {
+    const Metrics metrics = buffer.GetMetrics();
+    CHECK_GE(metrics.enqueued_bytes, last.enqueued_bytes);
+    CHECK_GE(metrics.dequeued_bytes, last.dequeued_bytes);
+    CHECK_GE(metrics.late_packets, last.late_packets);
+    CHECK_LE(metrics.updated_frames + metrics.update_missed_frames, metrics.late_packets * frames_per_packet);
+    last = metrics;
+  }
+  running = false;
+  writer.join();
+  reader.join();
+}
+
+#ifndef LIBJITTER_NO_TRACE
+TEST_CASE("libjitter::trace") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.clock = ClockMode::Manual, .trace_capacity = 4});
+  buffer.SetTime(milliseconds(1000));
+
+  // A late packet with nothing to update is traced rather than logged.
+  Packet packets[] = {makeTestPacket(5, frame_size, frames_per_packet), makeTestPacket(2, frame_size, frames_per_packet)};
+  REQUIRE_EQ(frames_per_packet, buffer.Enqueue(packets, 2, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  std::vector<TraceEvent> events;
+  const auto collect = [](const TraceEvent *event, void *user_data) {
+    static_cast<std::vector<TraceEvent> *>(user_data)->push_back(*event);
+  };
+  CHECK_EQ(1, buffer.DrainTrace(collect, &events));
+  REQUIRE_EQ(1, events.size());
+  CHECK_EQ(JITTER_TRACE_UPDATE_NOT_FOUND, events[0].type);
+  CHECK_EQ(2, events[0].sequence_number);
+  CHECK_EQ(1000, events[0].time_ms);
+  CHECK_EQ("[2] Couldn't find target packet. at 1000ms", JitterBuffer::DescribeTraceEvent(events[0]));
+
+  // A burst beyond capacity drops events, never blocking, and counts what was lost.
+  for (int late = 0; late < 10; late++) {
+    buffer.Enqueue(&packets[1], 1, [](Packet *, std::size_t, void *) {}, nullptr);
+  }
+  events.clear();
+  CHECK_EQ(4, buffer.DrainTrace(collect, &events));
+  CHECK_EQ(6, buffer.GetMetrics().trace_dropped_events);
+  CHECK_EQ(0, buffer.DrainTrace());
+
+  // Reset discards what hasn't been drained.
+  buffer.Enqueue(&packets[1], 1, [](Packet *, std::size_t, void *) {}, nullptr);
+  buffer.Reset();
+  CHECK_EQ(0, buffer.DrainTrace(collect, &events));
+
+  // No capacity, no tracing.
+  auto untraced = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.trace_capacity = 0});
+  REQUIRE_EQ(frames_per_packet, untraced.Enqueue(packets, 2, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(0, untraced.DrainTrace(collect, &events));
+  CHECK_EQ(0, untraced.GetMetrics().trace_dropped_events);
+  free(packets[0].data);
+  free(packets[1].data);
+}
+#endif
+
+TEST_CASE("libjitter::update_read_stress") {
+  // Late packets race the reader over their concealment. Every packet comes out in order, either concealment or real, never mixed or skipped.
+  const std::size_t frame_size = sizeof(std::uint32_t);
+  const std::size_t frames_per_packet = 48;
+  const std::uint32_t packets = 20001;
+  const std::uint32_t concealed = 0xFFFFFFFF;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.clock = ClockMode::Manual});
+  buffer.SetTime(milliseconds(1000));
+
+  std::thread writer([&buffer, frames_per_packet, concealed]() {
+    std::vector<std::uint32_t> data(frames_per_packet);
+    Packet packet = {.sequence_number = 0, .data = data.data(), .length = data.size() * frame_size, .elements = frames_per_packet};
+    const auto conceal = [](Packet *concealment, const std::size_t num_packets, void *) {
+      for (std::size_t index = 0; index < num_packets; index++) {
+        memset(concealment[index].data, 0xFF, concealment[index].length);
+      }
+    };
+    buffer.Enqueue(&packet, 1, conceal, nullptr);
+    for (std::uint32_t sequence_number = 1; sequence_number < packets; sequence_number += 2) {
+      while (buffer.GetCurrentDepth() > milliseconds(50)) {
+        std::this_thread::yield();
+      }
+      // Every other packet is missing, then arrives straight after its concealment.
+      for (const std::uint32_t arriving : {sequence_number + 1, sequence_number}) {
+        std::fill(data.begin(), data.end(), arriving);
+        packet.sequence_number = arriving;
+        buffer.Enqueue(&packet, 1, conceal, nullptr);
+      }
+    }
+  });
+
+  std::size_t read = 0;
+  std::size_t wrong = 0;
+  std::size_t played_concealment = 0;
+  // Reads are a packet at a time, so each is one copy of one record and must be all concealment or all real.
+  const auto check = [&read, &wrong, &played_concealment, frames_per_packet, concealed](const std::uint32_t *elements, const std::size_t count) {
+    for (std::size_t start = 0; start < count; start += frames_per_packet, read += frames_per_packet) {
+      const std::uint32_t expected = static_cast<std::uint32_t>(read / frames_per_packet);
+      const bool concealment = elements[start] == concealed && expected % 2 == 1;
+      const std::uint32_t *end = elements + std::min(start + frames_per_packet, count);
+      if (count - start < frames_per_packet || std::find_if(elements + start, end, [concealment, expected, concealed](const std::uint32_t element) { return element != (concealment ? concealed : expected); }) != end) {
+        wrong++;
+      } else if (concealment) {
+        played_concealment += frames_per_packet;
+      }
+    }
+  };
+  std::vector<std::uint32_t> destination(frames_per_packet);
+  Packet spans[4];
+  const auto deadline = steady_clock::now() + seconds(60);
+  for (bool peek = false; read < packets * frames_per_packet && steady_clock::now() < deadline; peek = !peek) {
+    if (peek) {
+      // Concealment handed out here is pinned until committed.
+      const std::size_t filled = buffer.Peek(frames_per_packet, spans, 4);
+      std::size_t elements = 0;
+      for (std::size_t span = 0; span < filled; span++) {
+        check(static_cast<const std::uint32_t *>(spans[span].data), spans[span].elements);
+        elements += spans[span].elements;
+      }
+      buffer.CommitRead(elements);
+    } else {
+      const std::size_t dequeued = buffer.Dequeue(reinterpret_cast<std::uint8_t *>(destination.data()), destination.size() * frame_size, frames_per_packet);
+      check(destination.data(), dequeued);
+    }
+  }
+  writer.join();
+  CHECK_EQ(packets * frames_per_packet, read);
+  CHECK_EQ(0, wrong);
+  const Metrics metrics = buffer.GetMetrics();
+  CHECK_EQ(0, metrics.skipped_frames);
+  CHECK_EQ(0, metrics.full_dropped_packets);
+  CHECK_EQ(packets / 2 * frames_per_packet, metrics.concealed_frames);
+  // An update racing the end of a read can count elements that were played as concealment.
+  CHECK_GE(played_concealment, metrics.concealed_frames - metrics.updated_frames);
+}
+
+TEST_CASE("libjitter::variable_packets") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t max_frames = 960;
+  auto buffer = JitterBuffer(frame_size, max_frames, 48000, milliseconds(200), milliseconds(0), logger, {.packets = PacketMode::Variable});
+
+  // A 20ms packet, then the far end drops to 10ms, then 5ms.
+  Packet packets[] = {makeTestPacket(1, frame_size, 960), makeTestPacket(2, frame_size, 480), makeTestPacket(3, frame_size, 240)};
+  REQUIRE_EQ(960 + 480 + 240, buffer.Enqueue(packets, 3, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(milliseconds(35), buffer.GetCurrentDepth());
+  CHECK(checkPacketInSlot(&buffer, packets[1], 1));
+  CHECK(checkPacketInSlot(&buffer, packets[2], 2));
+
+  // Sizes outside 1ms to the max are still rejected.
+  Packet too_big = makeTestPacket(4, frame_size, max_frames + 1);
+  CHECK_THROWS_WITH_AS(buffer.Enqueue(&too_big, 1, [](Packet *, std::size_t, void *) {}, nullptr),
+                       "Supplied packet elements must be between 48 and 960. Got: 961",
+                       const std::invalid_argument &);
+  free(too_big.data);
+
+  // A gap is concealed at the size of the last packet that arrived.
+  Packet after_gap = makeTestPacket(6, frame_size, 240);
+  std::size_t concealed_elements = 0;
+  REQUIRE_EQ(240 * 3, buffer.Enqueue(&after_gap, 1, [](Packet *concealment, const std::size_t num_packets, void *user_data) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      CHECK_EQ(240, concealment[index].elements);
+      memset(concealment[index].data, 0, concealment[index].length);
+      *static_cast<std::size_t *>(user_data) += concealment[index].elements;
+    }
+  }, &concealed_elements));
+  CHECK_EQ(480, concealed_elements);
+
+  // A late packet that turns out a different size can't replace its concealment, one that matches can.
+  Packet late_mismatch = makeTestPacket(4, frame_size, 480);
+  Packet late_match = makeTestPacket(5, frame_size, 240);
+  CHECK_EQ(0, buffer.Enqueue(&late_mismatch, 1, [](Packet *, std::size_t, void *) {}, nullptr));
+  CHECK_EQ(240, buffer.Enqueue(&late_match, 1, [](Packet *, std::size_t, void *) {}, nullptr));
+  CHECK_EQ(480, buffer.GetMetrics().update_missed_frames);
+  CHECK_EQ(240, buffer.GetMetrics().updated_frames);
+
+  // Reads are frame accurate across the size changes.
+  std::vector<std::uint8_t> destination(700 * frame_size);
+  REQUIRE_EQ(700, buffer.Dequeue(destination.data(), destination.size(), 700));
+  CHECK_EQ(1, destination[0]);
+  CHECK_EQ(1, destination[699 * frame_size]);
+  REQUIRE_EQ(700, buffer.Dequeue(destination.data(), destination.size(), 700));
+  CHECK_EQ(1, destination[259 * frame_size]);
+  CHECK_EQ(2, destination[260 * frame_size]);
+  CHECK_EQ(2, destination[699 * frame_size]);
+  REQUIRE_EQ(700, buffer.Dequeue(destination.data(), destination.size(), 700));
+  CHECK_EQ(2, destination[39 * frame_size]);
+  CHECK_EQ(3, destination[40 * frame_size]);
+  CHECK_EQ(0, destination[280 * frame_size]);
+  CHECK_EQ(5, destination[520 * frame_size]);
+  REQUIRE_EQ(300, buffer.Dequeue(destination.data(), destination.size(), 700));
+  CHECK_EQ(5, destination[59 * frame_size]);
+  CHECK_EQ(6, destination[60 * frame_size]);
+  CHECK_EQ(6, destination[299 * frame_size]);
+
+  // Writes in place can come up short.
+  std::uint8_t *reserved = buffer.Reserve(7);
+  REQUIRE_NE(reserved, nullptr);
+  memset(reserved, 7, 480 * frame_size);
+  CHECK_THROWS_AS(buffer.CommitWrite(10), const std::invalid_argument &);
+  CHECK_EQ(480, buffer.CommitWrite(480));
+  CHECK_EQ(milliseconds(10), buffer.GetCurrentDepth());
+  REQUIRE_EQ(480, buffer.Dequeue(destination.data(), destination.size(), 700));
+  CHECK_EQ(7, destination[479 * frame_size]);
+
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+  free(after_gap.data);
+  free(late_mismatch.data);
+  free(late_match.data);
+}
+
+TEST_CASE("libjitter::variable_packets_capacity") {
+  // Sized for the smallest packets, so a buffer of them still holds max_length.
+  const std::size_t frame_size = 2 * 2;
+  auto buffer = JitterBuffer(frame_size, 2880, 48000, milliseconds(100), milliseconds(0), logger, {.sizing = SizingMode::PerPacket, .packets = PacketMode::Variable});
+  Packet packet = makeTestPacket(0, frame_size, 48);
+  for (unsigned long sequence_number = 0; sequence_number < 100; sequence_number++) {
+    packet.sequence_number = sequence_number;
+    REQUIRE_EQ(48, buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) {}, nullptr));
+  }
+  CHECK_EQ(milliseconds(100), buffer.GetCurrentDepth());
+  CHECK_EQ(0, buffer.GetMetrics().full_dropped_packets);
+  free(packet.data);
+}
+
+TEST_CASE("libjitter::dequeue_scatter") {
+  // 16 bit stereo, with each packet's left channel holding its sequence number and right the negative.
+  const std::size_t sample_size = sizeof(std::int16_t);
+  const std::size_t frame_size = 2 * sample_size;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  std::vector<std::int16_t> payload(2 * frames_per_packet);
+  for (const unsigned long sequence_number : {1ul, 3ul}) {
+    for (std::size_t index = 0; index < frames_per_packet; index++) {
+      payload[2 * index] = static_cast<std::int16_t>(sequence_number);
+      payload[2 * index + 1] = static_cast<std::int16_t>(-static_cast<int>(sequence_number));
+    }
+    const Packet packet = {.sequence_number = sequence_number, .data = payload.data(), .length = payload.size() * sample_size, .elements = frames_per_packet};
+    buffer.Enqueue(&packet, 1, [](Packet *concealment, const std::size_t num_packets, void *) {
+      for (std::size_t index = 0; index < num_packets; index++) {
+        memset(concealment[index].data, 0, concealment[index].length);
+      }
+    }, nullptr);
+  }
+
+  // Split into planar buffers, with the right channel spaced out to check the stride.
+  const std::size_t elements = 700;
+  std::vector<std::int16_t> left(elements);
+  std::vector<std::int16_t> right(2 * elements);
+  const ScatterSpan spans[] = {
+          {.destination = reinterpret_cast<std::uint8_t *>(left.data()), .destination_length = left.size() * sample_size, .offset = 0, .bytes = sample_size, .stride = sample_size},
+          {.destination = reinterpret_cast<std::uint8_t *>(right.data()), .destination_length = right.size() * sample_size, .offset = sample_size, .bytes = sample_size, .stride = 2 * sample_size},
+  };
+  REQUIRE_EQ(elements, buffer.DequeueV(spans, 2, elements));
+  CHECK_EQ(1, left[0]);
+  CHECK_EQ(1, left[479]);
+  CHECK_EQ(0, left[480]);
+  CHECK_EQ(-1, right[2 * 479]);
+  CHECK_EQ(0, right[2 * 479 + 1]);
+  CHECK_EQ(0, right[2 * 699]);
+  REQUIRE_EQ(elements, buffer.DequeueV(spans, 2, elements));
+  CHECK_EQ(0, left[259]);
+  CHECK_EQ(3, left[260]);
+  CHECK_EQ(-3, right[2 * 699]);
+  CHECK_EQ(40, buffer.DequeueV(spans, 2, elements));
+  CHECK_EQ(frames_per_packet * 3 * frame_size, buffer.GetMetrics().dequeued_bytes);
+
+  // Slices have to fit in an element, and in their destination.
+  const ScatterSpan outside = {.destination = spans[0].destination, .destination_length = spans[0].destination_length, .offset = 3, .bytes = 2, .stride = 2};
+  CHECK_THROWS_AS(buffer.DequeueV(&outside, 1, elements), const std::invalid_argument &);
+  CHECK_THROWS_WITH_AS(buffer.DequeueV(&spans[1], 1, 701),
+                       "Provided buffer too small. Was: 2800, need: 2802",
+                       const std::invalid_argument &);
+}
+
+TEST_CASE("libjitter::dequeue_at") {
+  // Mono 16 bit, each packet holding its sequence number, with media time wrapping partway through.
+  const std::size_t frames_per_packet = 480;
+  const std::uint32_t base = 0xFFFFFFFF - 700;
+  auto buffer = JitterBuffer(sizeof(std::int16_t), frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  std::vector<std::int16_t> payload(frames_per_packet);
+  for (const unsigned long sequence_number : {1ul, 2ul, 4ul, 5ul}) {
+    std::fill(payload.begin(), payload.end(), static_cast<std::int16_t>(sequence_number));
+    const Packet packet = {
+            .sequence_number = sequence_number,
+            .data = payload.data(),
+            .length = payload.size() * sizeof(std::int16_t),
+            .elements = frames_per_packet,
+            .media_timestamp = static_cast<std::uint32_t>(base + sequence_number * frames_per_packet),
+    };
+    buffer.Enqueue(&packet, 1, [](Packet *concealment, const std::size_t num_packets, void *) {
+      // The gap carries on from the packet before.
+      CHECK_EQ(1, num_packets);
+      CHECK_EQ(base + static_cast<std::uint32_t>(3 * frames_per_packet), concealment[0].media_timestamp);
+      memset(concealment[0].data, 0, concealment[0].length);
+    }, nullptr);
+  }
+
+  // Partway into the first packet.
+  std::vector<std::int16_t> out(frames_per_packet);
+  const std::size_t out_bytes = out.size() * sizeof(std::int16_t);
+  REQUIRE_EQ(frames_per_packet, buffer.DequeueAt(static_cast<std::uint32_t>(base + frames_per_packet + 100), reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(1, out[379]);
+  CHECK_EQ(2, out[380]);
+  CHECK_EQ(100, buffer.GetMetrics().seeked_frames);
+
+  // Earlier than what's left is nothing, and drops nothing.
+  CHECK_EQ(0, buffer.DequeueAt(base, reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(100, buffer.GetMetrics().seeked_frames);
+
+  // Over the rest of 2 and the concealed 3, past the wrap, into 4.
+  Packet spans[1];
+  REQUIRE_EQ(1, buffer.Peek(1, spans, 1));
+  CHECK_EQ(static_cast<std::uint32_t>(base + 2 * frames_per_packet + 100), spans[0].media_timestamp);
+  buffer.CommitRead(0);
+  REQUIRE_EQ(frames_per_packet, buffer.DequeueAt(static_cast<std::uint32_t>(base + 4 * frames_per_packet + 10), reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(4, out[0]);
+  CHECK_EQ(4, out[469]);
+  CHECK_EQ(5, out[470]);
+  CHECK_EQ(100 + 380 + frames_per_packet + 10, buffer.GetMetrics().seeked_frames);
+
+  // Past everything buffered drops it all, but hasn't reached the media time to play from.
+  const std::size_t underruns = buffer.GetMetrics().underruns;
+  CHECK_EQ(0, buffer.DequeueAt(static_cast<std::uint32_t>(base + 7 * frames_per_packet), reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(100 + 380 + 2 * frames_per_packet, buffer.GetMetrics().seeked_frames);
+  CHECK_EQ(underruns, buffer.GetMetrics().underruns);
+}
+
+/// @brief A stretch that records what it's asked to do, and keeps the start of its input.
+struct StretchCalls {
+  std::size_t calls = 0;
+  std::size_t input_elements = 0;
+  std::size_t output_elements = 0;
+};
+
+static void RecordStretch(const std::uint8_t *input, const std::size_t input_elements, std::uint8_t *output, const std::size_t output_elements, const std::size_t element_size, void *user_data) {
+  auto *calls = static_cast<StretchCalls *>(user_data);
+  calls->calls++;
+  calls->input_elements += input_elements;
+  calls->output_elements += output_elements;
+  memcpy(output, input, output_elements * element_size);
+}
+
+TEST_CASE("libjitter::drain") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(500), milliseconds(20), logger,
+                             {.clock = ClockMode::Manual, .drain_depth = milliseconds(100), .drain_rate = 0.25});
+  buffer.SetTime(milliseconds(1000));
+
+  // A burst brings in 300ms at once.
+  Packet packet = makeTestPacket(0, frame_size, frames_per_packet);
+  for (unsigned long sequence_number = 0; sequence_number < 30; sequence_number++) {
+    packet.sequence_number = sequence_number;
+    REQUIRE_EQ(frames_per_packet, buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  }
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  StretchCalls calls;
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet, &RecordStretch, &calls));
+  CHECK_EQ(1, calls.calls);
+  CHECK_EQ(600, calls.input_elements);
+  CHECK_EQ(milliseconds(287), buffer.GetCurrentDepth());
+
+  // It keeps playing fast past drain_depth, down to the target, then stops.
+  std::size_t plain = 0;
+  for (std::size_t stretched = 0; stretched != calls.calls && calls.calls < 100;) {
+    stretched = calls.calls;
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet, &RecordStretch, &calls));
+    plain += stretched == calls.calls ? frames_per_packet : 0;
+  }
+  CHECK_GE(buffer.GetCurrentDepth(), milliseconds(10));
+  CHECK_LE(buffer.GetCurrentDepth(), milliseconds(20));
+  const Metrics metrics = buffer.GetMetrics();
+  CHECK_EQ(calls.input_elements - calls.output_elements, metrics.accelerated_frames);
+  CHECK_EQ(0, metrics.underruns);
+  CHECK_EQ(0, metrics.skipped_frames);
+
+  // Everything read is accounted for.
+  std::vector<std::uint8_t> rest(30 * frames_per_packet * frame_size);
+  const std::size_t remaining = buffer.Dequeue(rest.data(), rest.size(), 30 * frames_per_packet);
+  CHECK_EQ(30 * frames_per_packet, calls.input_elements + plain + remaining);
+  free(packet.data);
+}
+
+TEST_CASE("libjitter::stretch_pcm16") {
+  // A tone squeezed by a fifth keeps its ends and has no click at the join.
+  const std::size_t input_elements = 600;
+  const std::size_t output_elements = 480;
+  std::vector<std::int16_t> input(input_elements);
+  for (std::size_t index = 0; index < input_elements; index++) {
+    input[index] = static_cast<std::int16_t>(10000 * std::sin(2 * std::numbers::pi * 440 * static_cast<double>(index) / 48000));
+  }
+  std::vector<std::int16_t> output(output_elements);
+  JitterBuffer::StretchPcm16(reinterpret_cast<const std::uint8_t *>(input.data()), input_elements, reinterpret_cast<std::uint8_t *>(output.data()), output_elements, sizeof(std::int16_t), nullptr);
+  CHECK_EQ(input.front(), output.front());
+  CHECK_EQ(input.back(), output.back());
+  int largest_step = 0;
+  for (std::size_t index = 1; index < output_elements; index++) {
+    largest_step = std::max(largest_step, std::abs(output[index] - output[index - 1]));
+  }
+  // The tone itself moves by at most about 576 a sample.
+  CHECK_LT(largest_step, 700);
+}
+
+#if !LIBJITTER_LINEAR_RING && defined(__linux__)
+TEST_CASE("libjitter::export_import") {
+  // Mono 16 bit, each packet holding its sequence number.
+  const std::size_t frames_per_packet = 480;
+  std::vector<std::int16_t> payload(frames_per_packet);
+  const auto enqueue = [&payload](JitterBuffer &buffer, const unsigned long sequence_number) {
+    std::fill(payload.begin(), payload.end(), static_cast<std::int16_t>(sequence_number));
+    const Packet packet = {.sequence_number = sequence_number, .data = payload.data(), .length = payload.size() * sizeof(std::int16_t), .elements = frames_per_packet};
+    return buffer.Enqueue(&packet, 1, [](Packet *concealment, const std::size_t num_packets, void *) {
+      for (std::size_t index = 0; index < num_packets; index++) {
+        memset(concealment[index].data, 0, concealment[index].length);
+      }
+    }, nullptr);
+  };
+  int sockets[2];
+  REQUIRE_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+
+  // Part read, with a gap still waiting on its packet.
+  auto exporter = std::make_unique<JitterBuffer>(sizeof(std::int16_t), frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  enqueue(*exporter, 1);
+  enqueue(*exporter, 2);
+  enqueue(*exporter, 4);
+  std::vector<std::int16_t> out(frames_per_packet);
+  const std::size_t out_bytes = out.size() * sizeof(std::int16_t);
+  REQUIRE_EQ(100, exporter->Dequeue(reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, 100));
+  exporter->Export(sockets[0]);
+  auto imported = JitterBuffer::Import(sockets[1], sizeof(std::int16_t), frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  exporter.reset();
+
+  // Carries straight on, and the late packet still finds its concealment.
+  CHECK_EQ(100 * sizeof(std::int16_t), imported->GetMetrics().dequeued_bytes);
+  CHECK_EQ(frames_per_packet, enqueue(*imported, 3));
+  CHECK_EQ(frames_per_packet, imported->GetMetrics().updated_frames);
+  CHECK_EQ(frames_per_packet, enqueue(*imported, 5));
+  CHECK_EQ(frames_per_packet, imported->GetMetrics().concealed_frames);
+  REQUIRE_EQ(frames_per_packet, imported->Dequeue(reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(1, out[379]);
+  CHECK_EQ(2, out[380]);
+  REQUIRE_EQ(frames_per_packet, imported->Dequeue(reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(2, out[379]);
+  CHECK_EQ(3, out[380]);
+  REQUIRE_EQ(frames_per_packet, imported->Dequeue(reinterpret_cast<std::uint8_t *>(out.data()), out_bytes, frames_per_packet));
+  CHECK_EQ(4, out[380]);
+  CHECK_EQ((100 + 3 * frames_per_packet) * sizeof(std::int16_t), imported->GetMetrics().dequeued_bytes);
+
+  // Only into a matching configuration.
+  imported->Export(sockets[0]);
+  CHECK_THROWS_AS(JitterBuffer::Import(sockets[1], 2 * sizeof(std::int16_t), frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger), const std::invalid_argument &);
+
+  // Not while a packet's being written in place.
+  REQUIRE_NE(nullptr, imported->Reserve(6));
+  CHECK_THROWS_AS(imported->Export(sockets[0]), const std::logic_error &);
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+TEST_CASE("libjitter::shared_process") {
+  // The writer hands its reader to another buffer, then writes from a child process.
+  const std::size_t frames_per_packet = 480;
+  int sockets[2];
+  REQUIRE_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  JitterBuffer writer(sizeof(std::int16_t), frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.shared = true});
+  writer.Export(sockets[0]);
+  auto reader = JitterBuffer::Import(sockets[1], sizeof(std::int16_t), frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.shared = true});
+  close(sockets[0]);
+  close(sockets[1]);
+
+  const std::uint32_t write_count = reader->GetWriteCount();
+  const pid_t child = fork();
+  REQUIRE_NE(-1, child);
+  if (child == 0) {
+    std::vector<std::int16_t> payload(frames_per_packet);
+    for (unsigned long sequence_number = 1; sequence_number <= 3; sequence_number++) {
+      std::fill(payload.begin(), payload.end(), static_cast<std::int16_t>(sequence_number));
+      const Packet packet = {.sequence_number = sequence_number, .data = payload.data(), .length = payload.size() * sizeof(std::int16_t), .elements = frames_per_packet};
+      writer.Enqueue(&packet, 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+    }
+    _exit(0);
+  }
+  CHECK(reader->WaitForWrite(write_count, milliseconds(5000)));
+  int status = 0;
+  REQUIRE_EQ(child, waitpid(child, &status, 0));
+  REQUIRE(WIFEXITED(status));
+  CHECK_EQ(0, WEXITSTATUS(status));
+
+  // Everything the child wrote is readable here, and reading it shows on the writer's side.
+  CHECK_EQ(milliseconds(30), reader->GetCurrentDepth());
+  std::vector<std::int16_t> out(3 * frames_per_packet);
+  REQUIRE_EQ(out.size(), reader->Dequeue(reinterpret_cast<std::uint8_t *>(out.data()), out.size() * sizeof(std::int16_t), out.size()));
+  CHECK_EQ(1, out[0]);
+  CHECK_EQ(2, out[frames_per_packet]);
+  CHECK_EQ(3, out[out.size() - 1]);
+  CHECK_EQ(milliseconds(0), writer.GetCurrentDepth());
+  CHECK_FALSE(reader->WaitForWrite(reader->GetWriteCount(), milliseconds(1)));
+
+  // Neither side could see the other arm an eventfd.
+  CHECK_THROWS_AS(reader->GetEventFd(), const std::logic_error &);
+  CHECK_THROWS_AS(writer.GetEventFd(), const std::logic_error &);
+}
+#endif
+
+TEST_CASE("libjitter::wait_for_elements") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  CHECK_FALSE(buffer.WaitForElements(frames_per_packet, milliseconds(1)));
+
+  // Woken by the writer rather than timing out.
+  Packet packet = makeTestPacket(1, frame_size, frames_per_packet);
+  std::thread writer([&buffer, &packet]() {
+    std::this_thread::sleep_for(milliseconds(20));
+    buffer.Enqueue(&packet, 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+  });
+  const auto start = steady_clock::now();
+  CHECK(buffer.WaitForElements(frames_per_packet, milliseconds(5000)));
+  CHECK_LT(steady_clock::now() - start, milliseconds(5000));
+  writer.join();
+  CHECK(buffer.WaitForElements(frames_per_packet, milliseconds(0)));
+  CHECK_FALSE(buffer.WaitForElements(2 * frames_per_packet, milliseconds(1)));
+  free(packet.data);
+}
+
+TEST_CASE("libjitter::wait_for_elements_while_playing") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+
+  // Playing but drained, so the next publish is the only wakeup.
+  std::vector<Packet> packets = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(2, frame_size, frames_per_packet)};
+  buffer.Enqueue(&packets[0], 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+  REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  REQUIRE_FALSE(buffer.HasElements(1));
+  std::thread writer([&buffer, &packets]() {
+    std::this_thread::sleep_for(milliseconds(20));
+    buffer.Enqueue(&packets[1], 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+  });
+  const auto start = steady_clock::now();
+  CHECK(buffer.WaitForElements(frames_per_packet, milliseconds(5000)));
+  CHECK_LT(steady_clock::now() - start, milliseconds(1000));
+  writer.join();
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+}
+
+#ifdef __linux__
+/// @brief Runs straight away and is never resumed once finished, enough to drive one await.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static Detached AwaitElements(JitterBuffer &buffer, const std::size_t elements, bool &done) {
+  co_await buffer.WaitForElementsAsync(elements);
+  done = true;
+}
+
+static Detached AwaitWithoutEventFd(JitterBuffer &buffer, bool &threw) {
+  try {
+    co_await buffer.WaitForElementsAsync(1);
+  } catch (const std::logic_error &) {
+    threw = true;
+  }
+}
+
+TEST_CASE("libjitter::wait_for_elements_async") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  bool threw = false;
+  AwaitWithoutEventFd(buffer, threw);
+  CHECK(threw);
+  bool done = false;
+  pollfd event = {.fd = buffer.GetEventFd(), .events = POLLIN, .revents = 0};
+
+  // Suspends with nothing there, and the fd stays quiet.
+  AwaitElements(buffer, 2 * frames_per_packet, done);
+  CHECK_FALSE(done);
+  CHECK_EQ(0, poll(&event, 1, 0));
+
+  // One packet signals, but isn't enough, so it's waited on again.
+  std::vector<Packet> packets = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(2, frame_size, frames_per_packet)};
+  buffer.Enqueue(&packets[0], 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+  REQUIRE_EQ(1, poll(&event, 1, 0));
+  buffer.OnEventFd();
+  CHECK_FALSE(done);
+  CHECK_EQ(0, poll(&event, 1, 0));
+  buffer.Enqueue(&packets[1], 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+  REQUIRE_EQ(1, poll(&event, 1, 0));
+  buffer.OnEventFd();
+  CHECK(done);
+
+  // Already there doesn't suspend at all.
+  done = false;
+  AwaitElements(buffer, frames_per_packet, done);
+  CHECK(done);
+
+  // Reset disarms, so the next stream's first packet doesn't signal for the last one.
+  buffer.Reset();
+  CHECK_FALSE(buffer.ArmEventFd(frames_per_packet));
+  buffer.Reset();
+  buffer.Enqueue(&packets[0], 1, [](Packet *, const std::size_t, void *) {}, nullptr);
+  CHECK_EQ(0, poll(&event, 1, 0));
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+}
+#endif
+
+TEST_CASE("libjitter::tap") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.clock = ClockMode::Manual, .taps = 1});
+  auto tap = JitterTap(buffer, milliseconds(20));
+  CHECK_THROWS_AS(JitterTap(buffer, milliseconds(20)), const std::runtime_error &);
+  const std::size_t packet_bytes = frames_per_packet * frame_size;
+  std::vector<std::uint8_t> destination(2 * packet_bytes);
+
+  // The tap sees the same packets as the reader, at its own pace, in pieces if it likes.
+  std::vector<Packet> packets = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(2, frame_size, frames_per_packet)};
+  buffer.Enqueue(packets.data(), packets.size(), [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  REQUIRE_EQ(2 * frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), 2 * frames_per_packet));
+  CHECK_EQ(0, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  std::fill(destination.begin(), destination.end(), 0);
+  CHECK_EQ(frames_per_packet / 2, tap.Dequeue(destination.data(), destination.size(), frames_per_packet / 2));
+  CHECK_EQ(3 * frames_per_packet / 2, tap.Dequeue(destination.data() + packet_bytes / 2, destination.size() - packet_bytes / 2, 3 * frames_per_packet / 2));
+  CHECK_EQ(0, memcmp(destination.data(), packets[0].data, packet_bytes));
+  CHECK_EQ(0, memcmp(destination.data() + packet_bytes, packets[1].data, packet_bytes));
+  CHECK_EQ(0, tap.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_THROWS_AS(tap.Dequeue(destination.data(), packet_bytes, 2 * frames_per_packet), const std::invalid_argument &);
+
+  // It expires packets on its own max_length, well within the buffer's.
+  Packet old = makeTestPacket(3, frame_size, frames_per_packet);
+  buffer.Enqueue(&old, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  buffer.SetTime(milliseconds(50));
+  CHECK_EQ(0, tap.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(frames_per_packet, tap.GetSkippedFrames());
+  CHECK_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+
+  // A stalled tap holds its space, so the writer runs out even though the reader keeps up.
+  const Metrics before = buffer.GetMetrics();
+  unsigned long sequence_number = 4;
+  for (; sequence_number < 1000 && buffer.GetMetrics().full_dropped_packets == 0; sequence_number++) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+    buffer.Dequeue(destination.data(), destination.size(), frames_per_packet);
+    free(packet.data);
+  }
+  REQUIRE_EQ(1, buffer.GetMetrics().full_dropped_packets - before.full_dropped_packets);
+  CHECK_FALSE(tap.IsDropped());
+  CHECK_EQ(0, buffer.GetMetrics().dropped_taps);
+
+  // Reading frees it again.
+  while (tap.Dequeue(destination.data(), destination.size(), 2 * frames_per_packet) > 0) {
+  }
+  Packet after = makeTestPacket(sequence_number - 1, frame_size, frames_per_packet);
+  CHECK_EQ(frames_per_packet, buffer.Enqueue(&after, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(frames_per_packet, tap.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), after.data, packet_bytes));
+  free(after.data);
+  free(old.data);
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+}
+
+TEST_CASE("libjitter::tap_dropped") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.clock = ClockMode::Manual, .taps = 2});
+  auto stalled = JitterTap(buffer, milliseconds(100), true);
+  auto keeping_up = JitterTap(buffer, milliseconds(100), true);
+  const std::size_t packet_bytes = frames_per_packet * frame_size;
+  std::vector<std::uint8_t> destination(packet_bytes);
+
+  // A droppable tap that stalls is let go rather than losing packets, while one keeping up carries on.
+  unsigned long sequence_number = 1;
+  for (; sequence_number < 1000 && !stalled.IsDropped(); sequence_number++) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    REQUIRE_EQ(frames_per_packet, buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+    REQUIRE_EQ(frames_per_packet, keeping_up.Dequeue(destination.data(), destination.size(), frames_per_packet));
+    CHECK_EQ(0, memcmp(destination.data(), packet.data, packet_bytes));
+    free(packet.data);
+  }
+  REQUIRE(stalled.IsDropped());
+  CHECK_FALSE(keeping_up.IsDropped());
+  CHECK_EQ(0, buffer.GetMetrics().full_dropped_packets);
+  CHECK_EQ(1, buffer.GetMetrics().dropped_taps);
+  CHECK_EQ(0, stalled.Dequeue(destination.data(), destination.size(), frames_per_packet));
+
+  // Rejoining picks up from the next write.
+  stalled.Rejoin();
+  CHECK_FALSE(stalled.IsDropped());
+  CHECK_EQ(0, stalled.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+  buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+  REQUIRE_EQ(frames_per_packet, stalled.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(destination.data(), packet.data, packet_bytes));
+  free(packet.data);
+
+  // When the reader is as far behind, dropping the taps wouldn't make room, so they're kept.
+  const Metrics before = buffer.GetMetrics();
+  for (sequence_number++; sequence_number < 2000 && buffer.GetMetrics().full_dropped_packets == before.full_dropped_packets; sequence_number++) {
+    Packet full = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    buffer.Enqueue(&full, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr);
+    free(full.data);
+  }
+  CHECK_EQ(1, buffer.GetMetrics().full_dropped_packets - before.full_dropped_packets);
+  CHECK_FALSE(stalled.IsDropped());
+  CHECK_FALSE(keeping_up.IsDropped());
+  CHECK_EQ(1, buffer.GetMetrics().dropped_taps);
+}
+
+TEST_CASE("libjitter::tap_threaded") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.clock = ClockMode::Manual, .taps = 1});
+  auto tap = JitterTap(buffer, milliseconds(100));
+  const unsigned long packets = 500;
+
+  // The writer waits on the tap when it's full, so the tap sees every packet, in order.
+  std::thread writer([&buffer, frames_per_packet]() {
+    std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+    for (unsigned long sequence_number = 1; sequence_number <= packets; sequence_number++) {
+      Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+      while (buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) {}, nullptr) == 0) {
+        std::this_thread::yield();
+      }
+      buffer.Dequeue(destination.data(), destination.size(), frames_per_packet);
+      free(packet.data);
+    }
+  });
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  unsigned long read = 0;
+  while (read < packets * frames_per_packet) {
+    const std::size_t dequeued = tap.Dequeue(destination.data(), destination.size(), frames_per_packet / 3);
+    for (std::size_t index = 0; index < dequeued; index++) {
+      const unsigned long expected = ((read + index) / frames_per_packet + 1) & 0xFF;
+      REQUIRE_EQ(expected, destination[index * frame_size]);
+    }
+    read += dequeued;
+    if (dequeued == 0) {
+      std::this_thread::yield();
+    }
+  }
+  writer.join();
+  CHECK_FALSE(tap.IsDropped());
+}
+
+TEST_CASE("libjitter::fixed_shape") {
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  const JitterBufferOptions options = {.clock = ClockMode::Manual, .packets = PacketMode::Variable};
+  auto fixed = JitterBufferT<frame_size, frames_per_packet>(48000, milliseconds(100), milliseconds(0), logger, options);
+  auto runtime = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, options);
+  JitterBuffer &through_base = fixed;
+  CHECK_EQ(runtime.GetMappedSize(), through_base.GetMappedSize());
+
+  // Full packets, a gap, a short packet and a late update all come out as they do from the runtime shape.
+  std::vector<Packet> packets = {makeTestPacket(1, frame_size, frames_per_packet), makeTestPacket(3, frame_size, frames_per_packet),
+                                 makeTestPacket(4, frame_size, frames_per_packet / 2), makeTestPacket(2, frame_size, frames_per_packet)};
+  const auto conceal = [](Packet *concealment, const std::size_t num_packets, void *) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      memset(concealment[index].data, 0xCC, concealment[index].length);
+    }
+  };
+  CHECK_EQ(runtime.Enqueue(packets.data(), 3, conceal, nullptr), fixed.EnqueueFixed(packets.data(), 3, conceal, nullptr));
+  std::vector<std::uint8_t> expected(2 * frames_per_packet * frame_size);
+  std::vector<std::uint8_t> actual(expected.size());
+  for (const std::size_t elements : {frames_per_packet, frames_per_packet / 3, frames_per_packet}) {
+    CHECK_EQ(runtime.Dequeue(expected.data(), expected.size(), elements), fixed.DequeueFixed(actual.data(), actual.size(), elements));
+    CHECK_EQ(0, memcmp(expected.data(), actual.data(), elements * frame_size));
+    if (elements == frames_per_packet / 3) {
+      CHECK_EQ(runtime.Enqueue(&packets[3], 1, conceal, nullptr), fixed.EnqueueFixed(&packets[3], 1, conceal, nullptr));
+    }
+  }
+  CHECK_EQ(runtime.Dequeue(expected.data(), expected.size(), 2 * frames_per_packet), fixed.DequeueFixed(actual.data(), actual.size(), 2 * frames_per_packet));
+  CHECK_EQ(0, memcmp(expected.data(), actual.data(), expected.size()));
+  const Metrics runtime_metrics = runtime.GetMetrics();
+  const Metrics fixed_metrics = fixed.GetMetrics();
+  CHECK_EQ(runtime_metrics.concealed_frames, fixed_metrics.concealed_frames);
+  CHECK_EQ(runtime_metrics.updated_frames, fixed_metrics.updated_frames);
+  CHECK_EQ(runtime_metrics.enqueued_bytes, fixed_metrics.enqueued_bytes);
+  CHECK_EQ(runtime_metrics.dequeued_bytes, fixed_metrics.dequeued_bytes);
+  CHECK_EQ(runtime_metrics.underruns, fixed_metrics.underruns);
+  CHECK_THROWS_AS(fixed.DequeueFixed(actual.data(), frame_size, 2), const std::invalid_argument &);
+
+  // The generic calls aren't hidden, so they behave the same through either type.
+  Packet next = makeTestPacket(5, frame_size, frames_per_packet);
+  CHECK_EQ(frames_per_packet, fixed.Enqueue(&next, 1, conceal, nullptr));
+  CHECK_EQ(frames_per_packet, through_base.Dequeue(actual.data(), actual.size(), frames_per_packet));
+  CHECK_EQ(0, memcmp(next.data, actual.data(), next.length));
+  free(next.data);
+  for (Packet &packet : packets) {
+    free(packet.data);
+  }
+}
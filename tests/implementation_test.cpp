@@ -239,6 +239,48 @@ TEST_CASE("libjitter_implementation::update_existing_partial_read") {
   }
 }
 
+TEST_CASE("libjitter_implementation::update_reordered") {
+  // Push 1 and 20 to conceal 2-19, then update them out of order.
+  const std::size_t frame_size = 2 * 2;
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(1000), milliseconds(0), logger);
+  Packet first = makeTestPacket(1, frame_size, frames_per_packet);
+  Packet last = makeTestPacket(20, frame_size, frames_per_packet);
+  const std::size_t enqueued = buffer.Enqueue(std::vector<Packet>{first, last}, [](std::vector<Packet> &packets) {
+    for (Packet &packet: packets) {
+      memset(packet.data, 0, packet.length);
+    }
+  });
+  CHECK_EQ(enqueued, 20 * frames_per_packet);
+
+  // Partially read packet 1, it shouldn't matter to the updates.
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  REQUIRE_EQ(frames_per_packet / 2, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet / 2));
+
+  const unsigned long order[] = {19, 2, 10, 3, 18, 11, 4, 17, 5, 16, 6, 15, 7, 14, 8, 13, 9, 12};
+  std::vector<Packet> updates;
+  for (const unsigned long sequence_number: order) {
+    Packet update = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    CHECK_EQ(frames_per_packet, buffer.Enqueue(std::vector<Packet>{update}, [](const std::vector<Packet> &) {
+      FAIL("Unexpected concealment");
+    }));
+    updates.push_back(update);
+  }
+  for (const Packet &update: updates) {
+    CHECK(checkPacketInSlot(&buffer, update, update.sequence_number - 1));
+  }
+  CHECK_EQ(buffer.GetMetrics().updated_frames, 18 * frames_per_packet);
+  CHECK_EQ(buffer.GetMetrics().update_missed_frames, 0);
+
+  // A duplicate of real data is not an update.
+  CHECK_EQ(0, buffer.Enqueue(std::vector<Packet>{updates[0]}, [](const std::vector<Packet> &) {}));
+  for (const Packet &update: updates) {
+    free(update.data);
+  }
+  free(first.data);
+  free(last.data);
+}
+
 TEST_CASE("libjitter_implementation::checkPacketInSlot") {
   // Push 1 and 3 to generate 2, then update 2.
   const std::size_t frame_size = 2 * 2;
@@ -299,4 +341,68 @@ TEST_CASE("libjitter_implementation::run") {
 
   enqueue.join();
   dequeue.join();
-}
\ No newline at end of file
+}
+
+TEST_CASE("libjitter_implementation::wrap") {
+  const std::size_t frame_size = sizeof(int);
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger);
+  auto inspector = BufferInspector(&buffer);
+  const std::size_t record_bytes = frames_per_packet * frame_size + JitterBuffer::METADATA_SIZE;
+
+  // Offsets come back around past the end of the ring, landing where the total written says.
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  const std::size_t packets = 3 * buffer.GetMappedSize() / record_bytes;
+  for (std::size_t sequence_number = 1; sequence_number <= packets; sequence_number++) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    REQUIRE_EQ(frames_per_packet, buffer.Enqueue(&packet, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+    CHECK_EQ(0, memcmp(destination.data(), packet.data, destination.size()));
+    free(packet.data);
+    REQUIRE_EQ(sequence_number * record_bytes % buffer.GetMappedSize(), inspector.GetWriteOffset());
+    REQUIRE_EQ(inspector.GetWriteOffset(), inspector.GetReadOffset());
+  }
+  CHECK_EQ(0, inspector.GetWritten());
+}
+
+TEST_CASE("libjitter_implementation::update_after_wrap") {
+  // 2048 byte records tile the ring exactly, so a record written a ring later lands on the same offset.
+  const std::size_t frame_size = sizeof(int);
+  const std::size_t frames_per_packet = 480;
+  auto buffer = JitterBuffer(frame_size, frames_per_packet, 48000, milliseconds(100), milliseconds(0), logger, {.sizing = SizingMode::PerPacket, .payload_alignment = 128});
+  REQUIRE_EQ(10 * 2048, buffer.GetMappedSize());
+  const auto conceal = [](Packet *concealment, const std::size_t num_packets, void *) {
+    for (std::size_t index = 0; index < num_packets; index++) {
+      memset(concealment[index].data, 0, concealment[index].length);
+    }
+  };
+
+  // Conceal 2, and read past it.
+  std::vector<std::uint8_t> destination(frames_per_packet * frame_size);
+  for (const unsigned long sequence_number : {1ul, 3ul}) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    buffer.Enqueue(&packet, 1, conceal, nullptr);
+    free(packet.data);
+  }
+  for (int read = 0; read < 3; read++) {
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  }
+
+  // Fill the ring, concealing 12 where 2 was.
+  for (const unsigned long sequence_number : {4ul, 5ul, 6ul, 7ul, 8ul, 9ul, 10ul, 11ul, 13ul}) {
+    Packet packet = makeTestPacket(sequence_number, frame_size, frames_per_packet);
+    REQUIRE_EQ(sequence_number == 13 ? 2 * frames_per_packet : frames_per_packet, buffer.Enqueue(&packet, 1, conceal, nullptr));
+    free(packet.data);
+  }
+
+  // Late 2 was already played, and mustn't land in 12's concealment.
+  Packet late = makeTestPacket(2, frame_size, frames_per_packet);
+  CHECK_EQ(0, buffer.Enqueue(&late, 1, [](Packet *, std::size_t, void *) { FAIL("Unexpected concealment"); }, nullptr));
+  CHECK_EQ(frames_per_packet, buffer.GetMetrics().update_missed_frames);
+  free(late.data);
+  for (unsigned long sequence_number = 4; sequence_number <= 12; sequence_number++) {
+    REQUIRE_EQ(frames_per_packet, buffer.Dequeue(destination.data(), destination.size(), frames_per_packet));
+  }
+  CHECK_EQ(0, destination[0]);
+  CHECK_EQ(0, destination[destination.size() - 1]);
+}